@@ -15,11 +15,14 @@ namespace math
         AABB();
         AABB(const Vector<T, Dimension>& pMin, const Vector<T, Dimension>& pMax);
 
-        Vector<T, Dimension> min() const;
-        Vector<T, Dimension> max() const;
+        const Vector<T, Dimension>& min() const;
+        const Vector<T, Dimension>& max() const;
 
         AABB<T, Dimension> box_union(const AABB<T, Dimension>& other) const;
         AABB<T, Dimension> box_union(const Vector<T, Dimension>& other) const;
+        AABB<T, Dimension> box_intersection(const AABB<T, Dimension>& other) const;
+
+        bool isValid() const;
 
         uint32_t maximumExtent() const;
         T        surfaceArea()   const;
@@ -54,6 +57,11 @@ namespace math
         return b.box_union(v);
     }
 
+    template <typename T, int Dimension>
+    inline AABB<T, Dimension> box_intersection(const AABB<T, Dimension>& b1, const AABB<T, Dimension>& b2) {
+        return b1.box_intersection(b2);
+    }
+
     template <typename T, int Dimension>
     AABB<T, Dimension>::AABB()
         : mMin(static_cast<T>(kInfinity))
@@ -63,47 +71,50 @@ namespace math
 
     template <typename T, int Dimension>
     AABB<T, Dimension>::AABB(const Vector<T, Dimension>& p1, const Vector<T, Dimension>& p2)
+        : mMin(p1.min(p2))
+        , mMax(p1.max(p2))
     {
-        for (int i = 0; i < Dimension; ++i) {
-            mMin[i] = std::min(p1[i], p2[i]);
-            mMax[i] = std::max(p1[i], p2[i]);
-        }
     }
 
     template <typename T, int Dimension>
-    Vector<T, Dimension> AABB<T, Dimension>::min() const {
+    const Vector<T, Dimension>& AABB<T, Dimension>::min() const {
         return mMin;
     }
 
     template <typename T, int Dimension>
-    Vector<T, Dimension> AABB<T, Dimension>::max() const {
+    const Vector<T, Dimension>& AABB<T, Dimension>::max() const {
         return mMax;
     }
 
     template <typename T, int Dimension>
     AABB<T, Dimension> AABB<T, Dimension>::box_union(const AABB<T, Dimension>& other) const {
-        Vector<T, Dimension> pMin;
-        Vector<T, Dimension> pMax;
-
-        for (int i = 0; i < Dimension; ++i) {
-            pMin[i] = std::min(mMin[i], other.min()[i]);
-            pMax[i] = std::max(mMax[i], other.max()[i]);
-        }
-
-        return AABB(pMin, pMax);
+        return AABB(mMin.min(other.mMin), mMax.max(other.mMax));
     }
 
     template <typename T, int Dimension>
     AABB<T, Dimension> AABB<T, Dimension>::box_union(const Vector<T, Dimension>& other) const {
-        Vector<T, Dimension> pMin;
-        Vector<T, Dimension> pMax;
+        return AABB(mMin.min(other), mMax.max(other));
+    }
+
+    template <typename T, int Dimension>
+    AABB<T, Dimension> AABB<T, Dimension>::box_intersection(const AABB<T, Dimension>& other) const {
+        /// Not built through the two point constructor, which would reorder an empty result
+        AABB<T, Dimension> result;
+
+        result.mMin = mMin.max(other.mMin);
+        result.mMax = mMax.min(other.mMax);
+        return result;
+    }
 
+    template <typename T, int Dimension>
+    bool AABB<T, Dimension>::isValid() const {
         for (int i = 0; i < Dimension; ++i) {
-            pMin[i] = std::min(mMin[i], other[i]);
-            pMax[i] = std::max(mMax[i], other[i]);
+            if (mMin[i] > mMax[i]) {
+                return false;
+            }
         }
 
-        return AABB(pMin, pMax);
+        return true;
     }
 
     template <typename T, int Dimension>
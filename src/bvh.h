@@ -2,9 +2,31 @@
 
 #include "aggregate.h"
 #include "memory.h"
-
+#include "primitivegroup.h"
+#include "raypacket.h"
+#include "threadpool.h"
+#include "util.h"
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
 #include <vector>
 #include <functional>
+#include <limits>
+#include <mutex>
+#include <queue>
+
+/// Define MCP_BVH_STATS to count nodes, boxes and shapes visited by every traversal
+#if defined(MCP_BVH_STATS)
+#define MCP_BVH_STAT(statement) statement
+#else
+#define MCP_BVH_STAT(statement)
+#endif
 
 namespace mcp
 {
@@ -12,13 +34,49 @@ namespace accelerator
 {
     using namespace math;
 
-    static inline bool intersectBox(const AABB3f& bounds, const Ray3f& ray, const Vector3f& invDir,
-                                    const uint32_t dirIsNeg[3], float tMin, float tMax)
+    /// Far slab distances are scaled by 1 + 2 * gamma(3) to cover the rounding of the
+    /// subtraction and the multiplication (Ize 2013). Without it a ray through an edge
+    /// shared by two leaves, which lies on a face of both boxes, can miss both of them.
+    static const float kBoxFarScale = 1.f + 2.f * (3.f * FLT_EPSILON * 0.5f) / (1.f - 3.f * FLT_EPSILON * 0.5f);
+
+    /// A ray with the per-ray constants of a traversal, built once and passed by reference
+    /// through the node and leaf kernels instead of being recomputed by each of them.
+    /// Closest hit traversals shrink tMax to the distance of the closest hit so far.
+    struct TraversalRay {
+        TraversalRay() {}
+        TraversalRay(const Ray3f& ray, float tMin, float tMax);
+
+        Ray3f    ray;
+        Vector3f invDir;
+        uint32_t dirIsNeg[3];
+        /// Setup of the watertight triangle test of packed leaves
+        RayShear shear;
+        float    tMin;
+        float    tMax;
+    };
+
+    inline TraversalRay::TraversalRay(const Ray3f& ray, float tMin, float tMax)
+        : ray(ray)
+        , invDir(ray.direction().rcp())
+        , shear(ray)
+        , tMin(tMin)
+        , tMax(tMax)
     {
-        float txMin = (bounds[    dirIsNeg[0]].x() - ray.origin().x()) * invDir.x();
-        float txMax = (bounds[1 - dirIsNeg[0]].x() - ray.origin().x()) * invDir.x();
-        float tyMin = (bounds[    dirIsNeg[1]].y() - ray.origin().y()) * invDir.y();
-        float tyMax = (bounds[1 - dirIsNeg[1]].y() - ray.origin().y()) * invDir.y();
+        dirIsNeg[0] = invDir.x() < 0.f;
+        dirIsNeg[1] = invDir.y() < 0.f;
+        dirIsNeg[2] = invDir.z() < 0.f;
+    }
+
+    static inline bool intersectBox(const AABB3f& bounds, const TraversalRay& ray)
+    {
+        const Vector3f& origin   = ray.ray.origin();
+        const Vector3f& invDir   = ray.invDir;
+        const uint32_t* dirIsNeg = ray.dirIsNeg;
+
+        float txMin = (bounds[    dirIsNeg[0]].x() - origin.x()) * invDir.x();
+        float txMax = (bounds[1 - dirIsNeg[0]].x() - origin.x()) * invDir.x() * kBoxFarScale;
+        float tyMin = (bounds[    dirIsNeg[1]].y() - origin.y()) * invDir.y();
+        float tyMax = (bounds[1 - dirIsNeg[1]].y() - origin.y()) * invDir.y() * kBoxFarScale;
 
         if ((txMin > tyMax) || (tyMin > txMax)) {
             return false;
@@ -27,8 +85,8 @@ namespace accelerator
         if (tyMin > txMin) txMin = tyMin;
         if (tyMax < txMax) txMax = tyMax;
 
-        float tzMin = (bounds[    dirIsNeg[2]].z() - ray.origin().z()) * invDir.z();
-        float tzMax = (bounds[1 - dirIsNeg[2]].z() - ray.origin().z()) * invDir.z();
+        float tzMin = (bounds[    dirIsNeg[2]].z() - origin.z()) * invDir.z();
+        float tzMax = (bounds[1 - dirIsNeg[2]].z() - origin.z()) * invDir.z() * kBoxFarScale;
 
         if ((txMin > tzMax) || (tzMin > txMax)) {
             return false;
@@ -37,7 +95,241 @@ namespace accelerator
         if (tzMin > txMin) txMin = tzMin;
         if (tzMax < txMax) txMax = tzMax;
 
-        return (txMin < tMax) && (txMax > tMin);
+        return (txMin < ray.tMax) && (txMax > ray.tMin);
+    }
+
+    /// Per-packet constants of the packet traversal. When the directions of the active
+    /// rays agree in sign on every axis, intervals bounding their origins and reciprocal
+    /// directions give a conservative test of the whole packet against a box, which
+    /// lets the traversal skip boxes no ray of the packet can enter.
+    template <uint32_t Size>
+    struct alignas(32) PacketRayData {
+        PacketRayData(const RayPacket<Size>& packet, bool cullFrustum);
+
+        /// Moves the far end of the frustum to the largest tMax of the active rays
+        void updateRange(const RayPacket<Size>& packet);
+        /// True when no ray inside the frustum can enter bounds
+        bool frustumMisses(const AABB3f& bounds) const;
+
+        float    invDir[3][Size];
+        /// invDir scaled by kBoxFarScale
+        float    farInvDir[3][Size];
+        /// All bits set in lanes whose direction is negative along the axis
+        uint32_t dirIsNeg[3][Size];
+
+        bool     frustum;
+        uint32_t frustumDirIsNeg[3];
+        float    originMin[3];
+        float    originMax[3];
+        float    invDirMin[3];
+        float    invDirMax[3];
+        float    farInvDirMin[3];
+        float    farInvDirMax[3];
+        float    tMin;
+        float    tMax;
+    };
+
+    template <uint32_t Size>
+    PacketRayData<Size>::PacketRayData(const RayPacket<Size>& packet, bool cullFrustum)
+        : frustum(cullFrustum && packet.active)
+        , tMin(kInfinity)
+        , tMax(-kInfinity)
+    {
+        for (uint32_t axis = 0; axis < 3; ++axis) {
+            for (uint32_t lane = 0; lane < Size; ++lane) {
+                invDir[axis][lane]    = 1.f / packet.direction[axis][lane];
+                farInvDir[axis][lane] = invDir[axis][lane] * kBoxFarScale;
+                dirIsNeg[axis][lane]  = invDir[axis][lane] < 0.f ? 0xFFFFFFFF : 0;
+            }
+        }
+
+        if (!frustum) {
+            return;
+        }
+
+        const uint32_t first = countTrailingZeros(packet.active);
+        for (uint32_t axis = 0; axis < 3; ++axis) {
+            frustumDirIsNeg[axis] = dirIsNeg[axis][first] & 1;
+            originMin[axis]    = kInfinity;
+            originMax[axis]    = -kInfinity;
+            invDirMin[axis]    = kInfinity;
+            invDirMax[axis]    = -kInfinity;
+            farInvDirMin[axis] = kInfinity;
+            farInvDirMax[axis] = -kInfinity;
+        }
+
+        for (uint32_t active = packet.active; active; active &= active - 1) {
+            const uint32_t lane = countTrailingZeros(active);
+
+            for (uint32_t axis = 0; axis < 3; ++axis) {
+                /// Axis-parallel rays make the products of the intervals undefined
+                const float inv = invDir[axis][lane];
+                if ((dirIsNeg[axis][lane] & 1) != frustumDirIsNeg[axis] || inv == 0.f || std::isinf(inv)) {
+                    frustum = false;
+                    return;
+                }
+
+                originMin[axis]    = std::min(originMin[axis],    packet.origin[axis][lane]);
+                originMax[axis]    = std::max(originMax[axis],    packet.origin[axis][lane]);
+                invDirMin[axis]    = std::min(invDirMin[axis],    inv);
+                invDirMax[axis]    = std::max(invDirMax[axis],    inv);
+                farInvDirMin[axis] = std::min(farInvDirMin[axis], farInvDir[axis][lane]);
+                farInvDirMax[axis] = std::max(farInvDirMax[axis], farInvDir[axis][lane]);
+            }
+
+            tMin = std::min(tMin, packet.tMin[lane]);
+        }
+
+        updateRange(packet);
+    }
+
+    template <uint32_t Size>
+    void PacketRayData<Size>::updateRange(const RayPacket<Size>& packet) {
+        tMax = -kInfinity;
+        for (uint32_t active = packet.active; active; active &= active - 1) {
+            tMax = std::max(tMax, packet.tMax[countTrailingZeros(active)]);
+        }
+    }
+
+    template <uint32_t Size>
+    bool PacketRayData<Size>::frustumMisses(const AABB3f& bounds) const {
+        /// Rounding is monotonic, so the products of the interval ends bound the slab
+        /// distances every ray of the packet computes
+        float tNear = tMin;
+        float tFar  = tMax;
+
+        for (uint32_t axis = 0; axis < 3; ++axis) {
+            const float nearB = bounds[    frustumDirIsNeg[axis]][axis];
+            const float farB  = bounds[1 - frustumDirIsNeg[axis]][axis];
+
+            const float near0 = (nearB - originMax[axis]) * invDirMin[axis];
+            const float near1 = (nearB - originMax[axis]) * invDirMax[axis];
+            const float near2 = (nearB - originMin[axis]) * invDirMin[axis];
+            const float near3 = (nearB - originMin[axis]) * invDirMax[axis];
+            tNear = std::max(tNear, std::min(std::min(near0, near1), std::min(near2, near3)));
+
+            const float far0 = (farB - originMax[axis]) * farInvDirMin[axis];
+            const float far1 = (farB - originMax[axis]) * farInvDirMax[axis];
+            const float far2 = (farB - originMin[axis]) * farInvDirMin[axis];
+            const float far3 = (farB - originMin[axis]) * farInvDirMax[axis];
+            tFar = std::min(tFar, std::max(std::max(far0, far1), std::max(far2, far3)));
+        }
+
+        return tNear > tFar;
+    }
+
+    /// Rays of the packet in mask that enter bounds, the slab test of WideBVH with rays
+    /// instead of boxes in the lanes
+    template <uint32_t Size>
+    static inline uint32_t intersectPacketBox(const AABB3f& bounds, const RayPacket<Size>& packet,
+                                              const PacketRayData<Size>& rayData, uint32_t mask)
+    {
+        uint32_t hits = 0;
+
+#if defined(MCP_AVX)
+        if (Size % 8 == 0) {
+            for (uint32_t lane = 0; lane < Size; lane += 8) {
+                if (!((mask >> lane) & 0xFF)) {
+                    continue;
+                }
+
+                __m256 t0 = _mm256_loadu_ps(packet.tMin + lane);
+                __m256 t1 = _mm256_loadu_ps(packet.tMax + lane);
+
+                for (uint32_t axis = 0; axis < 3; ++axis) {
+                    const __m256 origin = _mm256_loadu_ps(packet.origin[axis] + lane);
+                    const __m256 isNeg  = _mm256_loadu_ps(reinterpret_cast<const float*>(rayData.dirIsNeg[axis] + lane));
+                    const __m256 minB   = _mm256_set1_ps(bounds[0][axis]);
+                    const __m256 maxB   = _mm256_set1_ps(bounds[1][axis]);
+                    const __m256 nearB  = _mm256_blendv_ps(minB, maxB, isNeg);
+                    const __m256 farB   = _mm256_blendv_ps(maxB, minB, isNeg);
+
+                    t0 = _mm256_max_ps(t0, _mm256_mul_ps(_mm256_sub_ps(nearB, origin), _mm256_loadu_ps(rayData.invDir[axis] + lane)));
+                    t1 = _mm256_min_ps(t1, _mm256_mul_ps(_mm256_sub_ps(farB,  origin), _mm256_loadu_ps(rayData.farInvDir[axis] + lane)));
+                }
+
+                hits |= static_cast<uint32_t>(_mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ))) << lane;
+            }
+
+            return hits & mask;
+        }
+#endif
+
+#if defined(MCP_SSE)
+        for (uint32_t lane = 0; lane < Size; lane += 4) {
+            if (!((mask >> lane) & 0xF)) {
+                continue;
+            }
+
+            __m128 t0 = _mm_loadu_ps(packet.tMin + lane);
+            __m128 t1 = _mm_loadu_ps(packet.tMax + lane);
+
+            for (uint32_t axis = 0; axis < 3; ++axis) {
+                const __m128 origin = _mm_loadu_ps(packet.origin[axis] + lane);
+                const __m128 isNeg  = _mm_loadu_ps(reinterpret_cast<const float*>(rayData.dirIsNeg[axis] + lane));
+                const __m128 minB   = _mm_set1_ps(bounds[0][axis]);
+                const __m128 maxB   = _mm_set1_ps(bounds[1][axis]);
+                const __m128 nearB  = _mm_or_ps(_mm_and_ps(isNeg, maxB), _mm_andnot_ps(isNeg, minB));
+                const __m128 farB   = _mm_or_ps(_mm_and_ps(isNeg, minB), _mm_andnot_ps(isNeg, maxB));
+
+                t0 = _mm_max_ps(t0, _mm_mul_ps(_mm_sub_ps(nearB, origin), _mm_loadu_ps(rayData.invDir[axis] + lane)));
+                t1 = _mm_min_ps(t1, _mm_mul_ps(_mm_sub_ps(farB,  origin), _mm_loadu_ps(rayData.farInvDir[axis] + lane)));
+            }
+
+            hits |= static_cast<uint32_t>(_mm_movemask_ps(_mm_cmple_ps(t0, t1))) << lane;
+        }
+#else
+        for (uint32_t lane = 0; lane < Size; ++lane) {
+            float t0 = packet.tMin[lane];
+            float t1 = packet.tMax[lane];
+
+            for (uint32_t axis = 0; axis < 3; ++axis) {
+                const uint32_t isNeg = rayData.dirIsNeg[axis][lane] & 1;
+                const float    nearT = (bounds[    isNeg][axis] - packet.origin[axis][lane]) * rayData.invDir[axis][lane];
+                const float    farT  = (bounds[1 - isNeg][axis] - packet.origin[axis][lane]) * rayData.farInvDir[axis][lane];
+                t0 = std::max(t0, nearT);
+                t1 = std::min(t1, farT);
+            }
+
+            hits |= static_cast<uint32_t>(t0 <= t1) << lane;
+        }
+#endif
+
+        return hits & mask;
+    }
+
+    /// Spreads the low 10 bits of x so that two zero bits separate each of them
+    static inline uint32_t leftShift3(uint32_t x) {
+        if (x == (1u << 10)) --x;
+        x = (x | (x << 16)) & 0x030000FF;
+        x = (x | (x <<  8)) & 0x0300F00F;
+        x = (x | (x <<  4)) & 0x030C30C3;
+        x = (x | (x <<  2)) & 0x09249249;
+        return x;
+    }
+
+    /// Spreads the low 21 bits of x so that two zero bits separate each of them
+    static inline uint64_t leftShift3(uint64_t x) {
+        if (x == (1ull << 21)) --x;
+        x = (x | (x << 32)) & 0x001F00000000FFFFull;
+        x = (x | (x << 16)) & 0x001F0000FF0000FFull;
+        x = (x | (x <<  8)) & 0x100F00F00F00F00Full;
+        x = (x | (x <<  4)) & 0x10C30C30C30C30C3ull;
+        x = (x | (x <<  2)) & 0x1249249249249249ull;
+        return x;
+    }
+
+    /// Interleaves the bits of a point quantized to [0, 2^bitsPerAxis]^3, x taking the lowest bit
+    static inline uint64_t encodeMorton3(const Vector3f& v, uint32_t bitsPerAxis) {
+        if (bitsPerAxis <= 10) {
+            return (leftShift3(static_cast<uint32_t>(v.z())) << 2) |
+                   (leftShift3(static_cast<uint32_t>(v.y())) << 1) |
+                    leftShift3(static_cast<uint32_t>(v.x()));
+        }
+
+        return (leftShift3(static_cast<uint64_t>(v.z())) << 2) |
+               (leftShift3(static_cast<uint64_t>(v.y())) << 1) |
+                leftShift3(static_cast<uint64_t>(v.x()));
     }
 
     class BVH : public Aggregate
@@ -46,28 +338,226 @@ namespace accelerator
         enum BuildMethod {
             eMIDDLE,
             eEQUAL_COUNT,
-            eSAH
+            eSAH,
+            eLBVH,
+            eHLBVH,
+            eSBVH
+        };
+
+        struct BuildOptions {
+            BuildOptions()
+                : numBuckets(12)
+                , traversalCost(0.125f)
+                , intersectionCost(1.f)
+                , evaluateAllAxes(true)
+                , mortonBits(30)
+                , treeletBits(12)
+                , spatialSplitAlpha(1e-5f)
+                , duplicationBudget(0.3f)
+                , cachePath()
+                , cacheData(nullptr)
+                , cacheSize(0)
+                , compactShapes(false)
+                , optimizationBudget(0.f)
+                , packLeaves(true)
+            {
+            }
+
+            /// Number of centroid bins per axis used by eSAH
+            uint32_t numBuckets;
+            /// SAH cost of visiting an interior node, relative to intersectionCost
+            float    traversalCost;
+            /// SAH cost of testing a single shape
+            float    intersectionCost;
+            /// Bin all three axes instead of only the one of largest centroid extent
+            bool     evaluateAllAxes;
+            /// Morton code length used by eLBVH and eHLBVH, either 30 or 63
+            uint32_t mortonBits;
+            /// eHLBVH groups shapes sharing this many leading Morton bits into
+            /// treelets, builds those as LBVHs and joins them with an SAH build
+            uint32_t treeletBits;
+            /// eSBVH only tries spatial splits where the children of the best object split
+            /// overlap by more than this fraction of the root surface area
+            float    spatialSplitAlpha;
+            /// eSBVH stops splitting references once their count exceeds the shape count
+            /// by this fraction
+            float    duplicationBudget;
+            /// When set, the flattened tree is loaded from this file if it was written for
+            /// the same geometry and options, and written to it after building otherwise
+            std::string cachePath;
+            /// Same as cachePath for a cache already in memory, e.g. a BVH stored in a mapped
+            /// scene file. The nodes are used in place, so the memory has to outlive the BVH
+            /// and be writable if it gets refitted. Nothing is written back when it's stale.
+            uint8_t*    cacheData;
+            size_t      cacheSize;
+            /// Copy the shapes into one block in leaf order so that leaves are tested walking
+            /// memory forward. The tree then refers to its own copies: later changes to the
+            /// original shapes, e.g. before a refit, are not seen. Shapes that cannot be relocated,
+            /// such as other BVHs, are still referenced in place.
+            bool     compactShapes;
+            /// Seconds spent after the build lowering the SAH cost by taking out subtrees and
+            /// reinserting them where they add the least surface area. Stops earlier once a
+            /// round of reinsertions no longer improves the tree, 0 disables it.
+            /// Worth it mostly for eMIDDLE, eEQUAL_COUNT and the Morton builds.
+            float    optimizationBudget;
+            /// Store the triangles and spheres of leaves with at least kMinPackedLeafShapes
+            /// shapes as SoA groups of kPrimitiveGroupWidth and test each group with one SIMD
+            /// kernel. The SAH then prices such a leaf by its number of groups rather than
+            /// shapes, so leaves fill up to maxShapesPerNode. Smaller leaves, such as those of
+            /// scattered spheres or of maxShapesPerNode = 1, are tested shape by shape, since
+            /// a mostly empty group would take several times the memory of its shapes.
+            bool     packLeaves;
+        };
+
+        /// Shape and quality figures of the built tree
+        struct Stats {
+            Stats()
+                : numNodes(0)
+                , numInteriorNodes(0)
+                , numLeaves(0)
+                , numShapeRefs(0)
+                , maxDepth(0)
+                , sahCost(0.f)
+                , memoryFootprint(0)
+            {
+            }
+
+            uint32_t numNodes;
+            uint32_t numInteriorNodes;
+            uint32_t numLeaves;
+            /// Shapes referenced by leaves, above the shape count when eSBVH duplicated some
+            uint32_t numShapeRefs;
+            uint32_t maxDepth;
+            /// Number of leaves at every depth, the root being at depth 0
+            std::vector<uint32_t> depthHistogram;
+            /// Number of leaves holding every shape count
+            std::vector<uint32_t> leafSizeHistogram;
+            float    sahCost;
+            /// Bytes used by the nodes, the shape references and compacted shapes
+            size_t   memoryFootprint;
+        };
+
+        /// Traversal work, only counted when compiled with MCP_BVH_STATS
+        struct TraversalCounters {
+            TraversalCounters()
+                : rays(0)
+                , nodesVisited(0)
+                , boxesTested(0)
+                , shapesTested(0)
+            {
+            }
+
+            TraversalCounters& operator+= (const TraversalCounters& rhs);
+
+            uint64_t rays;
+            /// Nodes whose bounds the ray entered
+            uint64_t nodesVisited;
+            uint64_t boxesTested;
+            uint64_t shapesTested;
         };
 
+        /// When a thread pool is given, subtrees above kParallelBuildThreshold shapes are
+        /// built as tasks on it and the bounds/binning passes of the top levels are split
+        /// across its workers. The resulting node layout is identical to a serial build.
         BVH(const std::vector<std::reference_wrapper<Shape> >& shapes, uint32_t maxShapesPerNode,
-            BuildMethod buildMethod);
+            BuildMethod buildMethod, thread::ThreadPool* threadPool = nullptr,
+            const BuildOptions& options = BuildOptions());
         ~BVH();
 
         bool intersect(const Ray3f& ray, float tMin, float tMax, HitInfo& info) const override;
         bool intersect_fast(const Ray3f& ray, float tMin, float tMax, float& t) const override;
         AABB3f aabb() const override;
 
+        /// Same as above for a ray prepared by the caller, a hit moves ray.tMax to its distance
+        bool intersect(TraversalRay& ray, HitInfo& info) const;
+        bool intersect_fast(const TraversalRay& ray, float& t) const;
+
+        /// Traces the active rays of a packet together, testing every node against all rays
+        /// that entered its parent. Returns the rays that hit, whose info is filled in and
+        /// whose tMax is moved to the hit. Children are visited in the order of the first
+        /// active ray, so rays through an edge may report the other triangle than on their
+        /// own. cullFrustum first tests nodes against intervals bounding the whole packet;
+        /// that costs about as much as testing 16 rays, so it only helps large packets
+        /// that miss most nodes.
+        template <uint32_t Size>
+        uint32_t intersectPacket(RayPacket<Size>& packet, HitInfo info[Size], bool cullFrustum = false) const;
+        /// Returns the rays of a packet that hit anything, e.g. occluded shadow rays
+        template <uint32_t Size>
+        uint32_t intersectPacket_fast(const RayPacket<Size>& packet, bool cullFrustum = false) const;
+
+        /// Closest hits of many independent rays, such as diffuse bounces. kStreamRays rays
+        /// are traversed at a time, taking turns one node each and prefetching the node they
+        /// move to, so that the cache misses of different rays overlap. hits[i] tells whether
+        /// rays[i] hit, info[i] is only filled in if it did. Returns the number of hits.
+        uint32_t intersectStream(const Ray3f* rays, uint32_t numRays, float tMin, float tMax,
+                                 HitInfo* info, bool* hits) const;
+        /// Any hit version of intersectStream
+        uint32_t intersectStream_fast(const Ray3f* rays, uint32_t numRays, float tMin, float tMax,
+                                      bool* hits) const;
+
+        /// Recomputes every node's bounds bottom-up from the current bounds of the shapes,
+        /// keeping the topology. Meant for geometry that moves but keeps its connectivity.
+        /// Returns the SAH cost of the refitted tree over the cost right after the build,
+        /// a rebuild usually pays off once this grows well beyond 1.
+        float refit();
+
+        /// Writes the tree in the cache file format, to be loaded again through
+        /// BuildOptions::cacheData or cachePath with the same shapes and options
+        bool writeCache(std::ostream& stream) const;
+
+        /// SAH cost of the tree, relative to the surface area of its root
+        float sahCost() const;
+
+        uint64_t contentHash(uint64_t seed) const override;
+
+        Stats stats() const;
+
+        /// Sum of the counters of every thread that traversed any BVH since the last reset,
+        /// including threads that have exited. Meant to be read once rendering is done.
+        static TraversalCounters traversalCounters();
+        static void resetTraversalCounters();
+
     private:
+        template <uint32_t Width>
+        friend class WideBVH;
+        template <uint32_t Width, typename Q>
+        friend class CompressedBVH;
+
+        static const uint32_t kParallelBuildThreshold     = 4096;
+        static const uint32_t kParallelReductionThreshold = 65536;
+        static const uint32_t kParallelChunkSize          = 16384;
+        static const uint32_t kCacheVersion               = 4;
+        /// Entries of the traversal stacks. Every interior node pushes at most one, so built
+        /// and cached trees keep their interior nodes above depth kTraversalStackSize - 1.
+        static const uint32_t kTraversalStackSize         = 64;
+        /// Rays in flight in a stream traversal, enough to cover a memory access with the
+        /// node steps of the other rays
+        static const uint32_t kStreamRays                 = 8;
+
+        /// A primitive of a shape, e.g. one triangle of a mesh
+        struct PrimitiveRef {
+            uint32_t shape;
+            uint32_t index;
+        };
+
+        /// Shape index of the entries padding packed leaves to a group boundary
+        static const uint32_t kPaddingPrimitive = std::numeric_limits<uint32_t>::max();
+
+        typedef PrimitiveGroup<kPrimitiveGroupWidth> Group;
+
+        /// Leaves with fewer shapes stay unpacked, so groups are always at least half full
+        static const uint32_t kMinPackedLeafShapes = kPrimitiveGroupWidth / 2;
+
         struct BVHShapeInfo {
             BVHShapeInfo() {}
-            BVHShapeInfo(uint32_t shapeNumber, const AABB3f& box)
-                : shapeNumber(shapeNumber)
+            BVHShapeInfo(uint32_t primitiveNumber, const AABB3f& box)
+                : primitiveNumber(primitiveNumber)
                 , aabb(box)
             {
                 centroid = box.min() * 0.5f + box.max() * 0.5f;
             }
 
-            uint32_t shapeNumber;
+            uint32_t primitiveNumber;
             Vector3f centroid;
             AABB3f   aabb;
         };
@@ -76,6 +566,12 @@ namespace accelerator
             BVHBuildNode() {
                 children[0] = nullptr;
                 children[1] = nullptr;
+                parent      = nullptr;
+            }
+
+            ~BVHBuildNode() {
+                delete children[0];
+                delete children[1];
             }
 
             void InitLeaf(uint32_t first, uint32_t num, const AABB3f& b) {
@@ -97,6 +593,31 @@ namespace accelerator
             uint32_t      splitAxis;
             uint32_t      firstShapeOffset;
             uint32_t      numShapes;
+            /// Only maintained while optimizing the tree
+            BVHBuildNode* parent;
+            float         cost;
+        };
+
+        struct SplitInfo {
+            SplitInfo() : cost(kInfinity), axis(0u), bucket(0u), position(0.f) {}
+
+            float    cost;
+            uint32_t axis;
+            uint32_t bucket;
+            float    position;
+            AABB3f   bounds[2];
+        };
+
+        struct MortonShape {
+            uint64_t mortonCode;
+            uint32_t shapeIndex;
+        };
+
+        struct BucketInfo {
+            BucketInfo() : count(0u) {}
+
+            uint32_t count;
+            AABB3f   bounds;
         };
 
         struct CompareToMid {
@@ -160,282 +681,2228 @@ namespace accelerator
             uint8_t padding[2];
         };
 
+        /// Cache file layout: this header, the node array starting at the next cache line
+        /// and then one uint32_t index into the input shape list per leaf reference, or
+        /// kPaddingPrimitive for the padding between packed leaves
+        struct BVHCacheHeader {
+            char     magic[8];
+            uint32_t version;
+            uint32_t nodeSize;
+            uint64_t contentHash;
+            uint32_t numNodes;
+            uint32_t numShapeRefs;
+            uint32_t numPrimitives;
+            float    buildSAHCost;
+            uint64_t orderOffset;
+            uint8_t  padding[16];
+        };
+
+        static_assert(sizeof(BVHCacheHeader) == MCP_L1_CACHE_LINE_SIZE, "Nodes must start cache line aligned");
+
         BVHBuildNode* recursiveBuild(std::vector<BVHShapeInfo>& buildData, uint32_t start, uint32_t end,
-                            uint32_t* totalNodes, std::vector<std::reference_wrapper<Shape> >& orderedShapes);
+                                     std::atomic<uint32_t>* totalNodes);
+        BVHBuildNode* buildChildren(BVHBuildNode* node, uint32_t axis, std::vector<BVHShapeInfo>& buildData,
+                                    uint32_t start, uint32_t mid, uint32_t end, std::atomic<uint32_t>* totalNodes);
+        void computeBounds(const std::vector<BVHShapeInfo>& buildData, uint32_t start, uint32_t end,
+                           AABB3f& bounds, AABB3f& centroidBounds) const;
+        void computeBuckets(const std::vector<BVHShapeInfo>& buildData, uint32_t start, uint32_t end,
+                            uint32_t dimension, const AABB3f& centroidBounds, BucketInfo* buckets) const;
+        void findObjectSplit(const std::vector<BVHShapeInfo>& buildData, uint32_t start, uint32_t end,
+                             const AABB3f& bbox, const AABB3f& centroidBounds, uint32_t dimension,
+                             SplitInfo& split) const;
+        void findSpatialSplit(const std::vector<BVHShapeInfo>& refs, const AABB3f& bbox, SplitInfo& split) const;
+        BVHBuildNode* buildSBVH(std::vector<BVHShapeInfo>& refs, float rootArea, uint32_t* numRefs,
+                                std::atomic<uint32_t>* totalNodes, std::vector<BVHShapeInfo>& leafRefs);
+        BVHBuildNode* buildHLBVH(std::vector<BVHShapeInfo>& buildData, std::atomic<uint32_t>* totalNodes);
+        BVHBuildNode* emitLBVH(const std::vector<BVHShapeInfo>& buildData, const MortonShape* mortonShapes,
+                               uint32_t start, uint32_t end, int32_t bitIndex, std::atomic<uint32_t>* totalNodes);
+        void optimizeTree(BVHBuildNode* root) const;
+        float reinsertNode(BVHBuildNode* root, BVHBuildNode* node) const;
+        static void orderChildren(BVHBuildNode* node);
+        /// Rebalances the subtrees reaching deeper than the traversal stacks allow, returns
+        /// the height of node's subtree afterwards
+        static uint32_t limitDepth(BVHBuildNode* node, uint32_t depth);
+        /// Median split tree over the given leaves, made of the given interior nodes
+        static BVHBuildNode* balanceLeaves(BVHBuildNode** leaves, uint32_t numLeaves,
+                                           const std::vector<BVHBuildNode*>& interiorNodes, uint32_t* nextNode);
+
+        BVHBuildNode* buildUpperSAH(std::vector<BVHBuildNode*>& treeletRoots, uint32_t start, uint32_t end,
+                                    std::atomic<uint32_t>* totalNodes);
+        void radixSort(std::vector<MortonShape>& mortonShapes) const;
         uint32_t flattenBVH(BVHBuildNode* node, uint32_t* offset);
 
+        uint64_t computeContentHash() const;
+        bool loadCache(const std::string& filePath);
+        /// Uses the nodes in data in place if it holds a cache for the current shapes
+        bool loadCache(uint8_t* data, size_t size);
+        void writeCache(const std::string& filePath, const std::vector<uint32_t>& primitiveOrder, uint32_t numPrimitives) const;
+        bool writeCache(std::ostream& stream, const std::vector<uint32_t>& primitiveOrder, uint32_t numPrimitives) const;
+        void orderShapes();
+        void compactShapes();
+        void alignLeaves(std::vector<uint32_t>& primitiveOrder);
+        void packGroups();
+        /// The PrimitiveTypes flag of a primitive
+        uint32_t primitiveType(const PrimitiveRef& primitive) const;
+
+        /// SAH cost of a leaf holding numShapes shapes. Split candidates price their children
+        /// with it too, so groups are counted as filled only as far as leaves can fill them
+        float leafCost(uint32_t numShapes) const;
+
+        void refitRange(uint32_t first, uint32_t end);
+        void collectRefitTasks(uint32_t node, uint32_t end, uint32_t grainSize,
+                               std::vector<uint32_t>& taskRanges, std::vector<uint32_t>& topNodes) const;
+        void refitNode(uint32_t node);
+
+        /// Traversal state of one ray of a stream
+        struct StreamRay {
+            TraversalRay traversal;
+            uint32_t     ray;
+            uint32_t     nodeNum;
+            uint32_t     todoOffset;
+            bool         hit;
+            PrimitiveHit closest;
+            uint32_t     todo[kTraversalStackSize];
+            MCP_BVH_STAT(TraversalCounters counters;)
+        };
+
+        template <bool AnyHit>
+        uint32_t intersectStream(const Ray3f* rays, uint32_t numRays, float tMin, float tMax,
+                                 HitInfo* info, bool* hits) const;
+        /// Visits the next node of a stream ray, returns false once its traversal is done
+        template <bool AnyHit>
+        bool stepStream(StreamRay& stream, HitInfo& info) const;
+
+        /// Closest hit in a leaf, hit.primitive is numbered like mPrimitives. Triangles and
+        /// spheres only record the hit, deferredHitInfo fills in info for the final one.
+        bool intersectLeaf(uint32_t firstShape, uint32_t numShapes, TraversalRay& ray, PrimitiveHit& hit, HitInfo& info) const;
+        bool intersectLeaf_fast(uint32_t firstShape, uint32_t numShapes, const TraversalRay& ray, float& t) const;
+        /// Leaf loops over packed groups, specialized for leaves holding only the given PrimitiveTypes
+        template <uint32_t Types>
+        bool intersectGroups(uint32_t firstShape, uint32_t numShapes, TraversalRay& ray, PrimitiveHit& hit, HitInfo& info) const;
+        template <uint32_t Types>
+        bool intersectGroups_fast(uint32_t firstShape, uint32_t numShapes, const TraversalRay& ray, float& t) const;
+        void deferredHitInfo(const Ray3f& ray, const PrimitiveHit& hit, HitInfo& info) const;
+
+        template <typename Func>
+        void forEachChunk(uint32_t count, const Func& func) const;
+
+        struct CounterRegistry {
+            std::mutex                       mutex;
+            std::vector<TraversalCounters*>  threads;
+            TraversalCounters                exited;
+        };
+
+        /// Registers the counters of a thread for its lifetime
+        struct ThreadCounters {
+            ThreadCounters();
+            ~ThreadCounters();
+
+            TraversalCounters counters;
+        };
+
+        static CounterRegistry& counterRegistry();
+        static TraversalCounters& threadCounters();
+
         uint32_t                                    mMaxShapesPerNode;
         BuildMethod                                 mBuildMethod;
+        BuildOptions                                mOptions;
+        thread::ThreadPool*                         mThreadPool;
+        /// Shapes in the order the leaves first reference them
         std::vector<std::reference_wrapper<Shape> > mShapes;
+        /// Primitives in leaf order, leaves reference contiguous ranges of them
+        std::vector<PrimitiveRef>                   mPrimitives;
+        /// With packLeaves, the primitives of packed leaves again in groups. Packed leaves
+        /// come first in mPrimitives and start on a group, the other leaves follow unpadded.
+        Group*                                      mGroups;
+        uint32_t                                    mNumGroups;
         BVHLinearNode*                              mNodes;
+        uint32_t                                    mNumNodes;
+        float                                       mBuildSAHCost;
+        uint64_t                                    mContentHash;
+        memory::MappedFile                          mCacheFile;
+        /// Cache the nodes live in, either mCacheFile or BuildOptions::cacheData
+        const uint8_t*                              mCacheData;
+        /// Input index of every entry of mShapes and index of the first primitive of every
+        /// input shape followed by the total, which map primitives back to the indices
+        /// cache files store
+        std::vector<uint32_t>                       mShapeOrder;
+        std::vector<uint32_t>                       mFirstPrimitive;
+        uint8_t*                                    mShapeStorage;
+        size_t                                      mShapeStorageSize;
+        std::vector<Shape*>                         mShapeCopies;
 
     };
 
+    const uint32_t BVH::kPaddingPrimitive;
+
     BVH::BVH(const std::vector<std::reference_wrapper<Shape> >& shapes, uint32_t maxShapesPerNode,
-             BuildMethod buildMethod)
+             BuildMethod buildMethod, thread::ThreadPool* threadPool, const BuildOptions& options)
         : mMaxShapesPerNode(maxShapesPerNode)
         , mBuildMethod(buildMethod)
+        , mOptions(options)
+        , mThreadPool(threadPool)
+        , mGroups(nullptr)
+        , mNumGroups(0)
+        , mCacheData(nullptr)
+        , mShapeStorage(nullptr)
+        , mShapeStorageSize(0)
     {
+        mOptions.numBuckets = std::max(mOptions.numBuckets, 2u);
+
+        /// Aggregates such as Instances or other BVHs are kept as single opaque shapes,
+        /// which is what makes a BVH over instances the top level of a two-level scene
         for (uint32_t i = 0; i < shapes.size(); ++i) {
-            // TODO: Refine incoming shapes as they might be composites.
-            //       For now assume incoming list is of non-aggregates.
             mShapes.push_back(shapes[i]);
         }
 
-        if (mShapes.size() == 0) {
-            mNodes = nullptr;
+        /// Shapes such as meshes are split into their primitives, in input order until built
+        mFirstPrimitive.reserve(mShapes.size() + 1);
+        for (uint32_t i = 0; i < mShapes.size(); ++i) {
+            mFirstPrimitive.push_back(mPrimitives.size());
+
+            const uint32_t numPrimitives = mShapes[i].get().numPrimitives();
+            for (uint32_t j = 0; j < numPrimitives; ++j) {
+                mPrimitives.push_back({ i, j });
+            }
+        }
+        mFirstPrimitive.push_back(mPrimitives.size());
+
+        if (mPrimitives.size() == 0) {
+            mNodes        = nullptr;
+            mNumNodes     = 0;
+            mBuildSAHCost = 0.f;
+            mContentHash  = 0;
             return;
         }
 
-        std::vector<BVHShapeInfo> buildData;
-        buildData.reserve(mShapes.size());
-        for (uint32_t i = 0; i < mShapes.size(); ++i) {
-            AABB3f box = mShapes[i].get().aabb();
-            buildData.push_back(BVHShapeInfo(i, box));
+        mContentHash = computeContentHash();
+
+        if (mOptions.cacheData) {
+            if (loadCache(mOptions.cacheData, mOptions.cacheSize)) {
+                return;
+            }
+            std::cerr << "Warning: Ignoring stale or invalid BVH cache data" << std::endl;
         }
 
-        uint32_t totalNodes = 0;
-        std::vector<std::reference_wrapper<Shape> > orderedShapes;
-        orderedShapes.reserve(mShapes.size());
-        BVHBuildNode* root = recursiveBuild(buildData, 0, mShapes.size(), &totalNodes, orderedShapes);
+        if (!mOptions.cachePath.empty() && loadCache(mOptions.cachePath)) {
+            return;
+        }
 
-        mShapes.swap(orderedShapes);
+        std::vector<BVHShapeInfo> buildData(mPrimitives.size());
+        auto initBuildData = [&](uint32_t, uint32_t begin, uint32_t end) {
+            for (uint32_t i = begin; i < end; ++i) {
+                const PrimitiveRef& primitive = mPrimitives[i];
+                buildData[i] = BVHShapeInfo(i, mShapes[primitive.shape].get().primitiveAABB(primitive.index));
+            }
+        };
+
+        if (mThreadPool) {
+            mThreadPool->parallelFor(mPrimitives.size(), kParallelChunkSize, initBuildData);
+        } else {
+            initBuildData(0, 0, mPrimitives.size());
+        }
+
+        std::atomic<uint32_t> totalNodes(0);
+        BVHBuildNode* root = nullptr;
+        if (mBuildMethod == eLBVH || mBuildMethod == eHLBVH) {
+            root = buildHLBVH(buildData, &totalNodes);
+        } else if (mBuildMethod == eSBVH) {
+            /// Leaves of a spatial split BVH may share primitives, buildData becomes the
+            /// list of references in leaf order, possibly longer than the primitive list
+            AABB3f bounds;
+            AABB3f centroidBounds;
+            computeBounds(buildData, 0, buildData.size(), bounds, centroidBounds);
+
+            uint32_t numRefs = buildData.size();
+            std::vector<BVHShapeInfo> leafRefs;
+            leafRefs.reserve(buildData.size());
+
+            root = buildSBVH(buildData, bounds.surfaceArea(), &numRefs, &totalNodes, leafRefs);
+            buildData.swap(leafRefs);
+        } else {
+            root = recursiveBuild(buildData, 0, buildData.size(), &totalNodes);
+        }
+
+        if (mOptions.optimizationBudget > 0.f) {
+            optimizeTree(root);
+        }
+
+        /// No builder bounds the depth by itself, e.g. spatial splits can chain up or the
+        /// optimizer move deep subtrees further down
+        limitDepth(root, 0);
+
+        /// Leaves reference contiguous ranges of buildData, so the final
+        /// primitive order is simply the order buildData was partitioned into
+        const uint32_t numPrimitives = mPrimitives.size();
+        std::vector<PrimitiveRef> orderedPrimitives(buildData.size());
+        std::vector<uint32_t> primitiveOrder(buildData.size());
+        for (uint32_t i = 0; i < buildData.size(); ++i) {
+            orderedPrimitives[i] = mPrimitives[buildData[i].primitiveNumber];
+            primitiveOrder[i]    = buildData[i].primitiveNumber;
+        }
+
+        mPrimitives.swap(orderedPrimitives);
 
         mNodes = memory::allocAligned<BVHLinearNode>(totalNodes);
         for (uint32_t i = 0; i < totalNodes; ++i) {
-            new (&mNodes[i]) BVHLinearNode;
+            new (&mNodes[i]) BVHLinearNode();
         }
 
         uint32_t offset = 0;
         flattenBVH(root, &offset);
-    }
 
-    BVH::~BVH() {
-        memory::freeAligned(mNodes);
-    }
+        delete root;
 
-    BVH::BVHBuildNode* BVH::recursiveBuild(std::vector<BVHShapeInfo>& buildData, uint32_t start, uint32_t end,
-                                           uint32_t* totalNodes, std::vector<std::reference_wrapper<Shape> >& orderedShapes) {
-        ++(*totalNodes);
+        mNumNodes     = totalNodes;
+        mBuildSAHCost = sahCost();
 
-        BVHBuildNode* node = new BVHBuildNode();
+        if (mOptions.packLeaves) {
+            alignLeaves(primitiveOrder);
+        }
+        orderShapes();
 
-        AABB3f bbox;
-        for (uint32_t i = start; i < end; ++i) {
-            bbox = box_union(bbox, buildData[i].aabb);
+        if (!mOptions.cachePath.empty()) {
+            writeCache(mOptions.cachePath, primitiveOrder, numPrimitives);
         }
 
-        uint32_t numShapes = end - start;
-        if (numShapes == 1) {
-            uint32_t firstShapeOffset = orderedShapes.size();
+        if (mOptions.compactShapes) {
+            compactShapes();
+        }
 
-            for (uint32_t i = start; i < end; ++i) {
-                uint32_t shapeNumber = buildData[i].shapeNumber;
-                orderedShapes.push_back(mShapes[shapeNumber]);
-            }
+        if (mOptions.packLeaves) {
+            packGroups();
+        }
+    }
+
+    BVH::~BVH() {
+        /// Nodes loaded from a cache live in the mapped file or the caller's memory
+        if (!mCacheData) {
+            memory::freeAligned(mNodes);
+        }
+        memory::freeAligned(mGroups);
 
-            node->InitLeaf(firstShapeOffset, numShapes, bbox);
+        for (Shape* shape : mShapeCopies) {
+            shape->~Shape();
+        }
+        memory::freeAligned(mShapeStorage);
+    }
 
-        } else {
+    uint64_t BVH::contentHash(uint64_t seed) const {
+        return hashBytes(&mContentHash, sizeof(mContentHash), seed);
+    }
 
-            AABB3f centroidBounds;
-            for (uint32_t i = start; i < end; ++i) {
-                centroidBounds = box_union(centroidBounds, buildData[i].centroid);
+    uint64_t BVH::computeContentHash() const {
+        /// Shapes are hashed in fixed size chunks so the result does not depend on threading
+        const uint32_t numShapes     = mShapes.size();
+        const uint32_t numPrimitives = mPrimitives.size();
+        const uint32_t numChunks     = (numShapes + kParallelChunkSize - 1) / kParallelChunkSize;
+
+        std::vector<uint64_t> chunkHashes(numChunks);
+        forEachChunk(numShapes, [&](uint32_t chunk, uint32_t begin, uint32_t end) {
+            uint64_t hash = hashBytes(&chunk, sizeof(chunk));
+            for (uint32_t i = begin; i < end; ++i) {
+                hash = mShapes[i].get().contentHash(hash);
             }
+            chunkHashes[chunk] = hash;
+        });
+
+        const uint32_t version  = kCacheVersion;
+        const uint32_t nodeSize = sizeof(BVHLinearNode);
+        const uint32_t method   = mBuildMethod;
+        /// Packed leaves are padded to the group width of this build, 1 when not packed
+        const uint32_t groupWidth = mOptions.packLeaves ? kPrimitiveGroupWidth : 1u;
+
+        uint64_t hash = hashBytes(&version, sizeof(version));
+        hash = hashBytes(&nodeSize,                   sizeof(nodeSize),                   hash);
+        hash = hashBytes(&numShapes,                  sizeof(numShapes),                  hash);
+        hash = hashBytes(&numPrimitives,              sizeof(numPrimitives),              hash);
+        hash = hashBytes(&method,                     sizeof(method),                     hash);
+        hash = hashBytes(&mMaxShapesPerNode,          sizeof(mMaxShapesPerNode),          hash);
+        hash = hashBytes(&mOptions.numBuckets,        sizeof(mOptions.numBuckets),        hash);
+        hash = hashBytes(&mOptions.traversalCost,     sizeof(mOptions.traversalCost),     hash);
+        hash = hashBytes(&mOptions.intersectionCost,  sizeof(mOptions.intersectionCost),  hash);
+        hash = hashBytes(&mOptions.evaluateAllAxes,   sizeof(mOptions.evaluateAllAxes),   hash);
+        hash = hashBytes(&mOptions.mortonBits,        sizeof(mOptions.mortonBits),        hash);
+        hash = hashBytes(&mOptions.treeletBits,       sizeof(mOptions.treeletBits),       hash);
+        hash = hashBytes(&mOptions.spatialSplitAlpha, sizeof(mOptions.spatialSplitAlpha), hash);
+        hash = hashBytes(&mOptions.duplicationBudget, sizeof(mOptions.duplicationBudget), hash);
+        hash = hashBytes(&mOptions.optimizationBudget, sizeof(mOptions.optimizationBudget), hash);
+        hash = hashBytes(&groupWidth,                 sizeof(groupWidth),                 hash);
+
+        return chunkHashes.empty() ? hash : hashBytes(chunkHashes.data(), chunkHashes.size() * sizeof(uint64_t), hash);
+    }
 
-            uint32_t dimension = centroidBounds.maximumExtent();
-            uint32_t mid       = (start + end) / 2u;
+    bool BVH::loadCache(const std::string& filePath) {
+        if (!mCacheFile.open(filePath)) {
+            return false;
+        }
 
-            if (centroidBounds.min()[dimension] == centroidBounds.max()[dimension]) {
-                if (numShapes <= mMaxShapesPerNode) {
-                    uint32_t firstShapeOffset = orderedShapes.size();
+        if (mCacheFile.size() < sizeof(BVHCacheHeader)) {
+            std::cerr << "Warning: Ignoring truncated BVH cache: " << filePath << std::endl;
+            mCacheFile.close();
+            return false;
+        }
 
-                    for (uint32_t i = start; i < end; ++i) {
-                        uint32_t shapeNumber = buildData[i].shapeNumber;
-                        orderedShapes.push_back(mShapes[shapeNumber]);
-                    }
+        if (!loadCache(mCacheFile.data(), mCacheFile.size())) {
+            std::cerr << "Warning: Ignoring stale or invalid BVH cache: " << filePath << std::endl;
+            mCacheFile.close();
+            return false;
+        }
 
-                    node->InitLeaf(firstShapeOffset, numShapes, bbox);
-                    return node;
+        return true;
+    }
 
-                } else {
-                    node->InitInterior(dimension,
-                                       recursiveBuild(buildData, start, mid, totalNodes, orderedShapes),
-                                       recursiveBuild(buildData, mid,   end, totalNodes, orderedShapes));
-                    return node;
-                }
-            }
+    bool BVH::loadCache(uint8_t* data, size_t size) {
+        if (size < sizeof(BVHCacheHeader)) {
+            return false;
+        }
 
-            /// Partition based on split method
-            switch(mBuildMethod) {
+        const BVHCacheHeader* header   = reinterpret_cast<const BVHCacheHeader*>(data);
+        const uint64_t        nodesEnd = sizeof(BVHCacheHeader) + static_cast<uint64_t>(header->numNodes) * sizeof(BVHLinearNode);
+
+        bool valid = std::memcmp(header->magic, "MCPBVH", 7) == 0 &&
+                     header->version       == kCacheVersion &&
+                     header->nodeSize      == sizeof(BVHLinearNode) &&
+                     header->contentHash   == mContentHash &&
+                     header->numPrimitives == mPrimitives.size() &&
+                     header->numNodes      >  0 &&
+                     header->orderOffset   == nodesEnd &&
+                     size                  >= nodesEnd + header->numShapeRefs * sizeof(uint32_t);
+
+        const uint32_t* primitiveOrder = reinterpret_cast<const uint32_t*>(data + nodesEnd);
+        for (uint32_t i = 0; valid && i < header->numShapeRefs; ++i) {
+            valid = primitiveOrder[i] < mPrimitives.size() || primitiveOrder[i] == kPaddingPrimitive;
+        }
 
-            case eMIDDLE: {
-                float tMid = (centroidBounds.min()[dimension] + centroidBounds.max()[dimension]) * 0.5f;
-                BVHShapeInfo* midPtr = std::partition(&buildData[start],
-                                                      &buildData[end - 1] + 1,
-                                                      CompareToMid(dimension, tMid));
-                mid = midPtr - &buildData[0];
-                if (mid != start && mid != end) {
-                    break;
+        /// The nodes are traversed as they are, so a damaged cache must not lead outside the
+        /// node or reference arrays, nor deeper than the traversal stacks. Children follow
+        /// their parent, which also rules out cycles.
+        const BVHLinearNode*  nodes = reinterpret_cast<const BVHLinearNode*>(data + sizeof(BVHCacheHeader));
+        std::vector<uint32_t> depth(valid ? header->numNodes : 0, 0);
+        for (uint32_t i = 0; valid && i < header->numNodes; ++i) {
+            const BVHLinearNode& node = nodes[i];
+            if (node.numShapes == 0) {
+                valid = node.axis < 3 &&
+                        i + 1 < node.secondChildOffset && node.secondChildOffset < header->numNodes &&
+                        depth[i] < kTraversalStackSize - 1;
+
+                if (valid) {
+                    depth[i + 1]                  = depth[i] + 1;
+                    depth[node.secondChildOffset] = depth[i] + 1;
                 }
-
-                /// In the case there are a lot of primitives with large overlapping bboxes
-                /// we want to fall through and use eEQUAL_COUNT
+                continue;
             }
 
-            case eEQUAL_COUNT: {
-                mid = (start + end) / 2u;
-                std::nth_element(&buildData[start],
-                                 &buildData[mid],
-                                 &buildData[end - 1] + 1,
-                                 ComparePoints(dimension));
-                break;
+            valid = static_cast<uint64_t>(node.firstShapeOffset) + node.numShapes <= header->numShapeRefs;
+
+            /// Packed leaves have to start on a group
+            if (valid && mOptions.packLeaves && node.numShapes >= kMinPackedLeafShapes) {
+                valid = node.firstShapeOffset % kPrimitiveGroupWidth == 0;
             }
 
-            default:
-            case eSAH: {
-                if (numShapes <= 4) {
-                    mid = (start + end) / 2u;
-                    std::nth_element(&buildData[start],
-                                     &buildData[mid],
-                                     &buildData[end - 1] + 1,
-                                     ComparePoints(dimension));
-                    break;
-                }
+            for (uint32_t j = 0; valid && j < node.numShapes; ++j) {
+                valid = primitiveOrder[node.firstShapeOffset + j] != kPaddingPrimitive;
+            }
+        }
 
-                const uint32_t numBuckets = 12;
+        if (!valid) {
+            return false;
+        }
 
-                struct BucketInfo {
-                    BucketInfo() : count(0u) {}
+        std::vector<PrimitiveRef> orderedPrimitives(header->numShapeRefs);
+        for (uint32_t i = 0; i < header->numShapeRefs; ++i) {
+            orderedPrimitives[i] = primitiveOrder[i] == kPaddingPrimitive ? PrimitiveRef{ kPaddingPrimitive, 0 }
+                                                                          : mPrimitives[primitiveOrder[i]];
+        }
+        mPrimitives.swap(orderedPrimitives);
+        orderShapes();
 
-                    uint32_t count;
-                    AABB3f   bounds;
-                };
+        mCacheData    = data;
+        mNodes        = reinterpret_cast<BVHLinearNode*>(data + sizeof(BVHCacheHeader));
+        mNumNodes     = header->numNodes;
+        mBuildSAHCost = header->buildSAHCost;
 
-                BucketInfo buckets[numBuckets];
+        if (mOptions.compactShapes) {
+            compactShapes();
+        }
 
-                for (uint32_t i = start; i < end; ++i) {
-                    uint32_t b = numBuckets * ((buildData[i].centroid[dimension] - centroidBounds.min()[dimension]) /
-                                               (centroidBounds.max()[dimension] - centroidBounds.min()[dimension]));
-                    if (b == numBuckets) {
-                        b = numBuckets - 1;
-                    }
+        if (mOptions.packLeaves) {
+            packGroups();
+        }
 
-                    buckets[b].count++;
-                    buckets[b].bounds = box_union(buckets[b].bounds, buildData[i].aabb);
-                }
+        return true;
+    }
 
-                float cost[numBuckets - 1];
-                for (uint32_t i = 0; i < numBuckets - 1; ++i) {
-                    AABB3f   b0;
-                    AABB3f   b1;
-                    uint32_t c0 = 0;
-                    uint32_t c1 = 0;
+    void BVH::orderShapes() {
+        const uint32_t kUnused = std::numeric_limits<uint32_t>::max();
 
-                    for (uint32_t j = 0; j <= i; ++j) {
-                        b0  = box_union(b0, buckets[j].bounds);
-                        c0 += buckets[j].count;
-                    }
+        /// With one primitive per shape, leaves then read mShapes front to back as well
+        std::vector<uint32_t> shapeIndex(mShapes.size(), kUnused);
+        std::vector<std::reference_wrapper<Shape> > orderedShapes;
+        orderedShapes.reserve(mShapes.size());
+        mShapeOrder.clear();
+        for (PrimitiveRef& primitive : mPrimitives) {
+            if (primitive.shape == kPaddingPrimitive) {
+                continue;
+            }
 
-                    for (uint32_t j = i + 1; j < numBuckets; ++j) {
-                        b1  = box_union(b1, buckets[j].bounds);
-                        c1 += buckets[j].count;
-                    }
+            if (shapeIndex[primitive.shape] == kUnused) {
+                shapeIndex[primitive.shape] = orderedShapes.size();
+                orderedShapes.push_back(mShapes[primitive.shape]);
+                mShapeOrder.push_back(primitive.shape);
+            }
+            primitive.shape = shapeIndex[primitive.shape];
+        }
 
-                    cost[i] = 0.125f + (c0 * b0.surfaceArea() + c1 * b1.surfaceArea()) / bbox.surfaceArea();
-                }
+        mShapes.swap(orderedShapes);
+    }
 
-                float    minCost      = cost[0];
-                uint32_t minCostSplit = 0;
-                for (uint32_t i = 1; i < numBuckets - 1; ++i) {
-                    if (cost[i] < minCost) {
-                        minCost      = cost[i];
-                        minCostSplit = i;
-                    }
-                }
+    void BVH::compactShapes() {
+        const size_t kAlignment = alignof(std::max_align_t);
 
-                if (numShapes > mMaxShapesPerNode || minCost < numShapes) {
-                    BVHShapeInfo* midPtr = std::partition(&buildData[start],
-                                                          &buildData[end - 1] + 1,
-                                                          CompareToBucket(minCostSplit, numBuckets, dimension, centroidBounds));
-                    mid = midPtr - &buildData[0];
-                } else {
-                    uint32_t firstShapeOffset = orderedShapes.size();
+        /// Shapes with several primitives or shared by several leaves (eSBVH) are
+        /// only listed once, so every shape gets copied once
+        size_t totalSize = 0;
+        for (uint32_t i = 0; i < mShapes.size(); ++i) {
+            totalSize += (mShapes[i].get().cloneSize() + kAlignment - 1) & ~(kAlignment - 1);
+        }
 
-                    for (uint32_t i = start; i < end; ++i) {
-                        uint32_t shapeNumber = buildData[i].shapeNumber;
-                        orderedShapes.push_back(mShapes[shapeNumber]);
-                    }
+        if (totalSize == 0) {
+            return;
+        }
 
-                    node->InitLeaf(firstShapeOffset, numShapes, bbox);
-                    return node;
-                }
+        mShapeStorage     = memory::allocAligned<uint8_t>(totalSize);
+        mShapeStorageSize = totalSize;
 
-                break;
-            }
+        size_t offset = 0;
+        for (uint32_t i = 0; i < mShapes.size(); ++i) {
+            const size_t size = mShapes[i].get().cloneSize();
+            if (size == 0) {
+                continue;
             }
 
-            node->InitInterior(dimension,
-                               recursiveBuild(buildData, start, mid, totalNodes, orderedShapes),
-                               recursiveBuild(buildData, mid,   end, totalNodes, orderedShapes));
+            Shape* copy = mShapes[i].get().cloneInto(mShapeStorage + offset);
+            mShapeCopies.push_back(copy);
+            mShapes[i] = *copy;
+            offset += (size + kAlignment - 1) & ~(kAlignment - 1);
         }
+    }
+
+    void BVH::alignLeaves(std::vector<uint32_t>& primitiveOrder) {
+        /// Leaves are visited in node order, which keeps the primitives of a subtree together.
+        /// Packed leaves are laid out first so that the groups cover a single range.
+        std::vector<PrimitiveRef> alignedPrimitives;
+        std::vector<uint32_t>     alignedOrder;
+        alignedPrimitives.reserve(mPrimitives.size() + mPrimitives.size() / 2);
+        alignedOrder.reserve(mPrimitives.size() + mPrimitives.size() / 2);
+
+        auto pad = [&]() {
+            while (alignedPrimitives.size() % kPrimitiveGroupWidth != 0) {
+                alignedPrimitives.push_back({ kPaddingPrimitive, 0 });
+                alignedOrder.push_back(kPaddingPrimitive);
+            }
+        };
+
+        std::vector<uint32_t> types;
+        for (uint32_t i = 0; i < mNumNodes; ++i) {
+            BVHLinearNode& node = mNodes[i];
+            if (node.numShapes < kMinPackedLeafShapes) {
+                continue;
+            }
+
+            pad();
+            const uint32_t first = node.firstShapeOffset;
+            node.firstShapeOffset = alignedPrimitives.size();
+
+            types.resize(node.numShapes);
+            for (uint32_t j = 0; j < node.numShapes; ++j) {
+                types[j] = primitiveType(mPrimitives[first + j]);
+            }
+
+            /// Triangles, then spheres, then other shapes, so that most groups hold a single type
+            for (uint32_t type : { eTRIANGLES, eSPHERES, eOTHER_SHAPES }) {
+                for (uint32_t j = 0; j < node.numShapes; ++j) {
+                    if (types[j] == type) {
+                        alignedPrimitives.push_back(mPrimitives[first + j]);
+                        alignedOrder.push_back(primitiveOrder[first + j]);
+                    }
+                }
+            }
+        }
+        pad();
+
+        for (uint32_t i = 0; i < mNumNodes; ++i) {
+            BVHLinearNode& node = mNodes[i];
+            if (node.numShapes == 0 || node.numShapes >= kMinPackedLeafShapes) {
+                continue;
+            }
+
+            const uint32_t first = node.firstShapeOffset;
+            node.firstShapeOffset = alignedPrimitives.size();
+
+            for (uint32_t j = 0; j < node.numShapes; ++j) {
+                alignedPrimitives.push_back(mPrimitives[first + j]);
+                alignedOrder.push_back(primitiveOrder[first + j]);
+            }
+        }
+
+        mPrimitives.swap(alignedPrimitives);
+        primitiveOrder.swap(alignedOrder);
+    }
+
+    void BVH::packGroups() {
+        if (!mGroups) {
+            uint32_t numPackedShapes = 0;
+            uint32_t packedEnd       = 0;
+            for (uint32_t i = 0; i < mNumNodes; ++i) {
+                const BVHLinearNode& node = mNodes[i];
+                if (node.numShapes >= kMinPackedLeafShapes) {
+                    numPackedShapes += node.numShapes;
+                    packedEnd        = std::max<uint32_t>(packedEnd, node.firstShapeOffset + node.numShapes);
+                }
+            }
+
+            /// Only leaves that fill at least half a group are packed
+            mNumGroups = (packedEnd + kPrimitiveGroupWidth - 1) / kPrimitiveGroupWidth;
+            assert(mNumGroups * kPrimitiveGroupWidth <= 2 * numPackedShapes);
+
+            if (mNumGroups == 0) {
+                return;
+            }
+            mGroups = memory::allocAligned<Group>(mNumGroups);
+        }
+
+        forEachChunk(mNumGroups, [&](uint32_t, uint32_t begin, uint32_t end) {
+            for (uint32_t i = begin; i < end; ++i) {
+                Group& group = mGroups[i];
+                clearGroup(group);
+
+                /// Shapes that are neither triangles nor spheres stay out of the masks
+                for (uint32_t lane = 0; lane < kPrimitiveGroupWidth; ++lane) {
+                    const PrimitiveRef& primitive = mPrimitives[i * kPrimitiveGroupWidth + lane];
+                    if (primitive.shape == kPaddingPrimitive) {
+                        continue;
+                    }
+
+                    const Shape& shape = mShapes[primitive.shape].get();
+                    Vector3f vertices[3];
+                    Vector3f center;
+                    float    radius;
+                    if (shape.primitiveTriangle(primitive.index, vertices)) {
+                        setTriangle(group, lane, vertices);
+                    } else if (shape.primitiveSphere(primitive.index, center, radius)) {
+                        setSphere(group, lane, center, radius);
+                    }
+                }
+            }
+        });
+
+        /// Tag the first group of every leaf with the types found in the whole leaf
+        forEachChunk(mNumNodes, [&](uint32_t, uint32_t begin, uint32_t end) {
+            for (uint32_t i = begin; i < end; ++i) {
+                const BVHLinearNode& node = mNodes[i];
+                if (node.numShapes < kMinPackedLeafShapes) {
+                    continue;
+                }
+
+                uint32_t types = 0;
+                for (uint32_t j = 0; j < node.numShapes; j += kPrimitiveGroupWidth) {
+                    const Group&   group = mGroups[(node.firstShapeOffset + j) / kPrimitiveGroupWidth];
+                    const uint32_t mask  = laneMask(node.numShapes - j);
+
+                    types |= (group.triangles & mask) ? eTRIANGLES : 0;
+                    types |= (group.spheres & mask) ? eSPHERES : 0;
+                    types |= (mask & ~(group.triangles | group.spheres)) ? eOTHER_SHAPES : 0;
+                }
+                mGroups[node.firstShapeOffset / kPrimitiveGroupWidth].leafTypes = types;
+            }
+        });
+    }
+
+    uint32_t BVH::primitiveType(const PrimitiveRef& primitive) const {
+        const Shape& shape = mShapes[primitive.shape].get();
+
+        Vector3f vertices[3];
+        Vector3f center;
+        float    radius;
+        if (shape.primitiveTriangle(primitive.index, vertices)) {
+            return eTRIANGLES;
+        }
+        if (shape.primitiveSphere(primitive.index, center, radius)) {
+            return eSPHERES;
+        }
+        return eOTHER_SHAPES;
+    }
+
+    float BVH::leafCost(uint32_t numShapes) const {
+        /// Leaves never hold more than mMaxShapesPerNode shapes, neither do their groups
+        const uint32_t groupSize = std::min(kPrimitiveGroupWidth, mMaxShapesPerNode);
+        const uint32_t numTests  = mOptions.packLeaves && groupSize >= kMinPackedLeafShapes &&
+                                   numShapes >= kMinPackedLeafShapes
+                                 ? (numShapes + groupSize - 1) / groupSize
+                                 : numShapes;
+        return mOptions.intersectionCost * numTests;
+    }
+
+    void BVH::writeCache(const std::string& filePath, const std::vector<uint32_t>& primitiveOrder, uint32_t numPrimitives) const {
+        /// Write to a temporary file first so a concurrent reader never maps a partial cache
+        const std::string tempPath = filePath + ".tmp";
+        std::ofstream fileStream(tempPath, std::ios::binary | std::ios::trunc);
+
+        const bool written = writeCache(fileStream, primitiveOrder, numPrimitives);
+        fileStream.close();
+
+        if (!written || !fileStream || std::rename(tempPath.c_str(), filePath.c_str()) != 0) {
+            std::cerr << "Warning: Could not write BVH cache: " << filePath << std::endl;
+            std::remove(tempPath.c_str());
+        }
+    }
+
+    bool BVH::writeCache(std::ostream& stream, const std::vector<uint32_t>& primitiveOrder, uint32_t numPrimitives) const {
+        BVHCacheHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, "MCPBVH", 7);
+        header.version       = kCacheVersion;
+        header.nodeSize      = sizeof(BVHLinearNode);
+        header.contentHash   = mContentHash;
+        header.numNodes      = mNumNodes;
+        header.numShapeRefs  = primitiveOrder.size();
+        header.numPrimitives = numPrimitives;
+        header.buildSAHCost  = mBuildSAHCost;
+        header.orderOffset   = sizeof(BVHCacheHeader) + static_cast<uint64_t>(mNumNodes) * sizeof(BVHLinearNode);
+
+        stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        stream.write(reinterpret_cast<const char*>(mNodes), mNumNodes * sizeof(BVHLinearNode));
+        stream.write(reinterpret_cast<const char*>(primitiveOrder.data()), primitiveOrder.size() * sizeof(uint32_t));
+
+        return static_cast<bool>(stream);
+    }
+
+    bool BVH::writeCache(std::ostream& stream) const {
+        if (mNumNodes == 0) {
+            return false;
+        }
+
+        /// Cache entries index the primitives in input order
+        std::vector<uint32_t> primitiveOrder(mPrimitives.size());
+        for (uint32_t i = 0; i < mPrimitives.size(); ++i) {
+            const PrimitiveRef& primitive = mPrimitives[i];
+            primitiveOrder[i] = primitive.shape == kPaddingPrimitive ? kPaddingPrimitive
+                                                                     : mFirstPrimitive[mShapeOrder[primitive.shape]] + primitive.index;
+        }
+
+        return writeCache(stream, primitiveOrder, mFirstPrimitive.back());
+    }
+
+    void BVH::computeBounds(const std::vector<BVHShapeInfo>& buildData, uint32_t start, uint32_t end,
+                            AABB3f& bounds, AABB3f& centroidBounds) const {
+        const uint32_t numShapes = end - start;
+
+        if (!mThreadPool || numShapes < kParallelReductionThreshold) {
+            for (uint32_t i = start; i < end; ++i) {
+                bounds         = box_union(bounds, buildData[i].aabb);
+                centroidBounds = box_union(centroidBounds, buildData[i].centroid);
+            }
+            return;
+        }
+
+        const uint32_t numChunks = (numShapes + kParallelChunkSize - 1) / kParallelChunkSize;
+        std::vector<AABB3f> chunkBounds(numChunks);
+        std::vector<AABB3f> chunkCentroidBounds(numChunks);
+
+        mThreadPool->parallelFor(numShapes, kParallelChunkSize, [&](uint32_t chunk, uint32_t begin, uint32_t end) {
+            for (uint32_t i = start + begin; i < start + end; ++i) {
+                chunkBounds[chunk]         = box_union(chunkBounds[chunk], buildData[i].aabb);
+                chunkCentroidBounds[chunk] = box_union(chunkCentroidBounds[chunk], buildData[i].centroid);
+            }
+        });
+
+        for (uint32_t i = 0; i < numChunks; ++i) {
+            bounds         = box_union(bounds, chunkBounds[i]);
+            centroidBounds = box_union(centroidBounds, chunkCentroidBounds[i]);
+        }
+    }
+
+    void BVH::computeBuckets(const std::vector<BVHShapeInfo>& buildData, uint32_t start, uint32_t end,
+                             uint32_t dimension, const AABB3f& centroidBounds, BucketInfo* buckets) const {
+        const uint32_t numShapes = end - start;
+
+        const uint32_t numBuckets = mOptions.numBuckets;
+
+        auto binShapes = [&](BucketInfo* bins, uint32_t begin, uint32_t end) {
+            for (uint32_t i = begin; i < end; ++i) {
+                uint32_t b = numBuckets * ((buildData[i].centroid[dimension] - centroidBounds.min()[dimension]) /
+                                           (centroidBounds.max()[dimension] - centroidBounds.min()[dimension]));
+                if (b == numBuckets) {
+                    b = numBuckets - 1;
+                }
+
+                bins[b].count++;
+                bins[b].bounds = box_union(bins[b].bounds, buildData[i].aabb);
+            }
+        };
+
+        if (!mThreadPool || numShapes < kParallelReductionThreshold) {
+            binShapes(buckets, start, end);
+            return;
+        }
+
+        const uint32_t numChunks = (numShapes + kParallelChunkSize - 1) / kParallelChunkSize;
+        std::vector<BucketInfo> chunkBuckets(numChunks * numBuckets);
+
+        mThreadPool->parallelFor(numShapes, kParallelChunkSize, [&](uint32_t chunk, uint32_t begin, uint32_t end) {
+            binShapes(&chunkBuckets[chunk * numBuckets], start + begin, start + end);
+        });
+
+        for (uint32_t i = 0; i < numChunks; ++i) {
+            for (uint32_t b = 0; b < numBuckets; ++b) {
+                const BucketInfo& bucket = chunkBuckets[i * numBuckets + b];
+                buckets[b].count += bucket.count;
+                buckets[b].bounds = box_union(buckets[b].bounds, bucket.bounds);
+            }
+        }
+    }
+
+    BVH::BVHBuildNode* BVH::buildChildren(BVHBuildNode* node, uint32_t axis, std::vector<BVHShapeInfo>& buildData,
+                                          uint32_t start, uint32_t mid, uint32_t end,
+                                          std::atomic<uint32_t>* totalNodes) {
+        if (!mThreadPool || end - start < kParallelBuildThreshold) {
+            node->InitInterior(axis,
+                               recursiveBuild(buildData, start, mid, totalNodes),
+                               recursiveBuild(buildData, mid,   end, totalNodes));
+            return node;
+        }
+
+        /// Hand the second subtree to the pool and build the first one here
+        auto future = mThreadPool->submit(&BVH::recursiveBuild, this, std::ref(buildData), mid, end, totalNodes);
+        BVHBuildNode* child0 = recursiveBuild(buildData, start, mid, totalNodes);
+
+        mThreadPool->wait(future);
+        node->InitInterior(axis, child0, future.get());
+        return node;
+    }
+
+    BVH::BVHBuildNode* BVH::recursiveBuild(std::vector<BVHShapeInfo>& buildData, uint32_t start, uint32_t end,
+                                           std::atomic<uint32_t>* totalNodes) {
+        ++(*totalNodes);
+
+        BVHBuildNode* node = new BVHBuildNode();
+
+        uint32_t numShapes = end - start;
+        if (numShapes == 1) {
+            node->InitLeaf(start, numShapes, buildData[start].aabb);
+
+        } else {
+
+            AABB3f bbox;
+            AABB3f centroidBounds;
+            computeBounds(buildData, start, end, bbox, centroidBounds);
+
+            uint32_t dimension = centroidBounds.maximumExtent();
+            uint32_t mid       = (start + end) / 2u;
+
+            if (centroidBounds.min()[dimension] == centroidBounds.max()[dimension]) {
+                if (numShapes <= mMaxShapesPerNode) {
+                    node->InitLeaf(start, numShapes, bbox);
+                    return node;
+
+                } else {
+                    return buildChildren(node, dimension, buildData, start, mid, end, totalNodes);
+                }
+            }
+
+            /// Partition based on split method
+            switch(mBuildMethod) {
+
+            case eMIDDLE: {
+                float tMid = (centroidBounds.min()[dimension] + centroidBounds.max()[dimension]) * 0.5f;
+                BVHShapeInfo* midPtr = std::partition(&buildData[start],
+                                                      &buildData[end - 1] + 1,
+                                                      CompareToMid(dimension, tMid));
+                mid = midPtr - &buildData[0];
+                if (mid != start && mid != end) {
+                    break;
+                }
+
+                /// In the case there are a lot of primitives with large overlapping bboxes
+                /// we want to fall through and use eEQUAL_COUNT
+            }
+
+            case eEQUAL_COUNT: {
+                mid = (start + end) / 2u;
+                std::nth_element(&buildData[start],
+                                 &buildData[mid],
+                                 &buildData[end - 1] + 1,
+                                 ComparePoints(dimension));
+                break;
+            }
+
+            default:
+            case eSAH: {
+                if (numShapes <= 4 && !mOptions.packLeaves) {
+                    mid = (start + end) / 2u;
+                    std::nth_element(&buildData[start],
+                                     &buildData[mid],
+                                     &buildData[end - 1] + 1,
+                                     ComparePoints(dimension));
+                    break;
+                }
+
+                SplitInfo split;
+                findObjectSplit(buildData, start, end, bbox, centroidBounds, dimension, split);
+
+                dimension = split.axis;
+                if (numShapes > mMaxShapesPerNode || split.cost < leafCost(numShapes)) {
+                    BVHShapeInfo* midPtr = std::partition(&buildData[start],
+                                                          &buildData[end - 1] + 1,
+                                                          CompareToBucket(split.bucket, mOptions.numBuckets, dimension, centroidBounds));
+                    mid = midPtr - &buildData[0];
+                } else {
+                    node->InitLeaf(start, numShapes, bbox);
+                    return node;
+                }
+
+                break;
+            }
+            }
+
+            buildChildren(node, dimension, buildData, start, mid, end, totalNodes);
+        }
+
+        return node;
+    }
+
+    void BVH::findObjectSplit(const std::vector<BVHShapeInfo>& buildData, uint32_t start, uint32_t end,
+                              const AABB3f& bbox, const AABB3f& centroidBounds, uint32_t dimension,
+                              SplitInfo& split) const {
+        const uint32_t numBuckets = mOptions.numBuckets;
+        const uint32_t numAxes    = mOptions.evaluateAllAxes ? 3u : 1u;
+
+        /// On the heap, numBuckets is up to the caller and the stacks of pool workers are small
+        std::vector<BucketInfo> buckets(numBuckets);
+        std::vector<AABB3f>     leftBounds(numBuckets - 1);
+        std::vector<AABB3f>     rightBounds(numBuckets - 1);
+        std::vector<float>      cost(numBuckets - 1);
+
+        for (uint32_t a = 0; a < numAxes; ++a) {
+            const uint32_t axis = mOptions.evaluateAllAxes ? a : dimension;
+            if (centroidBounds.min()[axis] == centroidBounds.max()[axis]) {
+                continue;
+            }
+
+            std::fill(buckets.begin(), buckets.end(), BucketInfo());
+            computeBuckets(buildData, start, end, axis, centroidBounds, buckets.data());
+
+            /// Sweep once from the left accumulating c0 * A(b0) ...
+            AABB3f   b0;
+            uint32_t c0 = 0;
+            for (uint32_t i = 0; i < numBuckets - 1; ++i) {
+                b0  = box_union(b0, buckets[i].bounds);
+                c0 += buckets[i].count;
+                cost[i]       = c0 > 0 ? leafCost(c0) * b0.surfaceArea() : 0.f;
+                leftBounds[i] = b0;
+            }
+
+            /// ... and once from the right adding c1 * A(b1)
+            AABB3f   b1;
+            uint32_t c1 = 0;
+            for (uint32_t i = numBuckets - 1; i > 0; --i) {
+                b1  = box_union(b1, buckets[i].bounds);
+                c1 += buckets[i].count;
+                cost[i - 1]       += c1 > 0 ? leafCost(c1) * b1.surfaceArea() : 0.f;
+                rightBounds[i - 1] = b1;
+            }
+
+            for (uint32_t i = 0; i < numBuckets - 1; ++i) {
+                const float splitCost = mOptions.traversalCost + cost[i] / bbox.surfaceArea();
+                if (splitCost < split.cost) {
+                    split.cost      = splitCost;
+                    split.bucket    = i;
+                    split.axis      = axis;
+                    split.bounds[0] = leftBounds[i];
+                    split.bounds[1] = rightBounds[i];
+                }
+            }
+        }
+    }
+
+    void BVH::findSpatialSplit(const std::vector<BVHShapeInfo>& refs, const AABB3f& bbox, SplitInfo& split) const {
+        struct SpatialBin {
+            SpatialBin() : enter(0u), exit(0u) {}
+
+            AABB3f   bounds;
+            uint32_t enter;
+            uint32_t exit;
+        };
+
+        const uint32_t numBins = mOptions.numBuckets;
+
+        std::vector<SpatialBin> bins(numBins);
+        std::vector<AABB3f>     leftBounds(numBins - 1);
+        std::vector<float>      cost(numBins - 1);
+
+        for (uint32_t axis = 0; axis < 3; ++axis) {
+            const float origin  = bbox.min()[axis];
+            const float binSize = (bbox.max()[axis] - origin) / numBins;
+            if (binSize <= 0.f) {
+                continue;
+            }
+
+            std::fill(bins.begin(), bins.end(), SpatialBin());
+
+            auto binIndex = [&](float position) {
+                const int32_t b = static_cast<int32_t>((position - origin) / binSize);
+                return static_cast<uint32_t>(clamp<int32_t>(b, 0, numBins - 1));
+            };
+
+            /// Chop every reference at the bin planes it straddles
+            for (const BVHShapeInfo& ref : refs) {
+                const uint32_t firstBin = binIndex(ref.aabb.min()[axis]);
+                const uint32_t lastBin  = binIndex(ref.aabb.max()[axis]);
+                const PrimitiveRef& primitive = mPrimitives[ref.primitiveNumber];
+                const Shape&        shape     = mShapes[primitive.shape].get();
+
+                AABB3f current = ref.aabb;
+                for (uint32_t b = firstBin; b < lastBin; ++b) {
+                    AABB3f left;
+                    AABB3f right;
+                    shape.splitPrimitiveAABB(primitive.index, current, axis, origin + binSize * (b + 1), left, right);
+
+                    bins[b].bounds = box_union(bins[b].bounds, left);
+                    current = right;
+                }
+
+                bins[lastBin].bounds = box_union(bins[lastBin].bounds, current);
+                bins[firstBin].enter++;
+                bins[lastBin].exit++;
+            }
+
+            AABB3f   b0;
+            uint32_t c0 = 0;
+            for (uint32_t i = 0; i < numBins - 1; ++i) {
+                b0  = box_union(b0, bins[i].bounds);
+                c0 += bins[i].enter;
+                cost[i]       = c0 > 0 ? leafCost(c0) * b0.surfaceArea() : 0.f;
+                leftBounds[i] = b0;
+            }
+
+            AABB3f   b1;
+            uint32_t c1 = 0;
+            for (uint32_t i = numBins - 1; i > 0; --i) {
+                b1  = box_union(b1, bins[i].bounds);
+                c1 += bins[i].exit;
+                cost[i - 1] += c1 > 0 ? leafCost(c1) * b1.surfaceArea() : 0.f;
+
+                const float splitCost = mOptions.traversalCost + cost[i - 1] / bbox.surfaceArea();
+                if (splitCost < split.cost) {
+                    split.cost      = splitCost;
+                    split.bucket    = i - 1;
+                    split.axis      = axis;
+                    split.position  = origin + binSize * i;
+                    split.bounds[0] = leftBounds[i - 1];
+                    split.bounds[1] = b1;
+                }
+            }
+        }
+    }
+
+    BVH::BVHBuildNode* BVH::buildSBVH(std::vector<BVHShapeInfo>& refs, float rootArea, uint32_t* numRefs,
+                                      std::atomic<uint32_t>* totalNodes, std::vector<BVHShapeInfo>& leafRefs) {
+        ++(*totalNodes);
+
+        BVHBuildNode* node = new BVHBuildNode();
+
+        const uint32_t numShapes = refs.size();
+
+        AABB3f bbox;
+        AABB3f centroidBounds;
+        computeBounds(refs, 0, numShapes, bbox, centroidBounds);
+
+        auto makeLeaf = [&]() {
+            node->InitLeaf(leafRefs.size(), numShapes, bbox);
+            leafRefs.insert(leafRefs.end(), refs.begin(), refs.end());
+            return node;
+        };
+
+        if (numShapes == 1) {
+            return makeLeaf();
+        }
+
+        const uint32_t dimension = centroidBounds.maximumExtent();
+
+        SplitInfo objectSplit;
+        findObjectSplit(refs, 0, numShapes, bbox, centroidBounds, dimension, objectSplit);
+
+        /// Spatial splits only pay off where the object split children overlap noticeably,
+        /// and only while the reference duplication budget lasts
+        SplitInfo spatialSplit;
+        const uint32_t maxRefs = static_cast<uint32_t>(mPrimitives.size() * (1.f + mOptions.duplicationBudget));
+        if (objectSplit.cost < kInfinity && *numRefs < maxRefs) {
+            const AABB3f overlap = box_intersection(objectSplit.bounds[0], objectSplit.bounds[1]);
+            if (overlap.isValid() && overlap.surfaceArea() > mOptions.spatialSplitAlpha * rootArea) {
+                findSpatialSplit(refs, bbox, spatialSplit);
+            }
+        }
+
+        const float minCost  = std::min(objectSplit.cost, spatialSplit.cost);
+        if (numShapes <= mMaxShapesPerNode && leafCost(numShapes) <= minCost) {
+            return makeLeaf();
+        }
+
+        std::vector<BVHShapeInfo> left;
+        std::vector<BVHShapeInfo> right;
+        uint32_t axis = dimension;
+
+        if (spatialSplit.cost < objectSplit.cost) {
+            axis = spatialSplit.axis;
+
+            for (const BVHShapeInfo& ref : refs) {
+                if (ref.aabb.max()[axis] <= spatialSplit.position) {
+                    left.push_back(ref);
+                } else if (ref.aabb.min()[axis] >= spatialSplit.position) {
+                    right.push_back(ref);
+                } else {
+                    AABB3f leftBox;
+                    AABB3f rightBox;
+                    const PrimitiveRef& primitive = mPrimitives[ref.primitiveNumber];
+                    mShapes[primitive.shape].get().splitPrimitiveAABB(primitive.index, ref.aabb, axis, spatialSplit.position,
+                                                                      leftBox, rightBox);
+
+                    if (leftBox.isValid()) {
+                        left.push_back(BVHShapeInfo(ref.primitiveNumber, leftBox));
+                    }
+                    if (rightBox.isValid()) {
+                        right.push_back(BVHShapeInfo(ref.primitiveNumber, rightBox));
+                    }
+                }
+            }
+
+            *numRefs += left.size() + right.size() - numShapes;
+        }
+
+        if (left.empty() || right.empty()) {
+            left.clear();
+            right.clear();
+
+            if (objectSplit.cost < kInfinity) {
+                axis = objectSplit.axis;
+                CompareToBucket compare(objectSplit.bucket, mOptions.numBuckets, axis, centroidBounds);
+                for (const BVHShapeInfo& ref : refs) {
+                    (compare(ref) ? left : right).push_back(ref);
+                }
+            }
+
+            /// All centroids coincide, split the references evenly
+            if (left.empty() || right.empty()) {
+                left.assign(refs.begin(), refs.begin() + numShapes / 2);
+                right.assign(refs.begin() + numShapes / 2, refs.end());
+            }
+        }
+
+        /// The node's references are no longer needed once distributed
+        std::vector<BVHShapeInfo>().swap(refs);
+
+        BVHBuildNode* child0 = buildSBVH(left,  rootArea, numRefs, totalNodes, leafRefs);
+        BVHBuildNode* child1 = buildSBVH(right, rootArea, numRefs, totalNodes, leafRefs);
+        node->InitInterior(axis, child0, child1);
+
+        return node;
+    }
+
+    template <typename Func>
+    void BVH::forEachChunk(uint32_t count, const Func& func) const {
+        if (mThreadPool) {
+            mThreadPool->parallelFor(count, kParallelChunkSize, func);
+            return;
+        }
+
+        for (uint32_t begin = 0, chunk = 0; begin < count; begin += kParallelChunkSize, ++chunk) {
+            func(chunk, begin, std::min(begin + kParallelChunkSize, count));
+        }
+    }
+
+    BVH::BVHBuildNode* BVH::buildHLBVH(std::vector<BVHShapeInfo>& buildData, std::atomic<uint32_t>* totalNodes) {
+        const uint32_t numShapes   = buildData.size();
+        const uint32_t mortonBits  = mOptions.mortonBits > 30 ? 63 : 30;
+        const uint32_t bitsPerAxis = mortonBits / 3;
+        const float    mortonScale = static_cast<float>(1u << bitsPerAxis);
+
+        AABB3f bounds;
+        AABB3f centroidBounds;
+        computeBounds(buildData, 0, numShapes, bounds, centroidBounds);
+
+        std::vector<MortonShape> mortonShapes(numShapes);
+        forEachChunk(numShapes, [&](uint32_t, uint32_t begin, uint32_t end) {
+            for (uint32_t i = begin; i < end; ++i) {
+                Vector3f offset = buildData[i].centroid - centroidBounds.min();
+                for (uint32_t axis = 0; axis < 3; ++axis) {
+                    const float extent = centroidBounds.max()[axis] - centroidBounds.min()[axis];
+                    offset[axis] = extent > 0.f ? offset[axis] / extent * mortonScale : 0.f;
+                }
+
+                mortonShapes[i].mortonCode = encodeMorton3(offset, bitsPerAxis);
+                mortonShapes[i].shapeIndex = i;
+            }
+        });
+
+        radixSort(mortonShapes);
+
+        /// Lay the shapes out in Morton order, leaves index straight into it
+        std::vector<BVHShapeInfo> sortedData(numShapes);
+        forEachChunk(numShapes, [&](uint32_t, uint32_t begin, uint32_t end) {
+            for (uint32_t i = begin; i < end; ++i) {
+                sortedData[i] = buildData[mortonShapes[i].shapeIndex];
+            }
+        });
+        buildData.swap(sortedData);
+
+        if (mBuildMethod == eLBVH) {
+            return emitLBVH(buildData, mortonShapes.data(), 0, numShapes, mortonBits - 1, totalNodes);
+        }
+
+        /// Treelets are runs of shapes sharing the leading treeletBits of their code
+        const uint32_t treeletBits = std::min(mOptions.treeletBits, mortonBits);
+        const uint64_t treeletMask = ((1ull << treeletBits) - 1ull) << (mortonBits - treeletBits);
+
+        std::vector<uint32_t> treeletStarts;
+        treeletStarts.push_back(0);
+        for (uint32_t i = 1; i < numShapes; ++i) {
+            if ((mortonShapes[i - 1].mortonCode & treeletMask) != (mortonShapes[i].mortonCode & treeletMask)) {
+                treeletStarts.push_back(i);
+            }
+        }
+        treeletStarts.push_back(numShapes);
+
+        const uint32_t numTreelets = treeletStarts.size() - 1;
+        const int32_t  firstBit    = static_cast<int32_t>(mortonBits - treeletBits) - 1;
+
+        std::vector<BVHBuildNode*> treeletRoots(numTreelets);
+        auto buildTreelet = [&](uint32_t, uint32_t begin, uint32_t end) {
+            for (uint32_t i = begin; i < end; ++i) {
+                treeletRoots[i] = emitLBVH(buildData, mortonShapes.data(), treeletStarts[i], treeletStarts[i + 1],
+                                           firstBit, totalNodes);
+            }
+        };
+
+        if (mThreadPool) {
+            mThreadPool->parallelFor(numTreelets, 1u, buildTreelet);
+        } else {
+            buildTreelet(0, 0, numTreelets);
+        }
+
+        return buildUpperSAH(treeletRoots, 0, numTreelets, totalNodes);
+    }
+
+    BVH::BVHBuildNode* BVH::emitLBVH(const std::vector<BVHShapeInfo>& buildData, const MortonShape* mortonShapes,
+                                     uint32_t start, uint32_t end, int32_t bitIndex, std::atomic<uint32_t>* totalNodes) {
+        const uint32_t numShapes = end - start;
+
+        if (numShapes <= mMaxShapesPerNode || numShapes == 1) {
+            ++(*totalNodes);
+
+            AABB3f bbox;
+            for (uint32_t i = start; i < end; ++i) {
+                bbox = box_union(bbox, buildData[i].aabb);
+            }
+
+            BVHBuildNode* node = new BVHBuildNode();
+            node->InitLeaf(start, numShapes, bbox);
+            return node;
+        }
+
+        /// Once the code is exhausted the remaining shapes share a cell, split them evenly
+        uint32_t mid  = (start + end) / 2u;
+        uint32_t axis = 0;
+
+        if (bitIndex >= 0) {
+            const uint64_t mask = 1ull << bitIndex;
+
+            /// Every shape in the range lands on the same side of this bit, try the next one
+            if ((mortonShapes[start].mortonCode & mask) == (mortonShapes[end - 1].mortonCode & mask)) {
+                return emitLBVH(buildData, mortonShapes, start, end, bitIndex - 1, totalNodes);
+            }
+
+            /// Binary search for the first shape with the bit set
+            uint32_t first = start;
+            uint32_t count = numShapes;
+            while (count > 0) {
+                const uint32_t half = count >> 1;
+                if (mortonShapes[first + half].mortonCode & mask) {
+                    count = half;
+                } else {
+                    first += half + 1;
+                    count -= half + 1;
+                }
+            }
+
+            mid  = first;
+            axis = bitIndex % 3;
+        }
+
+        ++(*totalNodes);
+        BVHBuildNode* node = new BVHBuildNode();
+
+        if (!mThreadPool || numShapes < kParallelBuildThreshold) {
+            node->InitInterior(axis,
+                               emitLBVH(buildData, mortonShapes, start, mid, bitIndex - 1, totalNodes),
+                               emitLBVH(buildData, mortonShapes, mid,   end, bitIndex - 1, totalNodes));
+            return node;
+        }
+
+        auto future = mThreadPool->submit(&BVH::emitLBVH, this, std::cref(buildData), mortonShapes,
+                                          mid, end, bitIndex - 1, totalNodes);
+        BVHBuildNode* child0 = emitLBVH(buildData, mortonShapes, start, mid, bitIndex - 1, totalNodes);
+
+        mThreadPool->wait(future);
+        node->InitInterior(axis, child0, future.get());
+        return node;
+    }
+
+    BVH::BVHBuildNode* BVH::buildUpperSAH(std::vector<BVHBuildNode*>& treeletRoots, uint32_t start, uint32_t end,
+                                          std::atomic<uint32_t>* totalNodes) {
+        const uint32_t numNodes = end - start;
+        if (numNodes == 1) {
+            return treeletRoots[start];
+        }
+
+        ++(*totalNodes);
+        BVHBuildNode* node = new BVHBuildNode();
+
+        auto centroid = [](const BVHBuildNode* n) {
+            return n->aabb.min() * 0.5f + n->aabb.max() * 0.5f;
+        };
+
+        AABB3f bbox;
+        AABB3f centroidBounds;
+        for (uint32_t i = start; i < end; ++i) {
+            bbox           = box_union(bbox, treeletRoots[i]->aabb);
+            centroidBounds = box_union(centroidBounds, centroid(treeletRoots[i]));
+        }
+
+        const uint32_t dimension = centroidBounds.maximumExtent();
+        const float    cMin      = centroidBounds.min()[dimension];
+        const float    cMax      = centroidBounds.max()[dimension];
+
+        uint32_t mid = (start + end) / 2u;
+
+        if (cMin != cMax) {
+            const uint32_t numBuckets = mOptions.numBuckets;
+
+            auto bucketIndex = [&](const BVHBuildNode* n) {
+                uint32_t b = numBuckets * ((centroid(n)[dimension] - cMin) / (cMax - cMin));
+                return b == numBuckets ? numBuckets - 1 : b;
+            };
+
+            std::vector<BucketInfo> buckets(numBuckets);
+            for (uint32_t i = start; i < end; ++i) {
+                BucketInfo& bucket = buckets[bucketIndex(treeletRoots[i])];
+                bucket.count++;
+                bucket.bounds = box_union(bucket.bounds, treeletRoots[i]->aabb);
+            }
+
+            std::vector<float> cost(numBuckets - 1);
+
+            AABB3f   b0;
+            uint32_t c0 = 0;
+            for (uint32_t i = 0; i < numBuckets - 1; ++i) {
+                b0  = box_union(b0, buckets[i].bounds);
+                c0 += buckets[i].count;
+                cost[i] = c0 > 0 ? c0 * b0.surfaceArea() : 0.f;
+            }
+
+            AABB3f   b1;
+            uint32_t c1 = 0;
+            for (uint32_t i = numBuckets - 1; i > 0; --i) {
+                b1  = box_union(b1, buckets[i].bounds);
+                c1 += buckets[i].count;
+                cost[i - 1] += c1 > 0 ? c1 * b1.surfaceArea() : 0.f;
+            }
+
+            uint32_t minCostSplit = 0;
+            for (uint32_t i = 1; i < numBuckets - 1; ++i) {
+                if (cost[i] < cost[minCostSplit]) {
+                    minCostSplit = i;
+                }
+            }
+
+            BVHBuildNode** midPtr = std::partition(&treeletRoots[start], &treeletRoots[end - 1] + 1,
+                                                   [&](const BVHBuildNode* n) {
+                                                       return bucketIndex(n) <= minCostSplit;
+                                                   });
+            mid = midPtr - &treeletRoots[0];
+            if (mid == start || mid == end) {
+                mid = (start + end) / 2u;
+            }
+        }
+
+        node->InitInterior(dimension,
+                           buildUpperSAH(treeletRoots, start, mid, totalNodes),
+                           buildUpperSAH(treeletRoots, mid,   end, totalNodes));
+        return node;
+    }
+
+    void BVH::radixSort(std::vector<MortonShape>& mortonShapes) const {
+        const uint32_t count       = mortonShapes.size();
+        const uint32_t numChunks   = (count + kParallelChunkSize - 1) / kParallelChunkSize;
+        const uint32_t bitsPerPass = 8;
+        const uint32_t numBuckets  = 1u << bitsPerPass;
+        const uint32_t numPasses   = ((mOptions.mortonBits > 30 ? 63 : 30) + bitsPerPass - 1) / bitsPerPass;
+
+        std::vector<MortonShape> temp(count);
+        std::vector<uint32_t>    offsets(numChunks * numBuckets);
+
+        for (uint32_t pass = 0; pass < numPasses; ++pass) {
+            const uint32_t lowBit = pass * bitsPerPass;
+            const std::vector<MortonShape>& in  = (pass & 1) ? temp : mortonShapes;
+            std::vector<MortonShape>&       out = (pass & 1) ? mortonShapes : temp;
+
+            std::fill(offsets.begin(), offsets.end(), 0u);
+
+            forEachChunk(count, [&](uint32_t chunk, uint32_t begin, uint32_t end) {
+                uint32_t* histogram = &offsets[chunk * numBuckets];
+                for (uint32_t i = begin; i < end; ++i) {
+                    histogram[(in[i].mortonCode >> lowBit) & (numBuckets - 1)]++;
+                }
+            });
+
+            /// Chunks write their share of each bucket one after the other, keeping the sort stable
+            uint32_t sum = 0;
+            for (uint32_t b = 0; b < numBuckets; ++b) {
+                for (uint32_t chunk = 0; chunk < numChunks; ++chunk) {
+                    const uint32_t bucketCount = offsets[chunk * numBuckets + b];
+                    offsets[chunk * numBuckets + b] = sum;
+                    sum += bucketCount;
+                }
+            }
+
+            forEachChunk(count, [&](uint32_t chunk, uint32_t begin, uint32_t end) {
+                uint32_t* offset = &offsets[chunk * numBuckets];
+                for (uint32_t i = begin; i < end; ++i) {
+                    out[offset[(in[i].mortonCode >> lowBit) & (numBuckets - 1)]++] = in[i];
+                }
+            });
+        }
+
+        if (numPasses & 1) {
+            mortonShapes.swap(temp);
+        }
+    }
+
+    void BVH::optimizeTree(BVHBuildNode* root) const {
+        typedef std::chrono::steady_clock Clock;
+
+        const Clock::time_point deadline = Clock::now() +
+            std::chrono::duration_cast<Clock::duration>(std::chrono::duration<float>(mOptions.optimizationBudget));
+
+        std::vector<BVHBuildNode*> nodes;
+        std::vector<BVHBuildNode*> todo(1, root);
+        root->parent = nullptr;
+        while (!todo.empty()) {
+            BVHBuildNode* node = todo.back();
+            todo.pop_back();
+
+            if (node->numShapes == 0) {
+                for (BVHBuildNode* child : node->children) {
+                    child->parent = node;
+                    todo.push_back(child);
+                }
+            }
+            if (node->parent && node->parent->parent) {
+                nodes.push_back(node);
+            }
+        }
+
+        if (nodes.empty()) {
+            return;
+        }
+
+        /// Rounds of reinsertions, each starting with the subtrees under the parents that
+        /// enclose the most space compared to their children
+        const uint32_t batchSize = std::max<uint32_t>(nodes.size() / 100, 1u);
+
+        while (Clock::now() < deadline) {
+            for (BVHBuildNode* node : nodes) {
+                const BVHBuildNode* parent = node->parent;
+                const float area    = parent->aabb.surfaceArea();
+                const float area0   = parent->children[0]->aabb.surfaceArea();
+                const float area1   = parent->children[1]->aabb.surfaceArea();
+                const float minArea = std::max(std::min(area0, area1), kEpsilon);
+                const float sumArea = std::max(area0 + area1, kEpsilon);
+                node->cost = area * (area / minArea) * (2.f * area / sumArea);
+            }
+
+            std::partial_sort(nodes.begin(), nodes.begin() + batchSize, nodes.end(),
+                              [](const BVHBuildNode* a, const BVHBuildNode* b) { return a->cost > b->cost; });
+
+            float gain = 0.f;
+            for (uint32_t i = 0; i < batchSize && Clock::now() < deadline; ++i) {
+                gain += reinsertNode(root, nodes[i]);
+            }
+
+            /// Stop once a round barely changes the tree
+            if (gain <= kEpsilon * root->aabb.surfaceArea()) {
+                break;
+            }
+
+            /// Nodes moved next to the root can no longer be taken out
+            nodes.erase(std::remove_if(nodes.begin(), nodes.end(), [](const BVHBuildNode* node) {
+                return !node->parent->parent;
+            }), nodes.end());
+
+            if (nodes.size() < batchSize) {
+                break;
+            }
+        }
+    }
+
+    float BVH::reinsertNode(BVHBuildNode* root, BVHBuildNode* node) const {
+        BVHBuildNode* parent      = node->parent;
+        BVHBuildNode* sibling     = parent->children[parent->children[0] == node ? 1 : 0];
+        BVHBuildNode* grandparent = parent->parent;
+
+        /// Moved next to the root earlier in this round
+        if (!grandparent) {
+            return 0.f;
+        }
+
+        /// Detach node, its sibling takes the place of the parent
+        float removalGain = parent->aabb.surfaceArea();
+
+        grandparent->children[grandparent->children[0] == parent ? 0 : 1] = sibling;
+        sibling->parent = grandparent;
+
+        for (BVHBuildNode* ancestor = grandparent; ancestor; ancestor = ancestor->parent) {
+            const float oldArea = ancestor->aabb.surfaceArea();
+            ancestor->aabb = box_union(ancestor->children[0]->aabb, ancestor->children[1]->aabb);
+            removalGain += oldArea - ancestor->aabb.surfaceArea();
+        }
+
+        /// Branch and bound search for the sibling that adds the least surface area: the
+        /// new parent's area plus the growth of every node above it
+        struct Candidate {
+            BVHBuildNode* node;
+            float         inducedCost;
+
+            bool operator< (const Candidate& rhs) const {
+                return inducedCost > rhs.inducedCost;
+            }
+        };
+
+        const float nodeArea = node->aabb.surfaceArea();
+
+        BVHBuildNode* best     = sibling;
+        float         bestCost = kInfinity;
+
+        std::priority_queue<Candidate> queue;
+        queue.push({ root, 0.f });
+
+        while (!queue.empty()) {
+            const Candidate candidate = queue.top();
+            queue.pop();
+
+            if (candidate.inducedCost + nodeArea >= bestCost) {
+                break;
+            }
+
+            const float mergedArea = box_union(candidate.node->aabb, node->aabb).surfaceArea();
+            const float cost       = candidate.inducedCost + mergedArea;
+            if (cost < bestCost) {
+                best     = candidate.node;
+                bestCost = cost;
+            }
+
+            if (candidate.node->numShapes == 0) {
+                const float childInducedCost = cost - candidate.node->aabb.surfaceArea();
+                if (childInducedCost + nodeArea < bestCost) {
+                    queue.push({ candidate.node->children[0], childInducedCost });
+                    queue.push({ candidate.node->children[1], childInducedCost });
+                }
+            }
+        }
+
+        /// The old parent becomes the new one, between best and its parent
+        BVHBuildNode* newGrandparent = best->parent;
+
+        parent->children[0] = best;
+        parent->children[1] = node;
+        parent->parent      = newGrandparent;
+        best->parent        = parent;
+        node->parent        = parent;
+
+        if (newGrandparent) {
+            newGrandparent->children[newGrandparent->children[0] == best ? 0 : 1] = parent;
+        } else {
+            /// The root has to keep its address, so its contents move into the freed
+            /// parent, which then becomes the root's first child
+            *parent = *root;
+            parent->parent = root;
+            if (parent->numShapes == 0) {
+                parent->children[0]->parent = parent;
+                parent->children[1]->parent = parent;
+            }
+
+            root->children[0] = parent;
+            root->children[1] = node;
+            root->numShapes   = 0;
+            root->parent      = nullptr;
+            node->parent      = root;
+            parent            = root;
+        }
+
+        for (BVHBuildNode* ancestor = parent; ancestor; ancestor = ancestor->parent) {
+            ancestor->aabb = box_union(ancestor->children[0]->aabb, ancestor->children[1]->aabb);
+            orderChildren(ancestor);
+        }
+
+        return removalGain - bestCost;
+    }
+
+    void BVH::orderChildren(BVHBuildNode* node) {
+        /// Traversal visits children[0] first unless the ray points down splitAxis, so once
+        /// children were moved the axis is taken as the one separating them the most
+        const AABB3f&  b0 = node->children[0]->aabb;
+        const AABB3f&  b1 = node->children[1]->aabb;
+        const Vector3f c0 = b0.min() * 0.5f + b0.max() * 0.5f;
+        const Vector3f c1 = b1.min() * 0.5f + b1.max() * 0.5f;
+
+        uint32_t axis = 0;
+        for (uint32_t i = 1; i < 3; ++i) {
+            if (std::abs(c1[i] - c0[i]) > std::abs(c1[axis] - c0[axis])) {
+                axis = i;
+            }
+        }
+
+        if (c1[axis] < c0[axis]) {
+            std::swap(node->children[0], node->children[1]);
+        }
+        node->splitAxis = axis;
+    }
+
+    uint32_t BVH::limitDepth(BVHBuildNode* node, uint32_t depth) {
+        if (node->numShapes > 0) {
+            return 0;
+        }
+
+        const uint32_t height = 1 + std::max(limitDepth(node->children[0], depth + 1),
+                                             limitDepth(node->children[1], depth + 1));
+        if (depth + height < kTraversalStackSize) {
+            return height;
+        }
+
+        std::vector<BVHBuildNode*> leaves;
+        std::vector<BVHBuildNode*> interiorNodes;
+        std::vector<BVHBuildNode*> todo(1, node);
+        while (!todo.empty()) {
+            BVHBuildNode* current = todo.back();
+            todo.pop_back();
+
+            if (current->numShapes > 0) {
+                leaves.push_back(current);
+            } else {
+                interiorNodes.push_back(current);
+                todo.push_back(current->children[1]);
+                todo.push_back(current->children[0]);
+            }
+        }
+
+        uint32_t balancedHeight = 0;
+        while ((1ull << balancedHeight) < leaves.size()) {
+            ++balancedHeight;
+        }
+
+        /// Too deep even when balanced, left to an ancestor with more room. The root always
+        /// has enough for 2^32 leaves.
+        if (depth + balancedHeight >= kTraversalStackSize) {
+            return height;
+        }
+
+        /// node comes first, so it stays the root of its subtree
+        uint32_t nextNode = 0;
+        balanceLeaves(leaves.data(), leaves.size(), interiorNodes, &nextNode);
+
+        return balancedHeight;
+    }
+
+    BVH::BVHBuildNode* BVH::balanceLeaves(BVHBuildNode** leaves, uint32_t numLeaves,
+                                          const std::vector<BVHBuildNode*>& interiorNodes, uint32_t* nextNode) {
+        if (numLeaves == 1) {
+            return leaves[0];
+        }
+
+        BVHBuildNode* node = interiorNodes[(*nextNode)++];
+
+        AABB3f centroidBounds;
+        for (uint32_t i = 0; i < numLeaves; ++i) {
+            centroidBounds = box_union(centroidBounds, leaves[i]->aabb.min() * 0.5f + leaves[i]->aabb.max() * 0.5f);
+        }
+
+        const uint32_t axis = centroidBounds.maximumExtent();
+        const uint32_t mid  = numLeaves / 2;
+        std::nth_element(leaves, leaves + mid, leaves + numLeaves, [axis](const BVHBuildNode* a, const BVHBuildNode* b) {
+            return a->aabb.min()[axis] + a->aabb.max()[axis] < b->aabb.min()[axis] + b->aabb.max()[axis];
+        });
+
+        BVHBuildNode* child0 = balanceLeaves(leaves,       mid,             interiorNodes, nextNode);
+        BVHBuildNode* child1 = balanceLeaves(leaves + mid, numLeaves - mid, interiorNodes, nextNode);
+        node->InitInterior(axis, child0, child1);
+
+        return node;
+    }
+
+    uint32_t BVH::flattenBVH(BVHBuildNode* node, uint32_t* offset) {
+        BVHLinearNode* linearNode = &mNodes[*offset];
+        linearNode->aabb = node->aabb;
+
+        uint32_t myOffset = (*offset)++;
+
+        if (node->numShapes > 0) {
+            linearNode->firstShapeOffset = node->firstShapeOffset;
+            linearNode->numShapes        = node->numShapes;
+
+        } else {
+            linearNode->axis      = node->splitAxis;
+            linearNode->numShapes = 0;
+
+            flattenBVH(node->children[0], offset);
+            linearNode->secondChildOffset = flattenBVH(node->children[1], offset);
+        }
+
+        return myOffset;
+    }
+
+    bool BVH::intersect(const Ray3f& ray, float tMin, float tMax, HitInfo& info) const {
+        TraversalRay traversalRay(ray, tMin, tMax);
+        return intersect(traversalRay, info);
+    }
+
+    bool BVH::intersect(TraversalRay& ray, HitInfo& info) const {
+        if (!mNodes) {
+            return false;
+        }
+
+        bool         hit = false;
+        PrimitiveHit closest;
+
+        MCP_BVH_STAT(TraversalCounters counters;)
+        MCP_BVH_STAT(counters.rays = 1;)
+
+        uint32_t todoOffset = 0;
+        uint32_t nodeNum    = 0;
+        uint32_t todo[kTraversalStackSize];
+
+        while (true) {
+            const BVHLinearNode* node = &mNodes[nodeNum];
+            MCP_BVH_STAT(++counters.boxesTested;)
+
+            if (intersectBox(node->aabb, ray)) {
+                MCP_BVH_STAT(++counters.nodesVisited;)
+
+                if (node->numShapes > 0) {
+                    MCP_BVH_STAT(counters.shapesTested += node->numShapes;)
+
+                    if (intersectLeaf(node->firstShapeOffset, node->numShapes, ray, closest, info)) {
+                        hit = true;
+                    }
+
+                    if (todoOffset == 0) break;
+                    nodeNum = todo[--todoOffset];
+
+                } else {
+                    if (ray.dirIsNeg[node->axis]) {
+                        todo[todoOffset++] = nodeNum + 1;
+                        nodeNum = node->secondChildOffset;
+                    } else {
+                        todo[todoOffset++] = node->secondChildOffset;
+                        nodeNum = nodeNum + 1;
+                    }
+                }
+
+            } else {
+                if (todoOffset == 0) break;
+                nodeNum = todo[--todoOffset];
+            }
+        }
+
+        MCP_BVH_STAT(threadCounters() += counters;)
+
+        if (hit && closest.deferred) {
+            deferredHitInfo(ray.ray, closest, info);
+        }
+        return hit;
+    }
+
+    template <uint32_t Size>
+    uint32_t BVH::intersectPacket(RayPacket<Size>& packet, HitInfo info[Size], bool cullFrustum) const {
+        if (!mNodes || !packet.active) {
+            return 0;
+        }
+
+        PacketRayData<Size> rayData(packet, cullFrustum);
+
+        TraversalRay rays[Size];
+        PrimitiveHit closest[Size];
+        for (uint32_t active = packet.active; active; active &= active - 1) {
+            const uint32_t lane = countTrailingZeros(active);
+            rays[lane] = TraversalRay(packet.ray(lane), packet.tMin[lane], packet.tMax[lane]);
+        }
+
+        MCP_BVH_STAT(TraversalCounters counters;)
+        MCP_BVH_STAT(counters.rays = countBits(packet.active);)
+
+        /// Children are visited in the order the first ray would visit them
+        const uint32_t first = countTrailingZeros(packet.active);
+        uint32_t       hits  = 0;
+
+        /// Every entry holds the rays that entered the parent of the node
+        uint32_t todoOffset = 0;
+        uint32_t nodeNum    = 0;
+        uint32_t mask       = packet.active;
+        uint32_t todo[kTraversalStackSize];
+        uint32_t todoMask[kTraversalStackSize];
+
+        while (true) {
+            const BVHLinearNode* node = &mNodes[nodeNum];
+            MCP_BVH_STAT(counters.boxesTested += countBits(mask);)
 
-        return node;
+            if (!rayData.frustum || !rayData.frustumMisses(node->aabb)) {
+                mask = intersectPacketBox(node->aabb, packet, rayData, mask);
+            } else {
+                mask = 0;
+            }
+
+            if (mask) {
+                MCP_BVH_STAT(counters.nodesVisited += countBits(mask);)
+
+                if (node->numShapes > 0) {
+                    MCP_BVH_STAT(counters.shapesTested += node->numShapes * countBits(mask);)
+
+                    uint32_t leafHits = 0;
+                    for (; mask; mask &= mask - 1) {
+                        const uint32_t lane = countTrailingZeros(mask);
+                        if (intersectLeaf(node->firstShapeOffset, node->numShapes, rays[lane], closest[lane], info[lane])) {
+                            packet.tMax[lane] = rays[lane].tMax;
+                            leafHits |= 1u << lane;
+                        }
+                    }
+
+                    if (leafHits) {
+                        hits |= leafHits;
+                        if (rayData.frustum) {
+                            rayData.updateRange(packet);
+                        }
+                    }
+
+                    if (todoOffset == 0) break;
+                    --todoOffset;
+                    nodeNum = todo[todoOffset];
+                    mask    = todoMask[todoOffset];
+
+                } else {
+                    todoMask[todoOffset] = mask;
+                    if (rayData.dirIsNeg[node->axis][first]) {
+                        todo[todoOffset++] = nodeNum + 1;
+                        nodeNum = node->secondChildOffset;
+                    } else {
+                        todo[todoOffset++] = node->secondChildOffset;
+                        nodeNum = nodeNum + 1;
+                    }
+                }
+
+            } else {
+                if (todoOffset == 0) break;
+                --todoOffset;
+                nodeNum = todo[todoOffset];
+                mask    = todoMask[todoOffset];
+            }
+        }
+
+        MCP_BVH_STAT(threadCounters() += counters;)
+
+        for (uint32_t deferred = hits; deferred; deferred &= deferred - 1) {
+            const uint32_t lane = countTrailingZeros(deferred);
+            if (closest[lane].deferred) {
+                deferredHitInfo(rays[lane].ray, closest[lane], info[lane]);
+            }
+        }
+
+        return hits;
     }
 
-    uint32_t BVH::flattenBVH(BVHBuildNode* node, uint32_t* offset) {
-        BVHLinearNode* linearNode = &mNodes[*offset];
-        linearNode->aabb = node->aabb;
+    template <uint32_t Size>
+    uint32_t BVH::intersectPacket_fast(const RayPacket<Size>& packet, bool cullFrustum) const {
+        if (!mNodes || !packet.active) {
+            return 0;
+        }
 
-        uint32_t myOffset = (*offset)++;
+        const PacketRayData<Size> rayData(packet, cullFrustum);
 
-        if (node->numShapes > 0) {
-            linearNode->firstShapeOffset = node->firstShapeOffset;
-            linearNode->numShapes        = node->numShapes;
+        TraversalRay rays[Size];
+        for (uint32_t active = packet.active; active; active &= active - 1) {
+            const uint32_t lane = countTrailingZeros(active);
+            rays[lane] = TraversalRay(packet.ray(lane), packet.tMin[lane], packet.tMax[lane]);
+        }
 
-        } else {
-            linearNode->axis      = node->splitAxis;
-            linearNode->numShapes = 0;
+        MCP_BVH_STAT(TraversalCounters counters;)
+        MCP_BVH_STAT(counters.rays = countBits(packet.active);)
 
-            flattenBVH(node->children[0], offset);
-            linearNode->secondChildOffset = flattenBVH(node->children[1], offset);
+        const uint32_t first = countTrailingZeros(packet.active);
+        uint32_t       hits  = 0;
+
+        uint32_t todoOffset = 0;
+        uint32_t nodeNum    = 0;
+        uint32_t mask       = packet.active;
+        uint32_t todo[kTraversalStackSize];
+        uint32_t todoMask[kTraversalStackSize];
+
+        while (true) {
+            const BVHLinearNode* node = &mNodes[nodeNum];
+
+            /// Rays that hit something are done
+            mask &= ~hits;
+            MCP_BVH_STAT(counters.boxesTested += countBits(mask);)
+
+            if (mask && (!rayData.frustum || !rayData.frustumMisses(node->aabb))) {
+                mask = intersectPacketBox(node->aabb, packet, rayData, mask);
+            } else {
+                mask = 0;
+            }
+
+            if (mask) {
+                MCP_BVH_STAT(counters.nodesVisited += countBits(mask);)
+
+                if (node->numShapes > 0) {
+                    MCP_BVH_STAT(counters.shapesTested += node->numShapes * countBits(mask);)
+
+                    for (; mask; mask &= mask - 1) {
+                        const uint32_t lane = countTrailingZeros(mask);
+                        float t;
+                        if (intersectLeaf_fast(node->firstShapeOffset, node->numShapes, rays[lane], t)) {
+                            hits |= 1u << lane;
+                        }
+                    }
+
+                    if (hits == packet.active || todoOffset == 0) break;
+                    --todoOffset;
+                    nodeNum = todo[todoOffset];
+                    mask    = todoMask[todoOffset];
+
+                } else {
+                    todoMask[todoOffset] = mask;
+                    if (rayData.dirIsNeg[node->axis][first]) {
+                        todo[todoOffset++] = nodeNum + 1;
+                        nodeNum = node->secondChildOffset;
+                    } else {
+                        todo[todoOffset++] = node->secondChildOffset;
+                        nodeNum = nodeNum + 1;
+                    }
+                }
+
+            } else {
+                if (todoOffset == 0) break;
+                --todoOffset;
+                nodeNum = todo[todoOffset];
+                mask    = todoMask[todoOffset];
+            }
         }
 
-        return myOffset;
+        MCP_BVH_STAT(threadCounters() += counters;)
+
+        return hits;
     }
 
-    bool BVH::intersect(const Ray3f& ray, float tMin, float tMax, HitInfo& info) const {
+    uint32_t BVH::intersectStream(const Ray3f* rays, uint32_t numRays, float tMin, float tMax,
+                                  HitInfo* info, bool* hits) const {
+        return intersectStream<false>(rays, numRays, tMin, tMax, info, hits);
+    }
+
+    uint32_t BVH::intersectStream_fast(const Ray3f* rays, uint32_t numRays, float tMin, float tMax,
+                                       bool* hits) const {
+        return intersectStream<true>(rays, numRays, tMin, tMax, nullptr, hits);
+    }
+
+    template <bool AnyHit>
+    uint32_t BVH::intersectStream(const Ray3f* rays, uint32_t numRays, float tMin, float tMax,
+                                  HitInfo* info, bool* hits) const {
         if (!mNodes) {
+            std::fill(hits, hits + numRays, false);
+            return 0;
+        }
+
+        StreamRay streams[kStreamRays];
+        uint32_t  numStreams = 0;
+        uint32_t  nextRay    = 0;
+        uint32_t  numHits    = 0;
+        HitInfo   anyHitInfo;
+
+        auto start = [&](StreamRay& stream) {
+            stream.traversal  = TraversalRay(rays[nextRay], tMin, tMax);
+            stream.ray        = nextRay++;
+            stream.nodeNum    = 0;
+            stream.todoOffset = 0;
+            stream.hit        = false;
+            MCP_BVH_STAT(stream.counters = TraversalCounters();)
+            MCP_BVH_STAT(stream.counters.rays = 1;)
+        };
+
+        while (numStreams < kStreamRays && nextRay < numRays) {
+            start(streams[numStreams++]);
+        }
+
+        while (numStreams > 0) {
+            for (uint32_t i = 0; i < numStreams; ) {
+                StreamRay& stream = streams[i];
+                HitInfo&   rayInfo = AnyHit ? anyHitInfo : info[stream.ray];
+
+                if (stepStream<AnyHit>(stream, rayInfo)) {
+                    ++i;
+                    continue;
+                }
+
+                MCP_BVH_STAT(threadCounters() += stream.counters;)
+
+                hits[stream.ray] = stream.hit;
+                if (stream.hit) {
+                    ++numHits;
+                    if (!AnyHit && stream.closest.deferred) {
+                        deferredHitInfo(stream.traversal.ray, stream.closest, rayInfo);
+                    }
+                }
+
+                /// Refill the slot, or close the gap with the last stream
+                if (nextRay < numRays) {
+                    start(stream);
+                    ++i;
+                } else if (i != --numStreams) {
+                    stream = streams[numStreams];
+                }
+            }
+        }
+
+        return numHits;
+    }
+
+    template <bool AnyHit>
+    bool BVH::stepStream(StreamRay& stream, HitInfo& info) const {
+        const BVHLinearNode* node = &mNodes[stream.nodeNum];
+        TraversalRay&        ray  = stream.traversal;
+
+        MCP_BVH_STAT(TraversalCounters& counters = stream.counters;)
+        MCP_BVH_STAT(++counters.boxesTested;)
+
+        bool done = false;
+
+        if (intersectBox(node->aabb, ray)) {
+            MCP_BVH_STAT(++counters.nodesVisited;)
+
+            if (node->numShapes > 0) {
+                MCP_BVH_STAT(counters.shapesTested += node->numShapes;)
+
+                if (AnyHit) {
+                    float t;
+                    if (intersectLeaf_fast(node->firstShapeOffset, node->numShapes, ray, t)) {
+                        stream.hit = true;
+                        done = true;
+                    }
+                } else if (intersectLeaf(node->firstShapeOffset, node->numShapes, ray, stream.closest, info)) {
+                    stream.hit = true;
+                }
+
+                if (stream.todoOffset == 0) {
+                    done = true;
+                } else {
+                    stream.nodeNum = stream.todo[--stream.todoOffset];
+                }
+
+            } else if (ray.dirIsNeg[node->axis]) {
+                stream.todo[stream.todoOffset++] = stream.nodeNum + 1;
+                stream.nodeNum = node->secondChildOffset;
+            } else {
+                stream.todo[stream.todoOffset++] = node->secondChildOffset;
+                stream.nodeNum = stream.nodeNum + 1;
+            }
+
+        } else if (stream.todoOffset == 0) {
+            done = true;
+        } else {
+            stream.nodeNum = stream.todo[--stream.todoOffset];
+        }
+
+        if (done) {
             return false;
         }
 
-        bool hit = false;
+        memory::prefetch(&mNodes[stream.nodeNum]);
+        return true;
+    }
+
+    bool BVH::intersectLeaf(uint32_t firstShape, uint32_t numShapes, TraversalRay& ray, PrimitiveHit& hit, HitInfo& info) const {
+        if (mGroups && numShapes >= kMinPackedLeafShapes) {
+            switch (mGroups[firstShape / kPrimitiveGroupWidth].leafTypes) {
+            case eTRIANGLES:
+                return intersectGroups<eTRIANGLES>(firstShape, numShapes, ray, hit, info);
+            case eSPHERES:
+                return intersectGroups<eSPHERES>(firstShape, numShapes, ray, hit, info);
+            case eTRIANGLES | eSPHERES:
+                return intersectGroups<eTRIANGLES | eSPHERES>(firstShape, numShapes, ray, hit, info);
+            case eOTHER_SHAPES:
+                return intersectGroups<eOTHER_SHAPES>(firstShape, numShapes, ray, hit, info);
+            default:
+                return intersectGroups<eTRIANGLES | eSPHERES | eOTHER_SHAPES>(firstShape, numShapes, ray, hit, info);
+            }
+        }
+
+        bool found = false;
+
+        for (uint32_t i = 0; i < numShapes; ++i) {
+            const PrimitiveRef& primitive = mPrimitives[firstShape + i];
+            if (mShapes[primitive.shape].get().intersectPrimitive_deferred(primitive.index, ray.ray, ray.tMin, ray.tMax, hit, info)) {
+                ray.tMax = hit.t;
+                hit.primitive = firstShape + i;
+                found = true;
+            }
+        }
+
+        return found;
+    }
+
+    bool BVH::intersectLeaf_fast(uint32_t firstShape, uint32_t numShapes, const TraversalRay& ray, float& t) const {
+        if (mGroups && numShapes >= kMinPackedLeafShapes) {
+            switch (mGroups[firstShape / kPrimitiveGroupWidth].leafTypes) {
+            case eTRIANGLES:
+                return intersectGroups_fast<eTRIANGLES>(firstShape, numShapes, ray, t);
+            case eSPHERES:
+                return intersectGroups_fast<eSPHERES>(firstShape, numShapes, ray, t);
+            case eTRIANGLES | eSPHERES:
+                return intersectGroups_fast<eTRIANGLES | eSPHERES>(firstShape, numShapes, ray, t);
+            case eOTHER_SHAPES:
+                return intersectGroups_fast<eOTHER_SHAPES>(firstShape, numShapes, ray, t);
+            default:
+                return intersectGroups_fast<eTRIANGLES | eSPHERES | eOTHER_SHAPES>(firstShape, numShapes, ray, t);
+            }
+        }
+
+        for (uint32_t i = 0; i < numShapes; ++i) {
+            const PrimitiveRef& primitive = mPrimitives[firstShape + i];
+            if (mShapes[primitive.shape].get().intersectPrimitive_fast(primitive.index, ray.ray, ray.tMin, ray.tMax, t)) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    template <uint32_t Types>
+    bool BVH::intersectGroups(uint32_t firstShape, uint32_t numShapes, TraversalRay& ray, PrimitiveHit& hit, HitInfo& info) const {
+        const Group* group = &mGroups[firstShape / kPrimitiveGroupWidth];
+        bool         found = false;
+
+        for (uint32_t i = 0; i < numShapes; i += kPrimitiveGroupWidth, ++group) {
+            const uint32_t mask = laneMask(numShapes - i);
+            if ((Types & (eTRIANGLES | eSPHERES)) && intersectGroup<Types>(*group, mask, ray.shear, ray.ray, ray.tMin, ray.tMax, hit)) {
+                ray.tMax = hit.t;
+                hit.primitive += firstShape + i;
+                found = true;
+            }
+
+            if (Types & eOTHER_SHAPES) {
+                uint32_t others = Types == eOTHER_SHAPES ? mask : mask & ~(group->triangles | group->spheres);
+                while (others) {
+                    const uint32_t      index     = firstShape + i + countTrailingZeros(others);
+                    const PrimitiveRef& primitive = mPrimitives[index];
+                    others &= others - 1;
+
+                    if (mShapes[primitive.shape].get().intersectPrimitive_deferred(primitive.index, ray.ray, ray.tMin, ray.tMax, hit, info)) {
+                        ray.tMax = hit.t;
+                        hit.primitive = index;
+                        found = true;
+                    }
+                }
+            }
+        }
+
+        return found;
+    }
+
+    template <uint32_t Types>
+    bool BVH::intersectGroups_fast(uint32_t firstShape, uint32_t numShapes, const TraversalRay& ray, float& t) const {
+        const Group* group = &mGroups[firstShape / kPrimitiveGroupWidth];
+
+        for (uint32_t i = 0; i < numShapes; i += kPrimitiveGroupWidth, ++group) {
+            const uint32_t mask = laneMask(numShapes - i);
+            if ((Types & (eTRIANGLES | eSPHERES)) && intersectGroup_fast<Types>(*group, mask, ray.shear, ray.ray, ray.tMin, ray.tMax, t)) {
+                return true;
+            }
+
+            if (Types & eOTHER_SHAPES) {
+                uint32_t others = Types == eOTHER_SHAPES ? mask : mask & ~(group->triangles | group->spheres);
+                while (others) {
+                    const PrimitiveRef& primitive = mPrimitives[firstShape + i + countTrailingZeros(others)];
+                    others &= others - 1;
+
+                    if (mShapes[primitive.shape].get().intersectPrimitive_fast(primitive.index, ray.ray, ray.tMin, ray.tMax, t)) {
+                        return true;
+                    }
+                }
+            }
+        }
+
+        return false;
+    }
+
+    void BVH::deferredHitInfo(const Ray3f& ray, const PrimitiveHit& hit, HitInfo& info) const {
+        /// Packed triangles and spheres are read from their group, which is likely still in cache
+        if (hit.primitive < mNumGroups * kPrimitiveGroupWidth) {
+            const Group&   group = mGroups[hit.primitive / kPrimitiveGroupWidth];
+            const uint32_t lane  = hit.primitive % kPrimitiveGroupWidth;
+            if ((group.triangles | group.spheres) & (1u << lane)) {
+                groupSurfaceInteraction(group, lane, ray, hit, info);
+                return;
+            }
+        }
+
+        const PrimitiveRef& primitive = mPrimitives[hit.primitive];
+        mShapes[primitive.shape].get().computeSurfaceInteraction(primitive.index, ray, hit, info);
+    }
+
+    bool BVH::intersect_fast(const Ray3f& ray, float tMin, float tMax, float& t) const {
+        return intersect_fast(TraversalRay(ray, tMin, tMax), t);
+    }
 
-        Vector3f invDir(1.f / ray.direction().x(), 1.f / ray.direction().y(), 1.f / ray.direction().z());
-        uint32_t dirIsNeg[3] = { invDir.x() < 0.f, invDir.y() < 0.f, invDir.z() < 0.f };
+    bool BVH::intersect_fast(const TraversalRay& ray, float& t) const {
+        if (!mNodes) {
+            return false;
+        }
 
         uint32_t todoOffset = 0;
         uint32_t nodeNum    = 0;
-        uint32_t todo[64];
+        uint32_t todo[kTraversalStackSize];
+
+        /// Any hit will do, so the traversal stops at the first shape that blocks the ray
+        /// and no HitInfo is filled. The near child is still visited first, which is free
+        /// here and finds occluders sooner.
+        MCP_BVH_STAT(TraversalCounters counters;)
+        MCP_BVH_STAT(counters.rays = 1;)
 
         while (true) {
             const BVHLinearNode* node = &mNodes[nodeNum];
+            MCP_BVH_STAT(++counters.boxesTested;)
+
+            if (intersectBox(node->aabb, ray)) {
+                MCP_BVH_STAT(++counters.nodesVisited;)
 
-            if (intersectBox(node->aabb, ray, invDir, dirIsNeg, tMin, tMax)) {
                 if (node->numShapes > 0) {
+                    MCP_BVH_STAT(counters.shapesTested += node->numShapes;)
 
-                    for (uint32_t i = 0; i < node->numShapes; ++i) {
-                        if (mShapes[node->firstShapeOffset + i].get().intersect(ray, tMin, tMax, info)) {
-                            tMax = info.t;
-                            hit = true;
-                        }
+                    if (intersectLeaf_fast(node->firstShapeOffset, node->numShapes, ray, t)) {
+                        MCP_BVH_STAT(threadCounters() += counters;)
+                        return true;
                     }
 
                     if (todoOffset == 0) break;
                     nodeNum = todo[--todoOffset];
 
                 } else {
-                    if (dirIsNeg[node->axis]) {
+                    if (ray.dirIsNeg[node->axis]) {
                         todo[todoOffset++] = nodeNum + 1;
                         nodeNum = node->secondChildOffset;
                     } else {
@@ -450,13 +2917,212 @@ namespace accelerator
             }
         }
 
-        return hit;
-    }
+        MCP_BVH_STAT(threadCounters() += counters;)
 
-    bool BVH::intersect_fast(const Ray3f& ray, float tMin, float tMax, float& t) const {
         return false;
     }
 
+    float BVH::refit() {
+        if (!mNodes) {
+            return 1.f;
+        }
+
+        /// Nodes are laid out depth-first, so every subtree is a contiguous range of
+        /// nodes that follows its root and can be refitted independently of the others
+        const uint32_t grainSize = mThreadPool ? std::max(mNumNodes / (8 * (mThreadPool->numThreads() + 1)), 1024u)
+                                               : mNumNodes;
+
+        std::vector<uint32_t> taskRanges;
+        std::vector<uint32_t> topNodes;
+        collectRefitTasks(0, mNumNodes, grainSize, taskRanges, topNodes);
+
+        const uint32_t numTasks = taskRanges.size() / 2;
+        if (mThreadPool && numTasks > 1) {
+            mThreadPool->parallelFor(numTasks, 1u, [&](uint32_t, uint32_t begin, uint32_t end) {
+                for (uint32_t i = begin; i < end; ++i) {
+                    refitRange(taskRanges[2 * i], taskRanges[2 * i + 1]);
+                }
+            });
+        } else {
+            for (uint32_t i = 0; i < numTasks; ++i) {
+                refitRange(taskRanges[2 * i], taskRanges[2 * i + 1]);
+            }
+        }
+
+        for (uint32_t i = topNodes.size(); i > 0; --i) {
+            refitNode(topNodes[i - 1]);
+        }
+
+        if (mGroups) {
+            packGroups();
+        }
+
+        return mBuildSAHCost > 0.f ? sahCost() / mBuildSAHCost : 1.f;
+    }
+
+    void BVH::collectRefitTasks(uint32_t node, uint32_t end, uint32_t grainSize,
+                                std::vector<uint32_t>& taskRanges, std::vector<uint32_t>& topNodes) const {
+        if (end - node <= grainSize || mNodes[node].numShapes > 0) {
+            taskRanges.push_back(node);
+            taskRanges.push_back(end);
+            return;
+        }
+
+        topNodes.push_back(node);
+
+        const uint32_t secondChild = mNodes[node].secondChildOffset;
+        collectRefitTasks(node + 1,    secondChild, grainSize, taskRanges, topNodes);
+        collectRefitTasks(secondChild, end,         grainSize, taskRanges, topNodes);
+    }
+
+    void BVH::refitRange(uint32_t first, uint32_t end) {
+        for (uint32_t i = end; i > first; --i) {
+            refitNode(i - 1);
+        }
+    }
+
+    void BVH::refitNode(uint32_t node) {
+        BVHLinearNode& linearNode = mNodes[node];
+
+        if (linearNode.numShapes > 0) {
+            AABB3f bbox;
+            for (uint32_t i = 0; i < linearNode.numShapes; ++i) {
+                const PrimitiveRef& primitive = mPrimitives[linearNode.firstShapeOffset + i];
+                bbox = box_union(bbox, mShapes[primitive.shape].get().primitiveAABB(primitive.index));
+            }
+            linearNode.aabb = bbox;
+
+        } else {
+            linearNode.aabb = box_union(mNodes[node + 1].aabb, mNodes[linearNode.secondChildOffset].aabb);
+        }
+    }
+
+    float BVH::sahCost() const {
+        if (!mNodes) {
+            return 0.f;
+        }
+
+        const float rootArea = mNodes[0].aabb.surfaceArea();
+        if (rootArea <= 0.f) {
+            return 0.f;
+        }
+
+        float cost = 0.f;
+        for (uint32_t i = 0; i < mNumNodes; ++i) {
+            const float nodeCost = mNodes[i].numShapes > 0 ? leafCost(mNodes[i].numShapes)
+                                                           : mOptions.traversalCost;
+            cost += nodeCost * mNodes[i].aabb.surfaceArea() / rootArea;
+        }
+
+        return cost;
+    }
+
+    BVH::Stats BVH::stats() const {
+        Stats result;
+        if (!mNodes) {
+            return result;
+        }
+
+        result.numNodes        = mNumNodes;
+        result.numShapeRefs    = std::count_if(mPrimitives.begin(), mPrimitives.end(), [](const PrimitiveRef& primitive) {
+                                     return primitive.shape != kPaddingPrimitive;
+                                 });
+        result.sahCost         = sahCost();
+        result.memoryFootprint = mNumNodes * sizeof(BVHLinearNode) +
+                                 mPrimitives.size() * sizeof(PrimitiveRef) +
+                                 mNumGroups * sizeof(Group) +
+                                 mShapes.size() * sizeof(std::reference_wrapper<Shape>) +
+                                 mShapeStorageSize;
+
+        struct StackEntry {
+            uint32_t node;
+            uint32_t depth;
+        };
+
+        std::vector<StackEntry> todo;
+        todo.push_back({ 0, 0 });
+
+        while (!todo.empty()) {
+            const StackEntry     entry = todo.back();
+            const BVHLinearNode& node  = mNodes[entry.node];
+            todo.pop_back();
+
+            result.maxDepth = std::max(result.maxDepth, entry.depth);
+
+            if (node.numShapes > 0) {
+                ++result.numLeaves;
+
+                if (result.depthHistogram.size() <= entry.depth) {
+                    result.depthHistogram.resize(entry.depth + 1, 0);
+                }
+                if (result.leafSizeHistogram.size() <= node.numShapes) {
+                    result.leafSizeHistogram.resize(node.numShapes + 1, 0);
+                }
+                ++result.depthHistogram[entry.depth];
+                ++result.leafSizeHistogram[node.numShapes];
+
+            } else {
+                ++result.numInteriorNodes;
+                todo.push_back({ node.secondChildOffset, entry.depth + 1 });
+                todo.push_back({ entry.node + 1,         entry.depth + 1 });
+            }
+        }
+
+        return result;
+    }
+
+    BVH::TraversalCounters& BVH::TraversalCounters::operator+= (const TraversalCounters& rhs) {
+        rays         += rhs.rays;
+        nodesVisited += rhs.nodesVisited;
+        boxesTested  += rhs.boxesTested;
+        shapesTested += rhs.shapesTested;
+        return *this;
+    }
+
+    BVH::ThreadCounters::ThreadCounters() {
+        CounterRegistry& registry = counterRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        registry.threads.push_back(&counters);
+    }
+
+    BVH::ThreadCounters::~ThreadCounters() {
+        CounterRegistry& registry = counterRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        registry.exited += counters;
+        registry.threads.erase(std::find(registry.threads.begin(), registry.threads.end(), &counters));
+    }
+
+    BVH::CounterRegistry& BVH::counterRegistry() {
+        static CounterRegistry registry;
+        return registry;
+    }
+
+    BVH::TraversalCounters& BVH::threadCounters() {
+        static thread_local ThreadCounters threadCounters;
+        return threadCounters.counters;
+    }
+
+    BVH::TraversalCounters BVH::traversalCounters() {
+        CounterRegistry& registry = counterRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+
+        TraversalCounters total = registry.exited;
+        for (const TraversalCounters* counters : registry.threads) {
+            total += *counters;
+        }
+        return total;
+    }
+
+    void BVH::resetTraversalCounters() {
+        CounterRegistry& registry = counterRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+
+        registry.exited = TraversalCounters();
+        for (TraversalCounters* counters : registry.threads) {
+            *counters = TraversalCounters();
+        }
+    }
+
     AABB3f BVH::aabb() const {
         return mNodes ? mNodes[0].aabb : AABB3f();
     }
@@ -8,6 +8,7 @@
 #include <vector>
 
 #include "ray.h"
+#include "raypacket.h"
 
 namespace mcp
 {
@@ -104,6 +105,12 @@ namespace mcp
 
         Ray3f getRay(float u, float v) const;
 
+        /// Rays through the centers of the pixels of the RayPacket tile whose top left
+        /// pixel is (x, y), the same rays getRay returns for them. Lanes of pixels outside
+        /// the film are left inactive.
+        template <uint32_t Size>
+        void getRayPacket(uint32_t x, uint32_t y, float tMin, float tMax, RayPacket<Size>& packet) const;
+
         float nearPlane() const {
             return mNearPlane;
         }
@@ -168,6 +175,23 @@ namespace mcp
         rayOrigin = rayOrigin + mCameraUp * mViewportTop * v;
         Vector3f rayDirection = normalize(rayOrigin - mPosition);
 
-        return Ray3f(rayOrigin, rayDirection);
+        return Ray3f(rayOrigin, rayDirection, false);
+    }
+
+    template <uint32_t Size>
+    void Camera::getRayPacket(uint32_t x, uint32_t y, float tMin, float tMax, RayPacket<Size>& packet) const {
+        packet.active = 0;
+
+        for (uint32_t j = 0; j < RayPacket<Size>::kTileHeight; ++j) {
+            for (uint32_t i = 0; i < RayPacket<Size>::kTileWidth; ++i) {
+                if (x + i >= mFilm.width() || y + j >= mFilm.height()) {
+                    continue;
+                }
+
+                const float u = (static_cast<float>(x + i) + 0.5f) / static_cast<float>(mFilm.width());
+                const float v = (static_cast<float>(y + j) + 0.5f) / static_cast<float>(mFilm.height());
+                packet.set(j * RayPacket<Size>::kTileWidth + i, getRay(u, v), tMin, tMax);
+            }
+        }
     }
 }
@@ -0,0 +1,326 @@
+#pragma once
+
+#include <cstring>
+#include <limits>
+
+#include "widebvh.h"
+
+namespace mcp
+{
+namespace accelerator
+{
+    using namespace math;
+
+    /// Wide BVH whose child bounds are quantized to Q (uint8_t or uint16_t) relative to
+    /// the bounds of their parent. Every node keeps a float origin and a power of two
+    /// scale per axis, and child bounds are rounded outwards so that decoding always
+    /// yields a box that contains the original one. Leaves reference shape ranges of
+    /// the source BVH, which has to outlive this one.
+    template <uint32_t Width, typename Q>
+    class CompressedBVH : public Aggregate
+    {
+    public:
+        explicit CompressedBVH(const BVH& bvh);
+        ~CompressedBVH();
+
+        bool intersect(const Ray3f& ray, float tMin, float tMax, HitInfo& info) const override;
+        bool intersect_fast(const Ray3f& ray, float tMin, float tMax, float& t) const override;
+        AABB3f aabb() const override;
+
+        /// Same as above for a ray prepared by the caller, a hit moves ray.tMax to its distance
+        bool intersect(TraversalRay& ray, HitInfo& info) const;
+        bool intersect_fast(const TraversalRay& ray, float& t) const;
+
+        /// Bytes used by the node array
+        size_t memoryFootprint() const {
+            return mNumNodes * sizeof(CompressedNode);
+        }
+
+    private:
+        static_assert(std::numeric_limits<Q>::is_integer && !std::numeric_limits<Q>::is_signed &&
+                      sizeof(Q) <= 2, "Bounds are quantized to 8 or 16 bit unsigned integers");
+
+        static const uint32_t kEmptyChild = 0xFFFFFFFF;
+        static const uint32_t kLeafFlag   = 0x80000000;
+        static const uint32_t kStackSize  = BVH::kTraversalStackSize * (Width - 1) + 1;
+        static const uint32_t kMaxQ       = std::numeric_limits<Q>::max();
+
+        struct CompressedNode {
+            float    origin[3];
+            int8_t   exponent[3];
+            uint8_t  padding;
+            /// Quantized minX, minY, minZ, maxX, maxY, maxZ of every child
+            Q        bounds[6][Width];
+            /// Compressed node index, or first shape | kLeafFlag, or kEmptyChild
+            uint32_t children[Width];
+            uint8_t  numShapes[Width];
+        };
+
+        struct StackEntry {
+            uint32_t child;
+            float    tNear;
+        };
+
+        static float exponentToScale(int8_t exponent);
+        static float dequantize(float origin, uint32_t q, float scale);
+
+        void compress(const typename WideBVH<Width>::WideNode& wideNode, CompressedNode& node) const;
+
+        /// With AnyHit set the traversal stops at the first leaf that reports a hit. Closest
+        /// hit leaf functions shrink ray.tMax through their own reference to the ray.
+        template <bool AnyHit, typename LeafFunc>
+        bool traverse(const TraversalRay& ray, const LeafFunc& leafFunc) const;
+
+        const BVH&      mBVH;
+        CompressedNode* mNodes;
+        uint32_t        mNumNodes;
+    };
+
+    typedef CompressedBVH<4, uint8_t>  CompressedBVH4;
+    typedef CompressedBVH<8, uint8_t>  CompressedBVH8;
+    typedef CompressedBVH<4, uint16_t> CompressedBVH4_16;
+    typedef CompressedBVH<8, uint16_t> CompressedBVH8_16;
+
+    template <uint32_t Width, typename Q>
+    CompressedBVH<Width, Q>::CompressedBVH(const BVH& bvh)
+        : mBVH(bvh)
+        , mNodes(nullptr)
+        , mNumNodes(0)
+    {
+        if (!mBVH.mNodes) {
+            return;
+        }
+
+        /// The wide tree is only needed while compressing, its node order is kept as is
+        const WideBVH<Width> wideBVH(bvh);
+
+        mNumNodes = wideBVH.mNumNodes;
+        mNodes    = memory::allocAligned<CompressedNode>(mNumNodes);
+
+        for (uint32_t i = 0; i < mNumNodes; ++i) {
+            compress(wideBVH.mNodes[i], mNodes[i]);
+        }
+    }
+
+    template <uint32_t Width, typename Q>
+    CompressedBVH<Width, Q>::~CompressedBVH() {
+        memory::freeAligned(mNodes);
+    }
+
+    template <uint32_t Width, typename Q>
+    AABB3f CompressedBVH<Width, Q>::aabb() const {
+        return mBVH.aabb();
+    }
+
+    template <uint32_t Width, typename Q>
+    float CompressedBVH<Width, Q>::exponentToScale(int8_t exponent) {
+        /// Builds 2^exponent directly from the float bits
+        const uint32_t bits = static_cast<uint32_t>(exponent + 127) << 23;
+        float scale;
+        std::memcpy(&scale, &bits, sizeof(scale));
+        return scale;
+    }
+
+    template <uint32_t Width, typename Q>
+    float CompressedBVH<Width, Q>::dequantize(float origin, uint32_t q, float scale) {
+        /// q * scale is exact, so only the addition rounds and building and traversal
+        /// always agree on the decoded value, whether or not it gets fused
+        return origin + static_cast<float>(q) * scale;
+    }
+
+    template <uint32_t Width, typename Q>
+    void CompressedBVH<Width, Q>::compress(const typename WideBVH<Width>::WideNode& wideNode, CompressedNode& node) const {
+        typedef WideBVH<Width> Wide;
+
+        AABB3f parent;
+        for (uint32_t i = 0; i < Width; ++i) {
+            if (wideNode.children[i] != Wide::kEmptyChild) {
+                parent = box_union(parent, AABB3f(Vector3f(wideNode.bounds[0][i], wideNode.bounds[1][i], wideNode.bounds[2][i]),
+                                                  Vector3f(wideNode.bounds[3][i], wideNode.bounds[4][i], wideNode.bounds[5][i])));
+            }
+        }
+
+        float scale[3];
+        for (uint32_t axis = 0; axis < 3; ++axis) {
+            const float extent = parent.max()[axis] - parent.min()[axis];
+
+            /// Smallest power of two for which kMaxQ steps cover the parent
+            int32_t exponent = -126;
+            if (extent > 0.f) {
+                std::frexp(extent / kMaxQ, &exponent);
+                exponent = clamp<int32_t>(exponent, -126, 127);
+            }
+            while (exponent < 127 &&
+                   dequantize(parent.min()[axis], kMaxQ, exponentToScale(exponent)) < parent.max()[axis]) {
+                ++exponent;
+            }
+
+            node.origin[axis]   = parent.min()[axis];
+            node.exponent[axis] = static_cast<int8_t>(exponent);
+            scale[axis]         = exponentToScale(node.exponent[axis]);
+        }
+        node.padding = 0;
+
+        for (uint32_t i = 0; i < Width; ++i) {
+            const uint32_t child = wideNode.children[i];
+
+            if (child == Wide::kEmptyChild) {
+                for (uint32_t axis = 0; axis < 3; ++axis) {
+                    node.bounds[axis][i]     = kMaxQ;
+                    node.bounds[axis + 3][i] = 0;
+                }
+                node.children[i]  = kEmptyChild;
+                node.numShapes[i] = 0;
+                continue;
+            }
+
+            for (uint32_t axis = 0; axis < 3; ++axis) {
+                const float origin = node.origin[axis];
+                const float lo     = wideNode.bounds[axis][i];
+                const float hi     = wideNode.bounds[axis + 3][i];
+
+                /// Round outwards, then step until the decoded bounds are conservative
+                uint32_t qLo = static_cast<uint32_t>(clamp(std::floor((lo - origin) / scale[axis]), 0.f, static_cast<float>(kMaxQ)));
+                uint32_t qHi = static_cast<uint32_t>(clamp(std::ceil((hi - origin) / scale[axis]),  0.f, static_cast<float>(kMaxQ)));
+                while (qLo > 0 && dequantize(origin, qLo, scale[axis]) > lo) {
+                    --qLo;
+                }
+                while (qHi < kMaxQ && dequantize(origin, qHi, scale[axis]) < hi) {
+                    ++qHi;
+                }
+
+                node.bounds[axis][i]     = static_cast<Q>(qLo);
+                node.bounds[axis + 3][i] = static_cast<Q>(qHi);
+            }
+
+            if (child & Wide::kLeafFlag) {
+                const BVH::BVHLinearNode& leaf = mBVH.mNodes[child & ~Wide::kLeafFlag];
+                node.children[i]  = leaf.firstShapeOffset | kLeafFlag;
+                node.numShapes[i] = leaf.numShapes;
+            } else {
+                node.children[i]  = child;
+                node.numShapes[i] = 0;
+            }
+        }
+    }
+
+    template <uint32_t Width, typename Q>
+    template <bool AnyHit, typename LeafFunc>
+    bool CompressedBVH<Width, Q>::traverse(const TraversalRay& ray, const LeafFunc& leafFunc) const {
+        if (!mNodes) {
+            return false;
+        }
+
+        bool hit = false;
+
+        const Vector3f& origin   = ray.ray.origin();
+        const Vector3f& invDir   = ray.invDir;
+        const uint32_t* dirIsNeg = ray.dirIsNeg;
+
+        uint32_t   todoOffset = 0;
+        StackEntry todo[kStackSize];
+        todo[todoOffset++] = { 0, ray.tMin };
+
+        while (todoOffset > 0) {
+            const StackEntry entry = todo[--todoOffset];
+
+            /// A closer hit was found since this entry was pushed
+            if (entry.tNear > ray.tMax) {
+                continue;
+            }
+
+            const CompressedNode& node = mNodes[entry.child];
+
+            /// Decode and test the children against the ray
+            float    tNear[Width];
+            uint32_t mask = 0;
+
+            float nodeOrigin[3];
+            float scale[3];
+            for (uint32_t axis = 0; axis < 3; ++axis) {
+                nodeOrigin[axis] = node.origin[axis];
+                scale[axis]      = exponentToScale(node.exponent[axis]);
+            }
+
+            for (uint32_t i = 0; i < Width; ++i) {
+                float t0 = ray.tMin;
+                float t1 = ray.tMax;
+
+                for (uint32_t axis = 0; axis < 3; ++axis) {
+                    const float nearB = dequantize(nodeOrigin[axis], node.bounds[axis + 3 * dirIsNeg[axis]][i],       scale[axis]);
+                    const float farB  = dequantize(nodeOrigin[axis], node.bounds[axis + 3 * (1 - dirIsNeg[axis])][i], scale[axis]);
+                    t0 = std::max(t0, (nearB - origin[axis]) * invDir[axis]);
+                    t1 = std::min(t1, (farB  - origin[axis]) * invDir[axis] * kBoxFarScale);
+                }
+
+                tNear[i] = t0;
+                mask |= static_cast<uint32_t>(t0 <= t1 && node.children[i] != kEmptyChild) << i;
+            }
+
+            /// Leaves are intersected right away, interior children are sorted by entry
+            /// distance and the farthest is pushed first
+            StackEntry hits[Width];
+            uint32_t   numHits = 0;
+            while (mask) {
+                const uint32_t i = countTrailingZeros(mask);
+                mask &= mask - 1;
+
+                if (node.children[i] & kLeafFlag) {
+                    if (tNear[i] <= ray.tMax && leafFunc(node.children[i] & ~kLeafFlag, node.numShapes[i])) {
+                        if (AnyHit) {
+                            return true;
+                        }
+                        hit = true;
+                    }
+                    continue;
+                }
+
+                StackEntry hitEntry = { node.children[i], tNear[i] };
+                uint32_t   j        = numHits++;
+                while (j > 0 && hits[j - 1].tNear < hitEntry.tNear) {
+                    hits[j] = hits[j - 1];
+                    --j;
+                }
+                hits[j] = hitEntry;
+            }
+
+            for (uint32_t i = 0; i < numHits; ++i) {
+                todo[todoOffset++] = hits[i];
+            }
+        }
+
+        return hit;
+    }
+
+    template <uint32_t Width, typename Q>
+    bool CompressedBVH<Width, Q>::intersect(const Ray3f& ray, float tMin, float tMax, HitInfo& info) const {
+        TraversalRay traversalRay(ray, tMin, tMax);
+        return intersect(traversalRay, info);
+    }
+
+    template <uint32_t Width, typename Q>
+    bool CompressedBVH<Width, Q>::intersect_fast(const Ray3f& ray, float tMin, float tMax, float& t) const {
+        return intersect_fast(TraversalRay(ray, tMin, tMax), t);
+    }
+
+    template <uint32_t Width, typename Q>
+    bool CompressedBVH<Width, Q>::intersect(TraversalRay& ray, HitInfo& info) const {
+        PrimitiveHit closest;
+        const bool hit = traverse<false>(ray, [&](uint32_t firstShape, uint32_t numShapes) {
+            return mBVH.intersectLeaf(firstShape, numShapes, ray, closest, info);
+        });
+
+        if (hit && closest.deferred) {
+            mBVH.deferredHitInfo(ray.ray, closest, info);
+        }
+        return hit;
+    }
+
+    template <uint32_t Width, typename Q>
+    bool CompressedBVH<Width, Q>::intersect_fast(const TraversalRay& ray, float& t) const {
+        return traverse<true>(ray, [&](uint32_t firstShape, uint32_t numShapes) {
+            return mBVH.intersectLeaf_fast(firstShape, numShapes, ray, t);
+        });
+    }
+}
+}
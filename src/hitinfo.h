@@ -13,4 +13,19 @@ namespace mcp
         float u;
         float v;
     };
+
+    /// What a closest hit search keeps of its current closest hit: the distance, the
+    /// primitive and its raw barycentric weights. The full HitInfo is only computed for
+    /// the hit that ends up closest.
+    struct PrimitiveHit
+    {
+        float    t;
+        /// Weights of the second and third vertex of a triangle, unused by other primitives
+        float    b1;
+        float    b2;
+        /// Index of the primitive, numbered by whoever recorded the hit
+        uint32_t primitive;
+        /// False when the HitInfo of the hit was filled in right away
+        bool     deferred;
+    };
 }
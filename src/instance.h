@@ -0,0 +1,97 @@
+#pragma once
+
+#include "aggregate.h"
+#include "transform.h"
+
+namespace mcp
+{
+namespace accelerator
+{
+    using namespace math;
+
+    /// Places a shared object, typically a bottom-level BVH, in the scene with its own
+    /// transform. Rays are moved into object space instead of duplicating geometry, so
+    /// a top-level BVH built over instances only needs a rebuild or refit when they move.
+    /// The referenced object has to outlive the instance.
+    class Instance : public Aggregate
+    {
+    public:
+        Instance(const Shape& object, const Transform& objectToWorld);
+
+        const Shape& object() const {
+            return mObject;
+        }
+
+        const Transform& objectToWorld() const {
+            return mObjectToWorld;
+        }
+
+        void setTransform(const Transform& objectToWorld);
+
+        bool intersect(const Ray3f& ray, float tMin, float tMax, HitInfo& info) const override;
+        bool intersect_fast(const Ray3f& ray, float tMin, float tMax, float& t) const override;
+        AABB3f aabb() const override;
+        uint64_t contentHash(uint64_t seed) const override;
+        size_t cloneSize() const override;
+        Shape* cloneInto(void* memory) const override;
+
+    private:
+        Ray3f toObject(const Ray3f& ray) const;
+
+        const Shape& mObject;
+        Transform    mObjectToWorld;
+        Transform    mWorldToObject;
+        AABB3f       mAABB;
+    };
+
+    Instance::Instance(const Shape& object, const Transform& objectToWorld)
+        : mObject(object)
+    {
+        setTransform(objectToWorld);
+    }
+
+    void Instance::setTransform(const Transform& objectToWorld) {
+        mObjectToWorld = objectToWorld;
+        mWorldToObject = objectToWorld.inverse();
+        mAABB          = mObjectToWorld.transformBox(mObject.aabb());
+    }
+
+    Ray3f Instance::toObject(const Ray3f& ray) const {
+        /// The direction is left unnormalized so t values are the same in both spaces
+        return Ray3f(mWorldToObject.transformPoint(ray.origin()),
+                     mWorldToObject.transformVector(ray.direction()), false);
+    }
+
+    bool Instance::intersect(const Ray3f& ray, float tMin, float tMax, HitInfo& info) const {
+        if (!mObject.intersect(toObject(ray), tMin, tMax, info)) {
+            return false;
+        }
+
+        info.point  = ray.origin() + info.t * ray.direction();
+        info.normal = normalize(mObjectToWorld.transformNormal(info.normal));
+
+        return true;
+    }
+
+    bool Instance::intersect_fast(const Ray3f& ray, float tMin, float tMax, float& t) const {
+        return mObject.intersect_fast(toObject(ray), tMin, tMax, t);
+    }
+
+    uint64_t Instance::contentHash(uint64_t seed) const {
+        seed = hashBytes(mObjectToWorld.matrix(), sizeof(mObjectToWorld.matrix()), seed);
+        return mObject.contentHash(seed);
+    }
+
+    size_t Instance::cloneSize() const {
+        return sizeof(*this);
+    }
+
+    Shape* Instance::cloneInto(void* memory) const {
+        return new (memory) Instance(*this);
+    }
+
+    AABB3f Instance::aabb() const {
+        return mAABB;
+    }
+}
+}
@@ -1,11 +1,13 @@
 #include <iostream>
 #include <ctime>
+#include <memory>
 
 #include "util.h"
 #include "camera.h"
 #include "sphere.h"
 #include "triangle.h"
 #include "bvh.h"
+#include "meshloader.h"
 #include "threadpool.h"
 
 using namespace mcp::math;
@@ -19,17 +21,12 @@ Trianglef gTriangle = Trianglef(Vector3f(-1.f,  1.0f, 0.f),
                                 Vector3f( 1.f,  1.0f, 0.f),
                                 Vector3f( 0.f, -1.0f, 0.f));
 
-// TODO: Make this take a range of pixels
-//       .. and also do proper lighting duh ..
-void render(const BVH& bvh, const Ray3f& ray, mcp::Pixel8u& pixel)
+// TODO: Do proper lighting duh ..
+void shade(const mcp::HitInfo& info, mcp::Pixel8u& pixel)
 {
-    mcp::HitInfo info;
-
-    if (bvh.intersect(ray, 0.1f, 100.0f, info)) {
-        pixel.r = 255 * info.u;
-        pixel.g = 255 * info.v;
-        pixel.b = 255 * (1.f - info.u - info.v);
-    }
+    pixel.r = 255 * info.u;
+    pixel.g = 255 * info.v;
+    pixel.b = 255 * (1.f - info.u - info.v);
 }
 
 struct ImageRegion
@@ -38,31 +35,104 @@ struct ImageRegion
     uint32_t startY, endY;
 };
 
+// Primary rays are traced as packets covering small tiles of the region
+typedef RayPacket<16> CameraPacket;
+
 void render2(const BVH& bvh, mcp::Camera& camera, const ImageRegion& region)
 {
-    for (uint32_t j = region.startY; j < region.endY; ++j) {
-        for (uint32_t i = region.startX; i < region.endX; ++i) {
-            const float u = (static_cast<float>(i) + 0.5f) / static_cast<float>(camera.film().width());
-            const float v = (static_cast<float>(j) + 0.5f) / static_cast<float>(camera.film().height());
-            Ray3f cameraRay = camera.getRay(u, v);
-
-            mcp::Pixel8u& pixel = camera.film().pixel(i, j);
-
-            render(bvh, cameraRay, pixel);
+    for (uint32_t j = region.startY; j < region.endY; j += CameraPacket::kTileHeight) {
+        for (uint32_t i = region.startX; i < region.endX; i += CameraPacket::kTileWidth) {
+            CameraPacket packet;
+            camera.getRayPacket(i, j, 0.1f, 100.0f, packet);
+
+            // Tiles may stick out of the region into the next one
+            for (uint32_t y = 0; y < CameraPacket::kTileHeight; ++y) {
+                for (uint32_t x = 0; x < CameraPacket::kTileWidth; ++x) {
+                    if (i + x >= region.endX || j + y >= region.endY) {
+                        packet.active &= ~(1u << (y * CameraPacket::kTileWidth + x));
+                    }
+                }
+            }
+
+            mcp::HitInfo info[CameraPacket::kSize];
+            uint32_t hits = bvh.intersectPacket(packet, info);
+
+            for (; hits; hits &= hits - 1) {
+                const uint32_t lane = mcp::countTrailingZeros(hits);
+                shade(info[lane], camera.film().pixel(i + lane % CameraPacket::kTileWidth,
+                                                      j + lane / CameraPacket::kTileWidth));
+            }
         }
     }
 }
 
-int main()
+int main(int argc, char** argv)
 {
+    // Multithreading, totally useless with simple scenes but hey it works
+    const uint32_t numThreads = 7;
+    ThreadPool threadPool(numThreads);
+    std::vector<ThreadPool::TaskFuture<void>> futures;
+    std::clock_t startTime;
+
     // Test scene
     std::vector<std::reference_wrapper<Shape> > shapes;
-    shapes.reserve(2);
+    shapes.reserve(3);
 
     shapes.push_back(std::reference_wrapper<Shape>(gSphere));
     shapes.push_back(std::reference_wrapper<Shape>(gTriangle));
 
-    BVH bvh(shapes, 1, BVH::eSAH);
+    // An OBJ or PLY mesh given on the command line is added to the test scene
+    std::unique_ptr<TriangleMesh> mesh;
+    if (argc > 1) {
+        MeshData meshData;
+        startTime = std::clock();
+        if (!MeshLoader(&threadPool).load(argv[1], meshData)) {
+            return 1;
+        }
+
+        const uint32_t numTriangles = static_cast<uint32_t>(meshData.indices.size() / 3);
+        mesh.reset(new TriangleMesh(std::move(meshData.x), std::move(meshData.y), std::move(meshData.z),
+                                    std::move(meshData.indices)));
+        shapes.push_back(std::reference_wrapper<Shape>(*mesh));
+
+        double duration = (std::clock() - startTime) / static_cast<double>(CLOCKS_PER_SEC);
+        std::cout << "Loaded " << numTriangles << " triangles with dt: " << duration << " sec" << std::endl;
+    }
+
+    // Leaves as wide as a primitive group, so loaded meshes are tested a group at a time
+    BVH bvh(shapes, kPrimitiveGroupWidth, BVH::eSAH, &threadPool);
+
+    // The reinsertion optimizer moves subtrees around, check it on a build it is meant for
+    // and that the leaves still reach every shape. The triangle around the small ones spans
+    // the whole scene, so the small ones it displaces get reinserted next to the root.
+    {
+        std::vector<Trianglef> checkTriangles;
+        checkTriangles.reserve(65);
+        for (uint32_t i = 0; i < 64; ++i) {
+            const Vector3f corner(static_cast<float>(i % 4), static_cast<float>(i / 4 % 4),
+                                  static_cast<float>(i / 16));
+            checkTriangles.push_back(Trianglef(corner, corner + Vector3f(0.5f, 0.f, 0.f),
+                                               corner + Vector3f(0.f, 0.5f, 0.f)));
+        }
+        checkTriangles.push_back(Trianglef(Vector3f(-100.f, -100.f, -100.f), Vector3f(100.f, 100.f, 100.f),
+                                           Vector3f(100.f, 100.f, -100.f)));
+
+        std::vector<std::reference_wrapper<Shape> > checkShapes(checkTriangles.begin(), checkTriangles.end());
+
+        BVH::BuildOptions options;
+        options.optimizationBudget = 0.1f;
+        const BVH::Stats stats = BVH(checkShapes, 1, BVH::eMIDDLE, &threadPool, options).stats();
+
+        uint32_t numReached = 0;
+        for (uint32_t i = 0; i < stats.leafSizeHistogram.size(); ++i) {
+            numReached += i * stats.leafSizeHistogram[i];
+        }
+        if (numReached != checkShapes.size()) {
+            std::cerr << "Error: Optimized BVH reaches " << numReached << " of "
+                      << checkShapes.size() << " shapes" << std::endl;
+            return 1;
+        }
+    }
 
     // Camera setup
     Vector3f cameraPosition(0.f, 0.f, 1.f);
@@ -71,12 +141,6 @@ int main()
     uint32_t height = 500;
     mcp::Camera camera(cameraPosition, cameraLookAt, 40.f, 0.1f, 100.f, width, height);
 
-    // Multithreading, totally useless with simple scenes but hey it works
-    const uint32_t numThreads = 7;
-    ThreadPool threadPool(numThreads);
-    std::vector<ThreadPool::TaskFuture<void>> futures;
-    std::clock_t startTime;
-
     // Init pixels ortherwise all hell breaks loose
     for (uint32_t i = 0; i < width * height; ++i) {
         camera.film().pixels().push_back(mcp::Pixel8u(0, 0, 0));
@@ -109,6 +173,19 @@ int main()
     double duration = (std::clock() - startTime) / static_cast<double>(CLOCKS_PER_SEC);
     std::cout << "Finished Tracing with dt: " << duration << " sec" << std::endl;
 
+#if defined(MCP_BVH_STATS)
+    const BVH::Stats stats = bvh.stats();
+    std::cout << "BVH: " << stats.numNodes << " nodes, " << stats.numLeaves << " leaves, depth "
+              << stats.maxDepth << ", SAH cost " << stats.sahCost << ", "
+              << stats.memoryFootprint << " bytes" << std::endl;
+
+    const BVH::TraversalCounters counters = BVH::traversalCounters();
+    const double numRays = std::max<double>(static_cast<double>(counters.rays), 1.0);
+    std::cout << "Per ray: " << counters.nodesVisited / numRays << " nodes visited, "
+              << counters.boxesTested / numRays << " boxes tested, "
+              << counters.shapesTested / numRays << " shapes tested" << std::endl;
+#endif
+
     // Dump pixels to file
     camera.film().write(std::string("image.ppm"));
 
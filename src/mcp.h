@@ -33,3 +33,19 @@
 #define MCP_POINTER_SIZE 4
 #endif
 #endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MCP_SSE
+#endif
+
+#if defined(__AVX__)
+#define MCP_AVX
+#endif
+
+#if defined(__AVX2__)
+#define MCP_AVX2
+#endif
+
+#if defined(__FMA__)
+#define MCP_FMA
+#endif
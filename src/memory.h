@@ -2,6 +2,21 @@
 
 #include "mcp.h"
 
+#include <string>
+
+#if defined(MCP_PLATFORM_WINDOWS)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(MCP_SSE)
+#include <xmmintrin.h>
+#endif
+
 namespace mcp
 {
 namespace memory
@@ -47,5 +62,119 @@ namespace memory
 #endif
     }
 
+    /// Asks for the cache line holding address to be loaded into all cache levels,
+    /// without waiting for it
+    inline void prefetch(const void* address) {
+#if defined(MCP_SSE)
+        _mm_prefetch(static_cast<const char*>(address), _MM_HINT_T0);
+#elif defined(__GNUC__)
+        __builtin_prefetch(address);
+#endif
+    }
+
+    /// Maps a whole file into memory. Pages are copy-on-write, so callers may modify
+    /// the mapped data in place without touching the file.
+    class MappedFile
+    {
+    public:
+        MappedFile() : mData(nullptr), mSize(0) {}
+        ~MappedFile() {
+            close();
+        }
+
+        MappedFile(const MappedFile& rhs) = delete;
+        MappedFile& operator= (const MappedFile& rhs) = delete;
+
+        bool open(const std::string& filePath);
+        void close();
+
+        bool isOpen() const {
+            return mData != nullptr;
+        }
+
+        uint8_t* data() const {
+            return mData;
+        }
+
+        size_t size() const {
+            return mSize;
+        }
+
+    private:
+        uint8_t* mData;
+        size_t   mSize;
+    };
+
+    bool MappedFile::open(const std::string& filePath) {
+        close();
+
+#if defined(MCP_PLATFORM_WINDOWS)
+        HANDLE file = CreateFileA(filePath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                                  OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+            CloseHandle(file);
+            return false;
+        }
+
+        HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+        CloseHandle(file);
+        if (!mapping) {
+            return false;
+        }
+
+        void* view = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+        CloseHandle(mapping);
+        if (!view) {
+            return false;
+        }
+
+        mData = static_cast<uint8_t*>(view);
+        mSize = static_cast<size_t>(fileSize.QuadPart);
+
+#else
+        int file = ::open(filePath.c_str(), O_RDONLY);
+        if (file < 0) {
+            return false;
+        }
+
+        struct stat fileStat;
+        if (fstat(file, &fileStat) != 0 || fileStat.st_size == 0) {
+            ::close(file);
+            return false;
+        }
+
+        void* view = mmap(nullptr, fileStat.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+        ::close(file);
+        if (view == MAP_FAILED) {
+            return false;
+        }
+
+        mData = static_cast<uint8_t*>(view);
+        mSize = static_cast<size_t>(fileStat.st_size);
+#endif
+
+        return true;
+    }
+
+    void MappedFile::close() {
+        if (!mData) {
+            return;
+        }
+
+#if defined(MCP_PLATFORM_WINDOWS)
+        UnmapViewOfFile(mData);
+#else
+        munmap(mData, mSize);
+#endif
+
+        mData = nullptr;
+        mSize = 0;
+    }
+
 }
 }
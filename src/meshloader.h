@@ -0,0 +1,769 @@
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "memory.h"
+#include "threadpool.h"
+#include "trianglemesh.h"
+
+namespace mcp
+{
+namespace geometry
+{
+    /// Positions as separate x, y and z arrays and three vertex indices per triangle, the
+    /// layout the moving TriangleMesh constructor takes over
+    struct MeshData {
+        std::vector<float>    x;
+        std::vector<float>    y;
+        std::vector<float>    z;
+        std::vector<uint32_t> indices;
+    };
+
+    /// Loads the positions and faces of Wavefront OBJ and binary PLY files. Files are
+    /// memory-mapped and parsed in two passes over chunks, on the workers of the thread
+    /// pool when one is given: the first pass counts the vertices and triangles of every
+    /// chunk, the second parses each chunk straight into its range of the final arrays.
+    /// Polygons are split into triangle fans. Normals, texture coordinates, groups and
+    /// materials are ignored.
+    class MeshLoader
+    {
+    public:
+        explicit MeshLoader(thread::ThreadPool* threadPool = nullptr);
+
+        /// Picks the format from the file extension. Returns false and prints why if the
+        /// file can't be read or is malformed, mesh is left empty then.
+        bool load(const std::string& filePath, MeshData& mesh) const;
+        bool loadOBJ(const std::string& filePath, MeshData& mesh) const;
+        bool loadPLY(const std::string& filePath, MeshData& mesh) const;
+
+    private:
+        /// Bytes of OBJ text, and PLY vertices or faces, parsed by one task
+        static const size_t   kOBJChunkSize = 1 << 22;
+        static const uint32_t kPLYChunkSize = 1 << 18;
+
+        /// Lines of an OBJ file handled by one task
+        struct OBJChunk {
+            const char* begin;
+            const char* end;
+            uint32_t    firstVertex;
+            uint32_t    firstTriangle;
+            uint32_t    numVertices;
+            uint32_t    numTriangles;
+        };
+
+        enum PLYType {
+            eINT8, eUINT8, eINT16, eUINT16, eINT32, eUINT32, eFLOAT32, eFLOAT64, eINVALID
+        };
+
+        struct PLYProperty {
+            std::string name;
+            PLYType     type;
+            /// Type of the element count of list properties, eINVALID for scalars
+            PLYType     countType;
+        };
+
+        struct PLYElement {
+            std::string              name;
+            uint64_t                 count;
+            std::vector<PLYProperty> properties;
+        };
+
+        /// Counts (Parse = false) or parses into mesh the vertices and triangles of a chunk
+        template <bool Parse>
+        static bool scanOBJ(OBJChunk& chunk, MeshData& mesh);
+
+        static bool parseFloat(const char*& p, const char* end, float& value);
+        static bool parseIndex(const char*& p, const char* end, int64_t& index);
+
+        static PLYType plyType(const std::string& name);
+        static uint32_t plyTypeSize(PLYType type);
+        static double readPLYValue(const uint8_t* p, PLYType type, bool swapBytes);
+        /// Bytes of the element's scalar properties, and whether it has any list property
+        static uint32_t plyFixedSize(const PLYElement& element, bool& hasLists);
+        /// Size of one record starting at p, or 0 if it runs past end
+        static size_t plyRecordSize(const PLYElement& element, const uint8_t* p, const uint8_t* end, bool swapBytes);
+
+        bool readPLYFaces(const PLYElement& element, const uint8_t* data, const uint8_t* end, bool swapBytes,
+                          MeshData& mesh) const;
+
+        template <typename Func>
+        void forEachChunk(uint32_t count, uint32_t chunkSize, const Func& func) const;
+
+        thread::ThreadPool* mThreadPool;
+    };
+
+    MeshLoader::MeshLoader(thread::ThreadPool* threadPool)
+        : mThreadPool(threadPool)
+    {
+    }
+
+    bool MeshLoader::load(const std::string& filePath, MeshData& mesh) const {
+        const size_t dot       = filePath.find_last_of('.');
+        std::string  extension = dot == std::string::npos ? std::string() : filePath.substr(dot + 1);
+        for (char& c : extension) {
+            c = static_cast<char>(tolower(c));
+        }
+
+        if (extension == "obj") {
+            return loadOBJ(filePath, mesh);
+        }
+        if (extension == "ply") {
+            return loadPLY(filePath, mesh);
+        }
+
+        std::cerr << "Error: Unknown mesh file format: " << filePath << std::endl;
+        return false;
+    }
+
+    bool MeshLoader::loadOBJ(const std::string& filePath, MeshData& mesh) const {
+        mesh = MeshData();
+
+        memory::MappedFile file;
+        if (!file.open(filePath)) {
+            std::cerr << "Error: Could not open mesh file: " << filePath << std::endl;
+            return false;
+        }
+
+        const char* data = reinterpret_cast<const char*>(file.data());
+        const char* end  = data + file.size();
+
+        /// Chunks start right after the first line break past every kOBJChunkSize bytes
+        std::vector<OBJChunk> chunks;
+        for (const char* begin = data; begin < end; ) {
+            const char* chunkEnd = end;
+            if (static_cast<size_t>(end - begin) > kOBJChunkSize) {
+                const void* lineEnd = memchr(begin + kOBJChunkSize, '\n', end - begin - kOBJChunkSize);
+                chunkEnd = lineEnd ? static_cast<const char*>(lineEnd) + 1 : end;
+            }
+
+            chunks.push_back({ begin, chunkEnd, 0, 0, 0, 0 });
+            begin = chunkEnd;
+        }
+
+        const uint32_t    numChunks = static_cast<uint32_t>(chunks.size());
+        std::atomic<bool> valid(true);
+
+        forEachChunk(numChunks, 1, [&](uint32_t chunk, uint32_t, uint32_t) {
+            if (!scanOBJ<false>(chunks[chunk], mesh)) {
+                valid = false;
+            }
+        });
+
+        uint64_t numVertices  = 0;
+        uint64_t numTriangles = 0;
+        for (OBJChunk& chunk : chunks) {
+            chunk.firstVertex   = static_cast<uint32_t>(numVertices);
+            chunk.firstTriangle = static_cast<uint32_t>(numTriangles);
+            numVertices  += chunk.numVertices;
+            numTriangles += chunk.numTriangles;
+        }
+
+        if (numVertices > UINT32_MAX || 3 * numTriangles > UINT32_MAX) {
+            valid = false;
+        }
+
+        if (valid) {
+            mesh.x.resize(numVertices);
+            mesh.y.resize(numVertices);
+            mesh.z.resize(numVertices);
+            mesh.indices.resize(3 * numTriangles);
+
+            forEachChunk(numChunks, 1, [&](uint32_t chunk, uint32_t, uint32_t) {
+                if (!scanOBJ<true>(chunks[chunk], mesh)) {
+                    valid = false;
+                }
+            });
+        }
+
+        if (!valid) {
+            std::cerr << "Error: Malformed OBJ file: " << filePath << std::endl;
+            mesh = MeshData();
+            return false;
+        }
+
+        return true;
+    }
+
+    template <bool Parse>
+    bool MeshLoader::scanOBJ(OBJChunk& chunk, MeshData& mesh) {
+        const uint32_t totalVertices = static_cast<uint32_t>(mesh.x.size());
+
+        uint32_t vertex   = chunk.firstVertex;
+        uint32_t triangle = chunk.firstTriangle;
+
+        for (const char* line = chunk.begin; line < chunk.end; ) {
+            const char* lineEnd = static_cast<const char*>(memchr(line, '\n', chunk.end - line));
+            if (!lineEnd) {
+                lineEnd = chunk.end;
+            }
+
+            const char* p = line;
+            while (p < lineEnd && (*p == ' ' || *p == '\t')) {
+                ++p;
+            }
+
+            const bool keyword = p + 1 < lineEnd && (p[1] == ' ' || p[1] == '\t');
+
+            if (keyword && p[0] == 'v') {
+                p += 2;
+                if (Parse) {
+                    if (!parseFloat(p, lineEnd, mesh.x[vertex]) ||
+                        !parseFloat(p, lineEnd, mesh.y[vertex]) ||
+                        !parseFloat(p, lineEnd, mesh.z[vertex])) {
+                        return false;
+                    }
+                }
+                ++vertex;
+
+            } else if (keyword && p[0] == 'f') {
+                p += 2;
+
+                /// Negative indices count back from the last vertex defined before the face
+                uint32_t corners = 0;
+                uint32_t first   = 0;
+                uint32_t last    = 0;
+                int64_t  index;
+                while (parseIndex(p, lineEnd, index)) {
+                    if (Parse) {
+                        const int64_t resolved = index > 0 ? index - 1 : static_cast<int64_t>(vertex) + index;
+                        if (index == 0 || resolved < 0 || resolved >= totalVertices) {
+                            return false;
+                        }
+
+                        const uint32_t current = static_cast<uint32_t>(resolved);
+                        if (corners == 0) {
+                            first = current;
+                        } else if (corners >= 2) {
+                            uint32_t* indices = &mesh.indices[3 * static_cast<size_t>(triangle++)];
+                            indices[0] = first;
+                            indices[1] = last;
+                            indices[2] = current;
+                        }
+                        last = current;
+                    }
+                    ++corners;
+                }
+
+                /// Anything but whitespace left over is a malformed index
+                while (p < lineEnd && (*p == ' ' || *p == '\t' || *p == '\r')) {
+                    ++p;
+                }
+                if (corners < 3 || p != lineEnd) {
+                    return false;
+                }
+
+                if (!Parse) {
+                    triangle += corners - 2;
+                }
+            }
+
+            line = lineEnd + 1;
+        }
+
+        if (!Parse) {
+            chunk.numVertices  = vertex - chunk.firstVertex;
+            chunk.numTriangles = triangle - chunk.firstTriangle;
+        }
+        return true;
+    }
+
+    bool MeshLoader::parseFloat(const char*& p, const char* end, float& value) {
+        /// Powers of ten that are exact in double precision
+        static const double kPowers[] = {
+            1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+        };
+
+        while (p < end && (*p == ' ' || *p == '\t')) {
+            ++p;
+        }
+
+        bool negative = false;
+        if (p < end && (*p == '-' || *p == '+')) {
+            negative = *p++ == '-';
+        }
+
+        /// Up to 19 significant digits fit the mantissa, the rest only move the exponent
+        uint64_t mantissa = 0;
+        int32_t  exponent = 0;
+        uint32_t digits   = 0;
+        bool     any      = false;
+
+        for (; p < end && *p >= '0' && *p <= '9'; ++p, any = true) {
+            if (digits < 19) {
+                mantissa = 10 * mantissa + (*p - '0');
+                digits  += mantissa != 0;
+            } else {
+                ++exponent;
+            }
+        }
+
+        if (p < end && *p == '.') {
+            for (++p; p < end && *p >= '0' && *p <= '9'; ++p, any = true) {
+                if (digits < 19) {
+                    mantissa = 10 * mantissa + (*p - '0');
+                    digits  += mantissa != 0;
+                    --exponent;
+                }
+            }
+        }
+
+        if (!any) {
+            return false;
+        }
+
+        if (p < end && (*p == 'e' || *p == 'E')) {
+            ++p;
+            bool negativeExponent = false;
+            if (p < end && (*p == '-' || *p == '+')) {
+                negativeExponent = *p++ == '-';
+            }
+
+            int32_t power = 0;
+            bool    anyPower = false;
+            for (; p < end && *p >= '0' && *p <= '9'; ++p, anyPower = true) {
+                power = std::min(10 * power + (*p - '0'), 100000);
+            }
+
+            if (!anyPower) {
+                return false;
+            }
+            exponent += negativeExponent ? -power : power;
+        }
+
+        double result = static_cast<double>(mantissa);
+        if (exponent >= 0 && exponent <= 22) {
+            result *= kPowers[exponent];
+        } else if (exponent < 0 && exponent >= -22) {
+            result /= kPowers[-exponent];
+        } else {
+            result *= std::pow(10.0, exponent);
+        }
+
+        value = static_cast<float>(negative ? -result : result);
+        return true;
+    }
+
+    bool MeshLoader::parseIndex(const char*& p, const char* end, int64_t& index) {
+        while (p < end && (*p == ' ' || *p == '\t')) {
+            ++p;
+        }
+
+        const char* start    = p;
+        bool        negative = false;
+        if (p < end && (*p == '-' || *p == '+')) {
+            negative = *p++ == '-';
+        }
+
+        int64_t value = 0;
+        bool    any   = false;
+        for (; p < end && *p >= '0' && *p <= '9'; ++p, any = true) {
+            value = std::min<int64_t>(10 * value + (*p - '0'), INT64_C(1) << 40);
+        }
+
+        if (!any) {
+            p = start;
+            return false;
+        }
+
+        /// Texture coordinate and normal indices of v/vt/vn corners are skipped
+        while (p < end && *p != ' ' && *p != '\t' && *p != '\r') {
+            if (*p != '/' && (*p < '0' || *p > '9') && *p != '-') {
+                p = start;
+                return false;
+            }
+            ++p;
+        }
+
+        index = negative ? -value : value;
+        return true;
+    }
+
+    bool MeshLoader::loadPLY(const std::string& filePath, MeshData& mesh) const {
+        mesh = MeshData();
+
+        memory::MappedFile file;
+        if (!file.open(filePath)) {
+            std::cerr << "Error: Could not open mesh file: " << filePath << std::endl;
+            return false;
+        }
+
+        const uint8_t* data = file.data();
+        const uint8_t* end  = data + file.size();
+
+        /// The header is text up to and including the end_header line
+        static const char kEndHeader[] = "end_header";
+        const uint8_t*    p            = data;
+        const uint8_t*    body         = nullptr;
+
+        std::vector<PLYElement> elements;
+        bool                    binary    = false;
+        bool                    swapBytes = false;
+        bool                    valid     = file.size() >= 4 && memcmp(data, "ply", 3) == 0;
+
+        while (valid && p < end && !body) {
+            const uint8_t* lineEnd = static_cast<const uint8_t*>(memchr(p, '\n', end - p));
+            if (!lineEnd) {
+                valid = false;
+                break;
+            }
+
+            std::string line(reinterpret_cast<const char*>(p), lineEnd - p);
+            p = lineEnd + 1;
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+
+            std::vector<std::string> tokens;
+            for (size_t begin = 0; begin < line.size(); ) {
+                const size_t tokenEnd = std::min(line.find_first_of(" \t", begin), line.size());
+                if (tokenEnd > begin) {
+                    tokens.push_back(line.substr(begin, tokenEnd - begin));
+                }
+                begin = tokenEnd + 1;
+            }
+
+            if (tokens.empty() || tokens[0] == "ply" || tokens[0] == "comment" || tokens[0] == "obj_info") {
+                continue;
+            }
+
+            if (tokens[0] == kEndHeader) {
+                body = p;
+            } else if (tokens[0] == "format" && tokens.size() >= 2) {
+                binary    = tokens[1] == "binary_little_endian" || tokens[1] == "binary_big_endian";
+                /// Values are stored in file order and swapped on a big endian mismatch
+                const uint16_t probe = 1;
+                const bool     littleEndianHost = *reinterpret_cast<const uint8_t*>(&probe) == 1;
+                swapBytes = (tokens[1] == "binary_big_endian") == littleEndianHost;
+            } else if (tokens[0] == "element" && tokens.size() == 3) {
+                const char*              countBegin = tokens[2].c_str();
+                char*                    countEnd   = nullptr;
+                const unsigned long long count      = strtoull(countBegin, &countEnd, 10);
+
+                valid = countBegin[0] >= '0' && countBegin[0] <= '9' && *countEnd == '\0';
+                elements.push_back({ tokens[1], count, {} });
+            } else if (tokens[0] == "property" && tokens.size() == 3 && !elements.empty()) {
+                elements.back().properties.push_back({ tokens[2], plyType(tokens[1]), eINVALID });
+                valid = elements.back().properties.back().type != eINVALID;
+            } else if (tokens[0] == "property" && tokens.size() == 5 && tokens[1] == "list" && !elements.empty()) {
+                elements.back().properties.push_back({ tokens[4], plyType(tokens[3]), plyType(tokens[2]) });
+                valid = elements.back().properties.back().type != eINVALID &&
+                        elements.back().properties.back().countType != eINVALID;
+            } else {
+                valid = false;
+            }
+        }
+
+        if (!valid || !body) {
+            std::cerr << "Error: Malformed PLY header: " << filePath << std::endl;
+            return false;
+        }
+        if (!binary) {
+            std::cerr << "Error: Only binary PLY files are supported: " << filePath << std::endl;
+            return false;
+        }
+
+        bool foundVertices = false;
+        bool foundFaces    = false;
+
+        for (const PLYElement& element : elements) {
+            bool           hasLists;
+            const uint32_t stride = plyFixedSize(element, hasLists);
+
+            if (element.name == "vertex" && !hasLists) {
+                int32_t axisProperty[3] = { -1, -1, -1 };
+                uint32_t axisOffset[3]  = { 0, 0, 0 };
+                for (uint32_t i = 0, offset = 0; i < element.properties.size(); ++i) {
+                    const PLYProperty& property = element.properties[i];
+                    for (uint32_t axis = 0; axis < 3; ++axis) {
+                        if (property.name.size() == 1 && property.name[0] == "xyz"[axis]) {
+                            axisProperty[axis] = i;
+                            axisOffset[axis]   = offset;
+                        }
+                    }
+                    offset += plyTypeSize(property.type);
+                }
+
+                if (axisProperty[0] < 0 || axisProperty[1] < 0 || axisProperty[2] < 0 ||
+                    element.count > UINT32_MAX || element.count * stride > static_cast<uint64_t>(end - body)) {
+                    valid = false;
+                    break;
+                }
+
+                const uint32_t numVertices = static_cast<uint32_t>(element.count);
+                mesh.x.resize(numVertices);
+                mesh.y.resize(numVertices);
+                mesh.z.resize(numVertices);
+
+                float* axes[3] = { mesh.x.data(), mesh.y.data(), mesh.z.data() };
+                PLYType types[3];
+                for (uint32_t axis = 0; axis < 3; ++axis) {
+                    types[axis] = element.properties[axisProperty[axis]].type;
+                }
+
+                forEachChunk(numVertices, kPLYChunkSize, [&](uint32_t, uint32_t begin, uint32_t chunkEnd) {
+                    const uint8_t* record = body + static_cast<size_t>(begin) * stride;
+                    for (uint32_t i = begin; i < chunkEnd; ++i, record += stride) {
+                        for (uint32_t axis = 0; axis < 3; ++axis) {
+                            axes[axis][i] = static_cast<float>(readPLYValue(record + axisOffset[axis], types[axis], swapBytes));
+                        }
+                    }
+                });
+
+                body += element.count * stride;
+                foundVertices = true;
+
+            } else if (element.name == "face") {
+                if (!readPLYFaces(element, body, end, swapBytes, mesh)) {
+                    valid = false;
+                }
+                foundFaces = true;
+                /// Whatever follows the faces is not needed
+                break;
+
+            } else if (!hasLists) {
+                if (element.count * stride > static_cast<uint64_t>(end - body)) {
+                    valid = false;
+                    break;
+                }
+                body += element.count * stride;
+
+            } else {
+                for (uint64_t i = 0; i < element.count && valid; ++i) {
+                    const size_t size = plyRecordSize(element, body, end, swapBytes);
+                    valid = size > 0;
+                    body += size;
+                }
+            }
+        }
+
+        /// Every face index has to name a vertex
+        if (valid && foundVertices && foundFaces) {
+            const uint32_t    numVertices = static_cast<uint32_t>(mesh.x.size());
+            std::atomic<bool> inRange(true);
+            forEachChunk(static_cast<uint32_t>(mesh.indices.size()), kPLYChunkSize, [&](uint32_t, uint32_t begin, uint32_t chunkEnd) {
+                for (uint32_t i = begin; i < chunkEnd; ++i) {
+                    if (mesh.indices[i] >= numVertices) {
+                        inRange = false;
+                        return;
+                    }
+                }
+            });
+            valid = inRange;
+        }
+
+        if (!valid || !foundVertices || !foundFaces) {
+            std::cerr << "Error: Malformed PLY file: " << filePath << std::endl;
+            mesh = MeshData();
+            return false;
+        }
+
+        return true;
+    }
+
+    bool MeshLoader::readPLYFaces(const PLYElement& element, const uint8_t* data, const uint8_t* end, bool swapBytes,
+                                  MeshData& mesh) const {
+        /// Index of the vertex index list, the only list a face may have
+        int32_t  listProperty = -1;
+        uint32_t listOffset   = 0;
+        for (uint32_t i = 0, offset = 0; i < element.properties.size(); ++i) {
+            const PLYProperty& property = element.properties[i];
+            if (property.countType != eINVALID) {
+                if (listProperty >= 0 || (property.name != "vertex_indices" && property.name != "vertex_index")) {
+                    return false;
+                }
+                listProperty = i;
+                listOffset   = offset;
+            } else {
+                offset += plyTypeSize(property.type);
+            }
+        }
+
+        if (listProperty < 0 || element.count > UINT32_MAX) {
+            return false;
+        }
+
+        const PLYProperty& list       = element.properties[listProperty];
+        const uint32_t     numFaces   = static_cast<uint32_t>(element.count);
+        const uint32_t     countSize  = plyTypeSize(list.countType);
+        const uint32_t     indexSize  = plyTypeSize(list.type);
+        bool               hasLists;
+        const uint32_t     fixedSize  = plyFixedSize(element, hasLists);
+
+        /// Meshes are usually all triangles, which makes every face record the same size
+        /// and lets the faces be read in parallel without first walking all records
+        const uint64_t triangleStride = fixedSize + countSize + 3 * indexSize;
+        if (numFaces * triangleStride <= static_cast<uint64_t>(end - data) && 3 * element.count <= UINT32_MAX) {
+            mesh.indices.resize(3 * static_cast<size_t>(numFaces));
+
+            std::atomic<bool> triangles(true);
+            forEachChunk(numFaces, kPLYChunkSize, [&](uint32_t, uint32_t begin, uint32_t chunkEnd) {
+                const uint8_t* record = data + begin * triangleStride + listOffset;
+                for (uint32_t i = begin; i < chunkEnd; ++i, record += triangleStride) {
+                    if (readPLYValue(record, list.countType, swapBytes) != 3.0) {
+                        triangles = false;
+                        return;
+                    }
+
+                    for (uint32_t corner = 0; corner < 3; ++corner) {
+                        const double index = readPLYValue(record + countSize + corner * indexSize, list.type, swapBytes);
+                        mesh.indices[3 * static_cast<size_t>(i) + corner] = index < 0.0 ? UINT32_MAX : static_cast<uint32_t>(index);
+                    }
+                }
+            });
+
+            if (triangles) {
+                return true;
+            }
+        }
+
+        /// Otherwise one walk over the records finds where every chunk starts and how many
+        /// triangles the faces before it make
+        const uint32_t        numChunks = (numFaces + kPLYChunkSize - 1) / kPLYChunkSize;
+        std::vector<size_t>   chunkOffsets(numChunks);
+        std::vector<uint32_t> chunkTriangles(numChunks + 1, 0);
+
+        uint64_t       numTriangles = 0;
+        const uint8_t* record       = data;
+        for (uint32_t i = 0; i < numFaces; ++i) {
+            if (i % kPLYChunkSize == 0) {
+                chunkOffsets[i / kPLYChunkSize]   = record - data;
+                chunkTriangles[i / kPLYChunkSize] = static_cast<uint32_t>(numTriangles);
+            }
+
+            const size_t size = plyRecordSize(element, record, end, swapBytes);
+            if (size == 0) {
+                return false;
+            }
+
+            const double corners = readPLYValue(record + listOffset, list.countType, swapBytes);
+            if (corners < 3.0) {
+                return false;
+            }
+
+            numTriangles += static_cast<uint64_t>(corners) - 2;
+            record       += size;
+        }
+
+        if (3 * numTriangles > UINT32_MAX) {
+            return false;
+        }
+
+        mesh.indices.resize(3 * numTriangles);
+
+        forEachChunk(numFaces, kPLYChunkSize, [&](uint32_t chunk, uint32_t begin, uint32_t chunkEnd) {
+            const uint8_t* face     = data + chunkOffsets[chunk];
+            uint32_t*      indices  = &mesh.indices[3 * static_cast<size_t>(chunkTriangles[chunk])];
+
+            for (uint32_t i = begin; i < chunkEnd; ++i) {
+                const uint8_t* listData = face + listOffset;
+                const uint32_t corners  = static_cast<uint32_t>(readPLYValue(listData, list.countType, swapBytes));
+
+                uint32_t vertices[3];
+                for (uint32_t corner = 0; corner < corners; ++corner) {
+                    const double index = readPLYValue(listData + countSize + corner * indexSize, list.type, swapBytes);
+                    vertices[std::min(corner, 2u)] = index < 0.0 ? UINT32_MAX : static_cast<uint32_t>(index);
+
+                    if (corner >= 2) {
+                        *indices++ = vertices[0];
+                        *indices++ = vertices[1];
+                        *indices++ = vertices[2];
+                        vertices[1] = vertices[2];
+                    }
+                }
+
+                face += fixedSize + countSize + corners * indexSize;
+            }
+        });
+
+        return true;
+    }
+
+    MeshLoader::PLYType MeshLoader::plyType(const std::string& name) {
+        if (name == "char"   || name == "int8")    return eINT8;
+        if (name == "uchar"  || name == "uint8")   return eUINT8;
+        if (name == "short"  || name == "int16")   return eINT16;
+        if (name == "ushort" || name == "uint16")  return eUINT16;
+        if (name == "int"    || name == "int32")   return eINT32;
+        if (name == "uint"   || name == "uint32")  return eUINT32;
+        if (name == "float"  || name == "float32") return eFLOAT32;
+        if (name == "double" || name == "float64") return eFLOAT64;
+        return eINVALID;
+    }
+
+    uint32_t MeshLoader::plyTypeSize(PLYType type) {
+        static const uint32_t kSizes[] = { 1, 1, 2, 2, 4, 4, 4, 8, 0 };
+        return kSizes[type];
+    }
+
+    double MeshLoader::readPLYValue(const uint8_t* p, PLYType type, bool swapBytes) {
+        uint8_t bytes[8];
+        const uint32_t size = plyTypeSize(type);
+        for (uint32_t i = 0; i < size; ++i) {
+            bytes[i] = swapBytes ? p[size - 1 - i] : p[i];
+        }
+
+        switch (type) {
+        case eINT8:    { int8_t   v; memcpy(&v, bytes, 1); return v; }
+        case eUINT8:   { uint8_t  v; memcpy(&v, bytes, 1); return v; }
+        case eINT16:   { int16_t  v; memcpy(&v, bytes, 2); return v; }
+        case eUINT16:  { uint16_t v; memcpy(&v, bytes, 2); return v; }
+        case eINT32:   { int32_t  v; memcpy(&v, bytes, 4); return v; }
+        case eUINT32:  { uint32_t v; memcpy(&v, bytes, 4); return v; }
+        case eFLOAT32: { float    v; memcpy(&v, bytes, 4); return v; }
+        case eFLOAT64: { double   v; memcpy(&v, bytes, 8); return v; }
+        default:       return 0.0;
+        }
+    }
+
+    uint32_t MeshLoader::plyFixedSize(const PLYElement& element, bool& hasLists) {
+        uint32_t size = 0;
+        hasLists = false;
+        for (const PLYProperty& property : element.properties) {
+            if (property.countType != eINVALID) {
+                hasLists = true;
+            } else {
+                size += plyTypeSize(property.type);
+            }
+        }
+        return size;
+    }
+
+    size_t MeshLoader::plyRecordSize(const PLYElement& element, const uint8_t* p, const uint8_t* end, bool swapBytes) {
+        size_t size = 0;
+        for (const PLYProperty& property : element.properties) {
+            if (property.countType != eINVALID) {
+                if (p + size + plyTypeSize(property.countType) > end) {
+                    return 0;
+                }
+                const double count = readPLYValue(p + size, property.countType, swapBytes);
+                if (count < 0.0) {
+                    return 0;
+                }
+                size += plyTypeSize(property.countType) + static_cast<size_t>(count) * plyTypeSize(property.type);
+            } else {
+                size += plyTypeSize(property.type);
+            }
+        }
+        return p + size <= end ? size : 0;
+    }
+
+    template <typename Func>
+    void MeshLoader::forEachChunk(uint32_t count, uint32_t chunkSize, const Func& func) const {
+        if (mThreadPool) {
+            mThreadPool->parallelFor(count, chunkSize, func);
+            return;
+        }
+
+        for (uint32_t begin = 0, chunk = 0; begin < count; begin += chunkSize, ++chunk) {
+            func(chunk, begin, std::min(begin + chunkSize, count));
+        }
+    }
+}
+}
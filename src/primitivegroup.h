@@ -0,0 +1,431 @@
+#pragma once
+
+#include "mcp.h"
+#include "sphere.h"
+#include "triangle.h"
+#include "util.h"
+
+#include <cstring>
+
+#if defined(MCP_SSE) || defined(MCP_AVX)
+#include <immintrin.h>
+#endif
+
+namespace mcp
+{
+namespace accelerator
+{
+    using namespace math;
+    using namespace geometry;
+
+#if defined(MCP_AVX)
+    static const uint32_t kPrimitiveGroupWidth = 8;
+#else
+    static const uint32_t kPrimitiveGroupWidth = 4;
+#endif
+
+    /// Kinds of primitives held by a leaf, used to pick a leaf loop specialized for them
+    enum PrimitiveTypes {
+        eTRIANGLES    = 1 << 0,
+        eSPHERES      = 1 << 1,
+        /// Any other shape, intersected through the Shape interface
+        eOTHER_SHAPES = 1 << 2
+    };
+
+    /// Up to Width triangles and spheres stored as SoA, so that a leaf tests all of them
+    /// against a ray with a single SIMD kernel per primitive type. Triangle lanes hold
+    /// the x, y and z rows of their three vertices, sphere lanes the center and the
+    /// radius in the first four rows. Lanes in neither mask are left to the caller.
+    template <uint32_t Width>
+    struct alignas(Width * sizeof(float)) PrimitiveGroup {
+        float    data[9][Width];
+        uint32_t triangles;
+        uint32_t spheres;
+        /// PrimitiveTypes of the whole leaf starting with this group, 0 in its other groups
+        uint32_t leafTypes;
+    };
+
+    /// Lanes of a group used by its first count primitives
+    inline uint32_t laneMask(uint32_t count) {
+        return (1u << std::min(count, kPrimitiveGroupWidth)) - 1;
+    }
+
+    template <uint32_t Width>
+    inline void clearGroup(PrimitiveGroup<Width>& group) {
+        std::memset(&group, 0, sizeof(group));
+    }
+
+    template <uint32_t Width>
+    inline void setTriangle(PrimitiveGroup<Width>& group, uint32_t lane, const Vector3f vertices[3]) {
+        for (uint32_t i = 0; i < 9; ++i) {
+            group.data[i][lane] = vertices[i / 3][i % 3];
+        }
+        group.triangles |= 1u << lane;
+    }
+
+    template <uint32_t Width>
+    inline void setSphere(PrimitiveGroup<Width>& group, uint32_t lane, const Vector3f& center, float radius) {
+        for (uint32_t axis = 0; axis < 3; ++axis) {
+            group.data[axis][lane] = center[axis];
+        }
+        group.data[3][lane] = radius;
+        group.spheres |= 1u << lane;
+    }
+
+    template <uint32_t Width>
+    inline Vector3f groupVertex(const PrimitiveGroup<Width>& group, uint32_t lane, uint32_t vertex) {
+        return Vector3f(group.data[3 * vertex][lane], group.data[3 * vertex + 1][lane], group.data[3 * vertex + 2][lane]);
+    }
+
+    /// Watertight test of the triangle lanes in mask, computing exactly what intersectTriangle
+    /// does. Returns the lanes hit within [tMin, tMax] and stores their distance and barycentrics.
+    template <uint32_t Width>
+    inline uint32_t intersectTriangles(const PrimitiveGroup<Width>& group, uint32_t mask, const RayShear& ray,
+                                       float tMin, float tMax, float* t, float* b1, float* b2) {
+        uint32_t hits = 0;
+        while (mask) {
+            const uint32_t lane = countTrailingZeros(mask);
+            mask &= mask - 1;
+
+            if (intersectTriangle(groupVertex(group, lane, 0), groupVertex(group, lane, 1), groupVertex(group, lane, 2),
+                                  ray, tMin, tMax, t[lane], b1[lane], b2[lane])) {
+                hits |= 1u << lane;
+            }
+        }
+        return hits;
+    }
+
+    /// Tests the sphere lanes in mask, computing exactly what intersectSphere does. Returns the
+    /// lanes hit within (tMin, tMax) and stores their distance.
+    template <uint32_t Width>
+    inline uint32_t intersectSpheres(const PrimitiveGroup<Width>& group, uint32_t mask, const Ray3f& ray,
+                                     float tMin, float tMax, float* t) {
+        uint32_t hits = 0;
+        while (mask) {
+            const uint32_t lane = countTrailingZeros(mask);
+            mask &= mask - 1;
+
+            if (intersectSphere(groupVertex(group, lane, 0), group.data[3][lane], ray, tMin, tMax, t[lane])) {
+                hits |= 1u << lane;
+            }
+        }
+        return hits;
+    }
+
+#if defined(MCP_SSE)
+    template <>
+    inline uint32_t intersectTriangles<4>(const PrimitiveGroup<4>& group, uint32_t mask, const RayShear& ray,
+                                          float tMin, float tMax, float* t, float* b1, float* b2) {
+        const uint32_t kx = ray.kx;
+        const uint32_t ky = ray.ky;
+        const uint32_t kz = ray.kz;
+
+        const __m128 sx = _mm_set1_ps(ray.shear[0]);
+        const __m128 sy = _mm_set1_ps(ray.shear[1]);
+        const __m128 sz = _mm_set1_ps(ray.shear[2]);
+        const __m128 ox = _mm_set1_ps(ray.origin[kx]);
+        const __m128 oy = _mm_set1_ps(ray.origin[ky]);
+        const __m128 oz = _mm_set1_ps(ray.origin[kz]);
+
+        const __m128 az = _mm_sub_ps(_mm_load_ps(group.data[kz]),     oz);
+        const __m128 bz = _mm_sub_ps(_mm_load_ps(group.data[3 + kz]), oz);
+        const __m128 cz = _mm_sub_ps(_mm_load_ps(group.data[6 + kz]), oz);
+        const __m128 ax = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(group.data[kx]),     ox), _mm_mul_ps(sx, az));
+        const __m128 ay = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(group.data[ky]),     oy), _mm_mul_ps(sy, az));
+        const __m128 bx = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(group.data[3 + kx]), ox), _mm_mul_ps(sx, bz));
+        const __m128 by = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(group.data[3 + ky]), oy), _mm_mul_ps(sy, bz));
+        const __m128 cx = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(group.data[6 + kx]), ox), _mm_mul_ps(sx, cz));
+        const __m128 cy = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(group.data[6 + ky]), oy), _mm_mul_ps(sy, cz));
+
+        const __m128 u = _mm_sub_ps(_mm_mul_ps(cx, by), _mm_mul_ps(cy, bx));
+        const __m128 v = _mm_sub_ps(_mm_mul_ps(ax, cy), _mm_mul_ps(ay, cx));
+        const __m128 w = _mm_sub_ps(_mm_mul_ps(bx, ay), _mm_mul_ps(by, ax));
+
+        const __m128 zero    = _mm_setzero_ps();
+        const __m128 onEdge  = _mm_or_ps(_mm_or_ps(_mm_cmpeq_ps(u, zero), _mm_cmpeq_ps(v, zero)), _mm_cmpeq_ps(w, zero));
+        const __m128 anyNeg  = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmplt_ps(v, zero)), _mm_cmplt_ps(w, zero));
+        const __m128 anyPos  = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(u, zero), _mm_cmpgt_ps(v, zero)), _mm_cmpgt_ps(w, zero));
+
+        const __m128 det     = _mm_add_ps(_mm_add_ps(u, v), w);
+        const __m128 scaledT = _mm_add_ps(_mm_add_ps(_mm_mul_ps(u, _mm_mul_ps(sz, az)), _mm_mul_ps(v, _mm_mul_ps(sz, bz))),
+                                          _mm_mul_ps(w, _mm_mul_ps(sz, cz)));
+        const __m128 lo      = _mm_mul_ps(_mm_set1_ps(tMin), det);
+        const __m128 hi      = _mm_mul_ps(_mm_set1_ps(tMax), det);
+        const __m128 posDet  = _mm_cmpgt_ps(det, zero);
+        const __m128 outPos  = _mm_or_ps(_mm_cmplt_ps(scaledT, lo), _mm_cmpgt_ps(scaledT, hi));
+        const __m128 outNeg  = _mm_or_ps(_mm_cmpgt_ps(scaledT, lo), _mm_cmplt_ps(scaledT, hi));
+        const __m128 out     = _mm_or_ps(_mm_and_ps(posDet, outPos), _mm_andnot_ps(posDet, outNeg));
+
+        const __m128 miss    = _mm_or_ps(_mm_or_ps(_mm_and_ps(anyNeg, anyPos), _mm_cmpeq_ps(det, zero)), out);
+        const __m128 invDet  = _mm_div_ps(_mm_set1_ps(1.f), det);
+
+        _mm_storeu_ps(t,  _mm_mul_ps(scaledT, invDet));
+        _mm_storeu_ps(b1, _mm_mul_ps(v, invDet));
+        _mm_storeu_ps(b2, _mm_mul_ps(w, invDet));
+
+        /// Lanes with an edge function of exactly zero take the double precision path
+        uint32_t edgeLanes = static_cast<uint32_t>(_mm_movemask_ps(onEdge)) & mask;
+        uint32_t hits      = ~static_cast<uint32_t>(_mm_movemask_ps(miss)) & mask & ~edgeLanes;
+        while (edgeLanes) {
+            const uint32_t lane = countTrailingZeros(edgeLanes);
+            edgeLanes &= edgeLanes - 1;
+
+            if (intersectTriangle(groupVertex(group, lane, 0), groupVertex(group, lane, 1), groupVertex(group, lane, 2),
+                                  ray, tMin, tMax, t[lane], b1[lane], b2[lane])) {
+                hits |= 1u << lane;
+            }
+        }
+        return hits;
+    }
+
+    template <>
+    inline uint32_t intersectSpheres<4>(const PrimitiveGroup<4>& group, uint32_t mask, const Ray3f& ray,
+                                        float tMin, float tMax, float* t) {
+        const Vector3f origin    = ray.origin();
+        const Vector3f direction = ray.direction();
+
+        const __m128 dx = _mm_set1_ps(direction.x());
+        const __m128 dy = _mm_set1_ps(direction.y());
+        const __m128 dz = _mm_set1_ps(direction.z());
+        const __m128 a  = _mm_set1_ps(dot(direction, direction));
+
+        const __m128 ocx = _mm_sub_ps(_mm_set1_ps(origin.x()), _mm_load_ps(group.data[0]));
+        const __m128 ocy = _mm_sub_ps(_mm_set1_ps(origin.y()), _mm_load_ps(group.data[1]));
+        const __m128 ocz = _mm_sub_ps(_mm_set1_ps(origin.z()), _mm_load_ps(group.data[2]));
+        const __m128 r   = _mm_load_ps(group.data[3]);
+
+        const __m128 b    = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, dx), _mm_mul_ps(ocy, dy)), _mm_mul_ps(ocz, dz));
+        const __m128 k    = _mm_div_ps(b, a);
+        const __m128 lx   = _mm_sub_ps(ocx, _mm_mul_ps(k, dx));
+        const __m128 ly   = _mm_sub_ps(ocy, _mm_mul_ps(k, dy));
+        const __m128 lz   = _mm_sub_ps(ocz, _mm_mul_ps(k, dz));
+        const __m128 ll   = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lx, lx), _mm_mul_ps(ly, ly)), _mm_mul_ps(lz, lz));
+        const __m128 disc = _mm_mul_ps(a, _mm_sub_ps(_mm_mul_ps(r, r), ll));
+        const __m128 root = _mm_sqrt_ps(_mm_max_ps(disc, _mm_setzero_ps()));
+        const __m128 negB = _mm_sub_ps(_mm_setzero_ps(), b);
+        const __m128 t0   = _mm_div_ps(_mm_sub_ps(negB, root), a);
+        const __m128 t1   = _mm_div_ps(_mm_add_ps(negB, root), a);
+
+        const __m128 minT = _mm_set1_ps(tMin);
+        const __m128 maxT = _mm_set1_ps(tMax);
+        const __m128 hit0 = _mm_and_ps(_mm_cmpgt_ps(t0, minT), _mm_cmplt_ps(t0, maxT));
+        const __m128 hit1 = _mm_and_ps(_mm_cmpgt_ps(t1, minT), _mm_cmplt_ps(t1, maxT));
+        const __m128 hit  = _mm_and_ps(_mm_cmpgt_ps(disc, _mm_setzero_ps()), _mm_or_ps(hit0, hit1));
+
+        _mm_storeu_ps(t, _mm_or_ps(_mm_and_ps(hit0, t0), _mm_andnot_ps(hit0, t1)));
+        return static_cast<uint32_t>(_mm_movemask_ps(hit)) & mask;
+    }
+#endif
+
+#if defined(MCP_AVX)
+    template <>
+    inline uint32_t intersectTriangles<8>(const PrimitiveGroup<8>& group, uint32_t mask, const RayShear& ray,
+                                          float tMin, float tMax, float* t, float* b1, float* b2) {
+        const uint32_t kx = ray.kx;
+        const uint32_t ky = ray.ky;
+        const uint32_t kz = ray.kz;
+
+        const __m256 sx = _mm256_set1_ps(ray.shear[0]);
+        const __m256 sy = _mm256_set1_ps(ray.shear[1]);
+        const __m256 sz = _mm256_set1_ps(ray.shear[2]);
+        const __m256 ox = _mm256_set1_ps(ray.origin[kx]);
+        const __m256 oy = _mm256_set1_ps(ray.origin[ky]);
+        const __m256 oz = _mm256_set1_ps(ray.origin[kz]);
+
+        const __m256 az = _mm256_sub_ps(_mm256_load_ps(group.data[kz]),     oz);
+        const __m256 bz = _mm256_sub_ps(_mm256_load_ps(group.data[3 + kz]), oz);
+        const __m256 cz = _mm256_sub_ps(_mm256_load_ps(group.data[6 + kz]), oz);
+        const __m256 ax = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(group.data[kx]),     ox), _mm256_mul_ps(sx, az));
+        const __m256 ay = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(group.data[ky]),     oy), _mm256_mul_ps(sy, az));
+        const __m256 bx = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(group.data[3 + kx]), ox), _mm256_mul_ps(sx, bz));
+        const __m256 by = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(group.data[3 + ky]), oy), _mm256_mul_ps(sy, bz));
+        const __m256 cx = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(group.data[6 + kx]), ox), _mm256_mul_ps(sx, cz));
+        const __m256 cy = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(group.data[6 + ky]), oy), _mm256_mul_ps(sy, cz));
+
+        const __m256 u = _mm256_sub_ps(_mm256_mul_ps(cx, by), _mm256_mul_ps(cy, bx));
+        const __m256 v = _mm256_sub_ps(_mm256_mul_ps(ax, cy), _mm256_mul_ps(ay, cx));
+        const __m256 w = _mm256_sub_ps(_mm256_mul_ps(bx, ay), _mm256_mul_ps(by, ax));
+
+        const __m256 zero    = _mm256_setzero_ps();
+        const __m256 onEdge  = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_EQ_OQ), _mm256_cmp_ps(v, zero, _CMP_EQ_OQ)),
+                                            _mm256_cmp_ps(w, zero, _CMP_EQ_OQ));
+        const __m256 anyNeg  = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_LT_OQ), _mm256_cmp_ps(v, zero, _CMP_LT_OQ)),
+                                            _mm256_cmp_ps(w, zero, _CMP_LT_OQ));
+        const __m256 anyPos  = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_GT_OQ), _mm256_cmp_ps(v, zero, _CMP_GT_OQ)),
+                                            _mm256_cmp_ps(w, zero, _CMP_GT_OQ));
+
+        const __m256 det     = _mm256_add_ps(_mm256_add_ps(u, v), w);
+        const __m256 scaledT = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(u, _mm256_mul_ps(sz, az)), _mm256_mul_ps(v, _mm256_mul_ps(sz, bz))),
+                                             _mm256_mul_ps(w, _mm256_mul_ps(sz, cz)));
+        const __m256 lo      = _mm256_mul_ps(_mm256_set1_ps(tMin), det);
+        const __m256 hi      = _mm256_mul_ps(_mm256_set1_ps(tMax), det);
+        const __m256 posDet  = _mm256_cmp_ps(det, zero, _CMP_GT_OQ);
+        const __m256 outPos  = _mm256_or_ps(_mm256_cmp_ps(scaledT, lo, _CMP_LT_OQ), _mm256_cmp_ps(scaledT, hi, _CMP_GT_OQ));
+        const __m256 outNeg  = _mm256_or_ps(_mm256_cmp_ps(scaledT, lo, _CMP_GT_OQ), _mm256_cmp_ps(scaledT, hi, _CMP_LT_OQ));
+        const __m256 out     = _mm256_or_ps(_mm256_and_ps(posDet, outPos), _mm256_andnot_ps(posDet, outNeg));
+
+        const __m256 miss    = _mm256_or_ps(_mm256_or_ps(_mm256_and_ps(anyNeg, anyPos), _mm256_cmp_ps(det, zero, _CMP_EQ_OQ)), out);
+        const __m256 invDet  = _mm256_div_ps(_mm256_set1_ps(1.f), det);
+
+        _mm256_storeu_ps(t,  _mm256_mul_ps(scaledT, invDet));
+        _mm256_storeu_ps(b1, _mm256_mul_ps(v, invDet));
+        _mm256_storeu_ps(b2, _mm256_mul_ps(w, invDet));
+
+        /// Lanes with an edge function of exactly zero take the double precision path
+        uint32_t edgeLanes = static_cast<uint32_t>(_mm256_movemask_ps(onEdge)) & mask;
+        uint32_t hits      = ~static_cast<uint32_t>(_mm256_movemask_ps(miss)) & mask & ~edgeLanes;
+        while (edgeLanes) {
+            const uint32_t lane = countTrailingZeros(edgeLanes);
+            edgeLanes &= edgeLanes - 1;
+
+            if (intersectTriangle(groupVertex(group, lane, 0), groupVertex(group, lane, 1), groupVertex(group, lane, 2),
+                                  ray, tMin, tMax, t[lane], b1[lane], b2[lane])) {
+                hits |= 1u << lane;
+            }
+        }
+        return hits;
+    }
+
+    template <>
+    inline uint32_t intersectSpheres<8>(const PrimitiveGroup<8>& group, uint32_t mask, const Ray3f& ray,
+                                        float tMin, float tMax, float* t) {
+        const Vector3f origin    = ray.origin();
+        const Vector3f direction = ray.direction();
+
+        const __m256 dx = _mm256_set1_ps(direction.x());
+        const __m256 dy = _mm256_set1_ps(direction.y());
+        const __m256 dz = _mm256_set1_ps(direction.z());
+        const __m256 a  = _mm256_set1_ps(dot(direction, direction));
+
+        const __m256 ocx = _mm256_sub_ps(_mm256_set1_ps(origin.x()), _mm256_load_ps(group.data[0]));
+        const __m256 ocy = _mm256_sub_ps(_mm256_set1_ps(origin.y()), _mm256_load_ps(group.data[1]));
+        const __m256 ocz = _mm256_sub_ps(_mm256_set1_ps(origin.z()), _mm256_load_ps(group.data[2]));
+        const __m256 r   = _mm256_load_ps(group.data[3]);
+
+        const __m256 b    = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, dx), _mm256_mul_ps(ocy, dy)), _mm256_mul_ps(ocz, dz));
+        const __m256 k    = _mm256_div_ps(b, a);
+        const __m256 lx   = _mm256_sub_ps(ocx, _mm256_mul_ps(k, dx));
+        const __m256 ly   = _mm256_sub_ps(ocy, _mm256_mul_ps(k, dy));
+        const __m256 lz   = _mm256_sub_ps(ocz, _mm256_mul_ps(k, dz));
+        const __m256 ll   = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(lx, lx), _mm256_mul_ps(ly, ly)), _mm256_mul_ps(lz, lz));
+        const __m256 disc = _mm256_mul_ps(a, _mm256_sub_ps(_mm256_mul_ps(r, r), ll));
+        const __m256 root = _mm256_sqrt_ps(_mm256_max_ps(disc, _mm256_setzero_ps()));
+        const __m256 negB = _mm256_sub_ps(_mm256_setzero_ps(), b);
+        const __m256 t0   = _mm256_div_ps(_mm256_sub_ps(negB, root), a);
+        const __m256 t1   = _mm256_div_ps(_mm256_add_ps(negB, root), a);
+
+        const __m256 minT = _mm256_set1_ps(tMin);
+        const __m256 maxT = _mm256_set1_ps(tMax);
+        const __m256 hit0 = _mm256_and_ps(_mm256_cmp_ps(t0, minT, _CMP_GT_OQ), _mm256_cmp_ps(t0, maxT, _CMP_LT_OQ));
+        const __m256 hit1 = _mm256_and_ps(_mm256_cmp_ps(t1, minT, _CMP_GT_OQ), _mm256_cmp_ps(t1, maxT, _CMP_LT_OQ));
+        const __m256 hit  = _mm256_and_ps(_mm256_cmp_ps(disc, _mm256_setzero_ps(), _CMP_GT_OQ), _mm256_or_ps(hit0, hit1));
+
+        _mm256_storeu_ps(t, _mm256_blendv_ps(t1, t0, hit0));
+        return static_cast<uint32_t>(_mm256_movemask_ps(hit)) & mask;
+    }
+#endif
+
+    /// Lanes of mask holding triangles, for a group of a leaf of the given PrimitiveTypes
+    template <uint32_t Types, uint32_t Width>
+    inline uint32_t triangleLanes(const PrimitiveGroup<Width>& group, uint32_t mask) {
+        return Types == eTRIANGLES ? mask : (Types & eTRIANGLES) ? group.triangles & mask : 0;
+    }
+
+    template <uint32_t Types, uint32_t Width>
+    inline uint32_t sphereLanes(const PrimitiveGroup<Width>& group, uint32_t mask) {
+        return Types == eSPHERES ? mask : (Types & eSPHERES) ? group.spheres & mask : 0;
+    }
+
+    /// Closest hit among the lanes in mask within [tMin, tMax], for a group of a leaf holding
+    /// only the given PrimitiveTypes. Ties go to the lane a sequential loop over the
+    /// primitives would have kept. The lane is recorded as the primitive of a deferred
+    /// hit, which groupSurfaceInteraction turns into a HitInfo.
+    template <uint32_t Types, uint32_t Width>
+    inline bool intersectGroup(const PrimitiveGroup<Width>& group, uint32_t mask, const RayShear& shear,
+                               const Ray3f& ray, float tMin, float tMax, PrimitiveHit& hit) {
+        alignas(32) float t[Width];
+        alignas(32) float b1[Width];
+        alignas(32) float b2[Width];
+        alignas(32) float tSphere[Width];
+
+        const uint32_t triangles    = triangleLanes<Types>(group, mask);
+        const uint32_t spheres      = sphereLanes<Types>(group, mask);
+        const uint32_t triangleHits = triangles ? intersectTriangles(group, triangles, shear, tMin, tMax, t, b1, b2) : 0;
+        const uint32_t sphereHits   = spheres   ? intersectSpheres(group, spheres, ray, tMin, tMax, tSphere)        : 0;
+
+        uint32_t hits = triangleHits | sphereHits;
+        if (!hits) {
+            return false;
+        }
+
+        /// Triangles accept hits at the current distance, spheres only closer ones
+        uint32_t best  = 0;
+        float    bestT = tMax;
+        bool     found = false;
+        while (hits) {
+            const uint32_t lane = countTrailingZeros(hits);
+            hits &= hits - 1;
+
+            if (!(Types & eSPHERES) || (triangleHits & (1u << lane))) {
+                if (!found || t[lane] <= bestT) {
+                    best  = lane;
+                    bestT = t[lane];
+                    found = true;
+                }
+            } else if (!found || tSphere[lane] < bestT) {
+                best  = lane;
+                bestT = tSphere[lane];
+                found = true;
+            }
+        }
+
+        hit.t         = bestT;
+        hit.primitive = best;
+        hit.deferred  = true;
+        if (!(Types & eSPHERES) || (triangleHits & (1u << best))) {
+            hit.b1 = b1[best];
+            hit.b2 = b2[best];
+        }
+
+        return true;
+    }
+
+    /// Fills in the HitInfo of a hit recorded by intersectGroup on the given lane
+    template <uint32_t Width>
+    inline void groupSurfaceInteraction(const PrimitiveGroup<Width>& group, uint32_t lane, const Ray3f& ray,
+                                        const PrimitiveHit& hit, HitInfo& info) {
+        if (group.triangles & (1u << lane)) {
+            const Vector3f v0 = groupVertex(group, lane, 0);
+            const Vector3f v1 = groupVertex(group, lane, 1);
+            const Vector3f v2 = groupVertex(group, lane, 2);
+            triangleHitInfo(ray, hit, normalize(cross(v1 - v0, v2 - v0)), info);
+        } else {
+            sphereHitInfo(ray, hit.t, groupVertex(group, lane, 0), info);
+        }
+    }
+
+    /// Any hit among the lanes in mask within [tMin, tMax], t is the distance of the first lane hit
+    template <uint32_t Types, uint32_t Width>
+    inline bool intersectGroup_fast(const PrimitiveGroup<Width>& group, uint32_t mask, const RayShear& shear,
+                                    const Ray3f& ray, float tMin, float tMax, float& t) {
+        alignas(32) float tHit[Width];
+        alignas(32) float b1[Width];
+        alignas(32) float b2[Width];
+        alignas(32) float tSphere[Width];
+
+        const uint32_t triangles    = triangleLanes<Types>(group, mask);
+        const uint32_t spheres      = sphereLanes<Types>(group, mask);
+        const uint32_t triangleHits = triangles ? intersectTriangles(group, triangles, shear, tMin, tMax, tHit, b1, b2) : 0;
+        const uint32_t sphereHits   = spheres   ? intersectSpheres(group, spheres, ray, tMin, tMax, tSphere)           : 0;
+
+        const uint32_t hits = triangleHits | sphereHits;
+        if (!hits) {
+            return false;
+        }
+
+        const uint32_t lane = countTrailingZeros(hits);
+        t = (!(Types & eSPHERES) || (triangleHits & (1u << lane))) ? tHit[lane] : tSphere[lane];
+        return true;
+    }
+}
+}
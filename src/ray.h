@@ -11,12 +11,14 @@ namespace math
     {
     public:
         Ray();
-        Ray(const Vector<T, Dimension>& origin, const Vector<T, Dimension>& direction);
+        /// Pass normalizeDirection = false for directions that already have unit length, or
+        /// that must keep their length, e.g. to preserve t across a transform
+        Ray(const Vector<T, Dimension>& origin, const Vector<T, Dimension>& direction, bool normalizeDirection = true);
 
         void set(const Vector<T, Dimension>& origin, const Vector<T, Dimension>& direction);
 
-        Vector<T, Dimension> origin() const;
-        Vector<T, Dimension> direction() const;
+        const Vector<T, Dimension>& origin() const;
+        const Vector<T, Dimension>& direction() const;
 
         Vector<T, Dimension> parametric(T t) const;
 
@@ -36,9 +38,9 @@ namespace math
     }
 
     template <typename T, int Dimension>
-    Ray<T, Dimension>::Ray(const Vector<T, Dimension>& origin, const Vector<T, Dimension>& direction)
+    Ray<T, Dimension>::Ray(const Vector<T, Dimension>& origin, const Vector<T, Dimension>& direction, bool normalizeDirection)
         : mOrigin(origin)
-        , mDirection(normalize(direction))
+        , mDirection(normalizeDirection ? normalize(direction) : direction)
     {
     }
 
@@ -49,12 +51,12 @@ namespace math
     }
 
     template <typename T, int Dimension>
-    Vector<T, Dimension> Ray<T, Dimension>::origin() const {
+    const Vector<T, Dimension>& Ray<T, Dimension>::origin() const {
         return mOrigin;
     }
 
     template <typename T, int Dimension>
-    Vector<T, Dimension> Ray<T, Dimension>::direction() const {
+    const Vector<T, Dimension>& Ray<T, Dimension>::direction() const {
         return mDirection;
     }
 
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "ray.h"
+
+namespace mcp
+{
+namespace math
+{
+    /// Size rays stored as SoA, traced together through a BVH. Meant for coherent rays,
+    /// such as primary rays of a screen tile or shadow rays toward a point light, which
+    /// visit mostly the same nodes. Rays whose bit is clear in active are ignored.
+    template <uint32_t Size>
+    struct alignas(32) RayPacket
+    {
+        static_assert(Size == 4 || Size == 8 || Size == 16, "Ray packets hold 4, 8 or 16 rays");
+
+        static const uint32_t kSize = Size;
+        /// Pixels covered by a packet of camera rays, lane = y * kTileWidth + x
+        static const uint32_t kTileWidth  = Size == 4 ? 2 : 4;
+        static const uint32_t kTileHeight = Size / kTileWidth;
+
+        RayPacket() : active(0) {}
+
+        /// Stores ray in the given lane and activates it
+        void set(uint32_t lane, const Ray3f& ray, float rayTMin, float rayTMax);
+        Ray3f ray(uint32_t lane) const;
+
+        float    origin[3][Size];
+        float    direction[3][Size];
+        float    tMin[Size];
+        /// Closest hit traversals shrink it to the distance of the hit
+        float    tMax[Size];
+        uint32_t active;
+    };
+
+    template <uint32_t Size>
+    const uint32_t RayPacket<Size>::kSize;
+
+    template <uint32_t Size>
+    const uint32_t RayPacket<Size>::kTileWidth;
+
+    template <uint32_t Size>
+    const uint32_t RayPacket<Size>::kTileHeight;
+
+    template <uint32_t Size>
+    void RayPacket<Size>::set(uint32_t lane, const Ray3f& ray, float rayTMin, float rayTMax) {
+        for (uint32_t axis = 0; axis < 3; ++axis) {
+            origin[axis][lane]    = ray.origin()[axis];
+            direction[axis][lane] = ray.direction()[axis];
+        }
+
+        tMin[lane] = rayTMin;
+        tMax[lane] = rayTMax;
+        active |= 1u << lane;
+    }
+
+    template <uint32_t Size>
+    Ray3f RayPacket<Size>::ray(uint32_t lane) const {
+        return Ray3f(Vector3f(origin[0][lane], origin[1][lane], origin[2][lane]),
+                     Vector3f(direction[0][lane], direction[1][lane], direction[2][lane]), false);
+    }
+}
+}
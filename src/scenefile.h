@@ -0,0 +1,536 @@
+#pragma once
+
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "bvh.h"
+#include "memory.h"
+#include "sphereset.h"
+#include "transform.h"
+#include "trianglemesh.h"
+
+namespace mcp
+{
+    using namespace math;
+
+    /// Read access to a binary scene file holding triangle meshes and sphere sets, called
+    /// objects, instances of them and prebuilt BVHs. The file is mapped and its arrays are
+    /// used in place: meshes and sphere sets are handed to the TriangleMesh and SphereSet
+    /// constructors taking caller owned arrays, BVHs to BuildOptions::cacheData. All of
+    /// them have to be destroyed before the SceneFile.
+    class SceneFile
+    {
+    public:
+        enum ObjectType {
+            eMESH,
+            eSPHERES
+        };
+
+        /// Arrays of a mesh, in the order the TriangleMesh constructor takes them
+        struct Mesh {
+            const float*    x;
+            const float*    y;
+            const float*    z;
+            uint32_t        numVertices;
+            const uint32_t* indices;
+            uint32_t        numTriangles;
+        };
+
+        /// x, y, z, radius quadruples of a sphere set
+        struct Spheres {
+            const float* spheres;
+            uint32_t     numSpheres;
+        };
+
+        /// Object index of the top-level BVH, built over one Instance per instance
+        static const uint32_t kInstances = 0xFFFFFFFFu;
+
+        SceneFile();
+
+        SceneFile(const SceneFile& rhs) = delete;
+        SceneFile& operator= (const SceneFile& rhs) = delete;
+
+        /// Maps the file and checks its layout, including that every index refers to
+        /// an existing vertex or object. Returns false and prints why if it's invalid.
+        bool open(const std::string& filePath);
+        void close();
+
+        bool isOpen() const {
+            return mFile.isOpen();
+        }
+
+        uint32_t numObjects() const {
+            return static_cast<uint32_t>(mObjects.size());
+        }
+
+        ObjectType objectType(uint32_t object) const;
+        Mesh mesh(uint32_t object) const;
+        Spheres spheres(uint32_t object) const;
+
+        uint32_t numInstances() const;
+        uint32_t instanceObject(uint32_t instance) const;
+        Transform instanceTransform(uint32_t instance) const;
+
+        /// The BVH stored for an object or kInstances, nullptr if there is none. It's only
+        /// used if built again with the same shapes, maxShapesPerNode and build options.
+        uint8_t* bvhCache(uint32_t object, size_t& size) const;
+
+    private:
+        friend class SceneFileWriter;
+
+        static const uint32_t kVersion = 1;
+
+        /// File layout: this header, the section table and then the data of every section,
+        /// each starting on a cache line. Values are in host byte order.
+        struct Header {
+            char     magic[8];
+            uint32_t version;
+            uint32_t numSections;
+            uint64_t fileSize;
+            uint8_t  padding[40];
+        };
+
+        enum SectionType {
+            eMESH_SECTION,
+            eSPHERES_SECTION,
+            eINSTANCES_SECTION,
+            eBVH_SECTION
+        };
+
+        /// A mesh stores x, y, z and the indices as four arrays, each starting on a cache
+        /// line. Objects are numbered in the order of their sections.
+        struct Section {
+            uint32_t type;
+            /// Vertices, spheres or instances, BVH sections store the object instead
+            uint32_t count;
+            uint32_t numTriangles;
+            uint32_t padding;
+            uint64_t offset;
+            uint64_t size;
+        };
+
+        struct Instance {
+            uint32_t object;
+            uint32_t padding[3];
+            float    objectToWorld[4][4];
+            float    worldToObject[4][4];
+        };
+
+        static_assert(sizeof(Header) == MCP_L1_CACHE_LINE_SIZE, "Sections must start cache line aligned");
+
+        /// Bytes taken by an array of size bytes, padded so the next one is aligned
+        static uint64_t alignedSize(uint64_t size) {
+            return (size + MCP_L1_CACHE_LINE_SIZE - 1) & ~static_cast<uint64_t>(MCP_L1_CACHE_LINE_SIZE - 1);
+        }
+
+        bool validate(const Section& section) const;
+
+        memory::MappedFile          mFile;
+        std::vector<const Section*> mObjects;
+        std::vector<const Section*> mObjectBVHs;
+        const Section*              mInstances;
+        const Section*              mInstanceBVH;
+    };
+
+    /// Collects objects, instances and BVHs and writes them as a SceneFile. Arrays are
+    /// referenced, not copied, and have to stay alive until write() is done.
+    class SceneFileWriter
+    {
+    public:
+        /// Each returns the object index, counting meshes and sphere sets together
+        uint32_t addMesh(const float* x, const float* y, const float* z, uint32_t numVertices,
+                         const uint32_t* indices, uint32_t numTriangles);
+        uint32_t addMesh(const geometry::TriangleMesh& mesh);
+        uint32_t addSpheres(const float* spheres, uint32_t numSpheres);
+        uint32_t addSpheres(const geometry::SphereSet& spheres);
+
+        /// object has to be added already
+        uint32_t addInstance(uint32_t object, const Transform& objectToWorld);
+
+        /// Stores a BVH built over the object alone, or with SceneFile::kInstances over one
+        /// Instance per instance in order. The tree is copied right away. Returns false for
+        /// an empty BVH, an object that wasn't added yet or one that already has a BVH.
+        bool addBVH(uint32_t object, const accelerator::BVH& bvh);
+
+        /// Returns false and prints why if the scene couldn't be written or would not pass
+        /// SceneFile::open, e.g. a mesh index past its vertices or an instance BVH without
+        /// instances
+        bool write(const std::string& filePath) const;
+
+    private:
+        struct Object {
+            SceneFile::SectionType type;
+            const float*           arrays[3];
+            const uint32_t*        indices;
+            uint32_t               count;
+            uint32_t               numTriangles;
+        };
+
+        struct BVHData {
+            uint32_t    object;
+            std::string data;
+        };
+
+        std::vector<Object>                mObjects;
+        std::vector<SceneFile::Instance>   mInstances;
+        std::vector<BVHData>               mBVHs;
+    };
+
+    const uint32_t SceneFile::kInstances;
+
+    SceneFile::SceneFile()
+        : mInstances(nullptr)
+        , mInstanceBVH(nullptr)
+    {
+    }
+
+    bool SceneFile::open(const std::string& filePath) {
+        close();
+
+        if (!mFile.open(filePath)) {
+            std::cerr << "Error: Could not open scene file: " << filePath << std::endl;
+            return false;
+        }
+
+        const Header* header = reinterpret_cast<const Header*>(mFile.data());
+        bool valid = mFile.size() >= sizeof(Header) &&
+                     std::memcmp(header->magic, "MCPSCN", 7) == 0 &&
+                     header->version  == kVersion &&
+                     header->fileSize == mFile.size() &&
+                     sizeof(Header) + static_cast<uint64_t>(header->numSections) * sizeof(Section) <= mFile.size();
+
+        const Section* sections = reinterpret_cast<const Section*>(mFile.data() + sizeof(Header));
+        for (uint32_t i = 0; valid && i < header->numSections; ++i) {
+            const Section& section = sections[i];
+            valid = section.offset % MCP_L1_CACHE_LINE_SIZE == 0 &&
+                    section.offset <= mFile.size() &&
+                    section.size   <= mFile.size() - section.offset;
+
+            if (!valid) {
+                break;
+            }
+
+            switch (section.type) {
+            case eMESH_SECTION:
+            case eSPHERES_SECTION:
+                mObjects.push_back(&section);
+                break;
+            case eINSTANCES_SECTION:
+                valid      = !mInstances;
+                mInstances = &section;
+                break;
+            case eBVH_SECTION:
+                break;
+            default:
+                valid = false;
+            }
+        }
+
+        /// Indices are checked once all objects are known
+        mObjectBVHs.assign(mObjects.size(), nullptr);
+        for (uint32_t i = 0; valid && i < header->numSections; ++i) {
+            const Section& section = sections[i];
+            valid = validate(section);
+
+            if (valid && section.type == eBVH_SECTION) {
+                const Section*& bvh = section.count == kInstances ? mInstanceBVH : mObjectBVHs[section.count];
+                valid = !bvh;
+                bvh   = &section;
+            }
+        }
+
+        if (!valid) {
+            std::cerr << "Error: Invalid scene file: " << filePath << std::endl;
+            close();
+            return false;
+        }
+
+        return true;
+    }
+
+    bool SceneFile::validate(const Section& section) const {
+        const uint8_t* data = mFile.data() + section.offset;
+
+        switch (section.type) {
+        case eMESH_SECTION: {
+            const uint64_t positionsSize = alignedSize(static_cast<uint64_t>(section.count) * sizeof(float));
+            if (section.size < 3 * positionsSize + 3 * static_cast<uint64_t>(section.numTriangles) * sizeof(uint32_t)) {
+                return false;
+            }
+
+            const uint32_t* indices = reinterpret_cast<const uint32_t*>(data + 3 * positionsSize);
+            for (uint64_t i = 0; i < 3 * static_cast<uint64_t>(section.numTriangles); ++i) {
+                if (indices[i] >= section.count) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        case eSPHERES_SECTION:
+            return section.size >= 4 * static_cast<uint64_t>(section.count) * sizeof(float);
+
+        case eINSTANCES_SECTION: {
+            if (section.size < static_cast<uint64_t>(section.count) * sizeof(Instance)) {
+                return false;
+            }
+
+            const Instance* instances = reinterpret_cast<const Instance*>(data);
+            for (uint32_t i = 0; i < section.count; ++i) {
+                if (instances[i].object >= mObjects.size()) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        case eBVH_SECTION:
+            return section.count == kInstances || section.count < mObjects.size();
+
+        default:
+            return false;
+        }
+    }
+
+    void SceneFile::close() {
+        mFile.close();
+        mObjects.clear();
+        mObjectBVHs.clear();
+        mInstances   = nullptr;
+        mInstanceBVH = nullptr;
+    }
+
+    SceneFile::ObjectType SceneFile::objectType(uint32_t object) const {
+        return mObjects[object]->type == eMESH_SECTION ? eMESH : eSPHERES;
+    }
+
+    SceneFile::Mesh SceneFile::mesh(uint32_t object) const {
+        const Section& section       = *mObjects[object];
+        const uint8_t* data          = mFile.data() + section.offset;
+        const uint64_t positionsSize = alignedSize(static_cast<uint64_t>(section.count) * sizeof(float));
+
+        Mesh mesh;
+        mesh.x            = reinterpret_cast<const float*>(data);
+        mesh.y            = reinterpret_cast<const float*>(data + positionsSize);
+        mesh.z            = reinterpret_cast<const float*>(data + 2 * positionsSize);
+        mesh.numVertices  = section.count;
+        mesh.indices      = reinterpret_cast<const uint32_t*>(data + 3 * positionsSize);
+        mesh.numTriangles = section.numTriangles;
+        return mesh;
+    }
+
+    SceneFile::Spheres SceneFile::spheres(uint32_t object) const {
+        const Section& section = *mObjects[object];
+
+        Spheres spheres;
+        spheres.spheres    = reinterpret_cast<const float*>(mFile.data() + section.offset);
+        spheres.numSpheres = section.count;
+        return spheres;
+    }
+
+    uint32_t SceneFile::numInstances() const {
+        return mInstances ? mInstances->count : 0;
+    }
+
+    uint32_t SceneFile::instanceObject(uint32_t instance) const {
+        return reinterpret_cast<const Instance*>(mFile.data() + mInstances->offset)[instance].object;
+    }
+
+    Transform SceneFile::instanceTransform(uint32_t instance) const {
+        const Instance& record = reinterpret_cast<const Instance*>(mFile.data() + mInstances->offset)[instance];
+        return Transform(record.objectToWorld, record.worldToObject);
+    }
+
+    uint8_t* SceneFile::bvhCache(uint32_t object, size_t& size) const {
+        const Section* section = object == kInstances ? mInstanceBVH : mObjectBVHs[object];
+        if (!section) {
+            size = 0;
+            return nullptr;
+        }
+
+        size = section->size;
+        return mFile.data() + section->offset;
+    }
+
+    uint32_t SceneFileWriter::addMesh(const float* x, const float* y, const float* z, uint32_t numVertices,
+                                      const uint32_t* indices, uint32_t numTriangles) {
+        mObjects.push_back({ SceneFile::eMESH_SECTION, { x, y, z }, indices, numVertices, numTriangles });
+        return static_cast<uint32_t>(mObjects.size() - 1);
+    }
+
+    uint32_t SceneFileWriter::addMesh(const geometry::TriangleMesh& mesh) {
+        return addMesh(mesh.positions(0), mesh.positions(1), mesh.positions(2), mesh.numVertices(),
+                       mesh.indices(), mesh.numTriangles());
+    }
+
+    uint32_t SceneFileWriter::addSpheres(const float* spheres, uint32_t numSpheres) {
+        mObjects.push_back({ SceneFile::eSPHERES_SECTION, { spheres, nullptr, nullptr }, nullptr, numSpheres, 0 });
+        return static_cast<uint32_t>(mObjects.size() - 1);
+    }
+
+    uint32_t SceneFileWriter::addSpheres(const geometry::SphereSet& spheres) {
+        return addSpheres(spheres.spheres(), spheres.numSpheres());
+    }
+
+    uint32_t SceneFileWriter::addInstance(uint32_t object, const Transform& objectToWorld) {
+        assert(object < mObjects.size());
+
+        SceneFile::Instance instance;
+        std::memset(&instance, 0, sizeof(instance));
+        instance.object = object;
+        std::memcpy(instance.objectToWorld, objectToWorld.matrix(), sizeof(instance.objectToWorld));
+        std::memcpy(instance.worldToObject, objectToWorld.inverse().matrix(), sizeof(instance.worldToObject));
+
+        mInstances.push_back(instance);
+        return static_cast<uint32_t>(mInstances.size() - 1);
+    }
+
+    bool SceneFileWriter::addBVH(uint32_t object, const accelerator::BVH& bvh) {
+        if (object != SceneFile::kInstances && object >= mObjects.size()) {
+            std::cerr << "Warning: Not storing BVH of unknown object " << object << " in scene file" << std::endl;
+            return false;
+        }
+
+        for (const BVHData& other : mBVHs) {
+            if (other.object == object) {
+                std::cerr << "Warning: Not storing second BVH of object " << object << " in scene file" << std::endl;
+                return false;
+            }
+        }
+
+        std::ostringstream stream(std::ios::binary);
+        if (!bvh.writeCache(stream)) {
+            std::cerr << "Warning: Not storing empty BVH in scene file" << std::endl;
+            return false;
+        }
+
+        mBVHs.push_back({ object, stream.str() });
+        return true;
+    }
+
+    bool SceneFileWriter::write(const std::string& filePath) const {
+        typedef SceneFile::Section Section;
+
+        /// Refuse to write what SceneFile::open would reject
+        bool valid = true;
+        for (const Object& object : mObjects) {
+            for (uint64_t i = 0; valid && object.indices && i < 3 * static_cast<uint64_t>(object.numTriangles); ++i) {
+                valid = object.indices[i] < object.count;
+            }
+        }
+        for (const SceneFile::Instance& instance : mInstances) {
+            valid = valid && instance.object < mObjects.size();
+        }
+        for (const BVHData& bvh : mBVHs) {
+            valid = valid && (bvh.object == SceneFile::kInstances ? !mInstances.empty() : bvh.object < mObjects.size());
+        }
+
+        if (!valid) {
+            std::cerr << "Error: Not writing inconsistent scene file: " << filePath << std::endl;
+            return false;
+        }
+
+        /// Lay out the sections in the order objects, instances, BVHs
+        std::vector<Section> sections;
+        std::vector<const void*> sectionData;
+
+        for (const Object& object : mObjects) {
+            Section section;
+            std::memset(&section, 0, sizeof(section));
+            section.type         = object.type;
+            section.count        = object.count;
+            section.numTriangles = object.numTriangles;
+            section.size         = object.type == SceneFile::eMESH_SECTION
+                                 ? 3 * SceneFile::alignedSize(static_cast<uint64_t>(object.count) * sizeof(float)) +
+                                   3 * static_cast<uint64_t>(object.numTriangles) * sizeof(uint32_t)
+                                 : 4 * static_cast<uint64_t>(object.count) * sizeof(float);
+
+            sections.push_back(section);
+            sectionData.push_back(&object);
+        }
+
+        if (!mInstances.empty()) {
+            Section section;
+            std::memset(&section, 0, sizeof(section));
+            section.type  = SceneFile::eINSTANCES_SECTION;
+            section.count = static_cast<uint32_t>(mInstances.size());
+            section.size  = mInstances.size() * sizeof(SceneFile::Instance);
+
+            sections.push_back(section);
+            sectionData.push_back(mInstances.data());
+        }
+
+        for (const BVHData& bvh : mBVHs) {
+            Section section;
+            std::memset(&section, 0, sizeof(section));
+            section.type  = SceneFile::eBVH_SECTION;
+            section.count = bvh.object;
+            section.size  = bvh.data.size();
+
+            sections.push_back(section);
+            sectionData.push_back(bvh.data.data());
+        }
+
+        uint64_t offset = SceneFile::alignedSize(sizeof(SceneFile::Header) + sections.size() * sizeof(Section));
+        for (Section& section : sections) {
+            section.offset = offset;
+            offset += SceneFile::alignedSize(section.size);
+        }
+
+        SceneFile::Header header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, "MCPSCN", 7);
+        header.version     = SceneFile::kVersion;
+        header.numSections = static_cast<uint32_t>(sections.size());
+        header.fileSize    = offset;
+
+        /// Write to a temporary file first so a concurrent reader never maps a partial scene
+        const std::string tempPath = filePath + ".tmp";
+        std::ofstream fileStream(tempPath, std::ios::binary | std::ios::trunc);
+
+        const char kPadding[MCP_L1_CACHE_LINE_SIZE] = {};
+        auto pad = [&](uint64_t size) {
+            fileStream.write(kPadding, SceneFile::alignedSize(size) - size);
+        };
+
+        fileStream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        fileStream.write(reinterpret_cast<const char*>(sections.data()), sections.size() * sizeof(Section));
+        pad(sizeof(header) + sections.size() * sizeof(Section));
+
+        for (uint32_t i = 0; i < sections.size(); ++i) {
+            const Section& section = sections[i];
+
+            if (section.type == SceneFile::eMESH_SECTION) {
+                const Object&  object        = *static_cast<const Object*>(sectionData[i]);
+                const uint64_t positionsSize = static_cast<uint64_t>(object.count) * sizeof(float);
+                for (uint32_t axis = 0; axis < 3; ++axis) {
+                    fileStream.write(reinterpret_cast<const char*>(object.arrays[axis]), positionsSize);
+                    pad(positionsSize);
+                }
+                fileStream.write(reinterpret_cast<const char*>(object.indices), 3 * static_cast<uint64_t>(object.numTriangles) * sizeof(uint32_t));
+            } else if (section.type == SceneFile::eSPHERES_SECTION) {
+                const Object& object = *static_cast<const Object*>(sectionData[i]);
+                fileStream.write(reinterpret_cast<const char*>(object.arrays[0]), section.size);
+            } else {
+                fileStream.write(static_cast<const char*>(sectionData[i]), section.size);
+            }
+            pad(section.size);
+        }
+
+        fileStream.close();
+
+        if (!fileStream || std::rename(tempPath.c_str(), filePath.c_str()) != 0) {
+            std::cerr << "Error: Could not write scene file: " << filePath << std::endl;
+            std::remove(tempPath.c_str());
+            return false;
+        }
+
+        return true;
+    }
+}
@@ -3,6 +3,7 @@
 #include <iostream>
 
 #include "aabb.h"
+#include "util.h"
 #include "ray.h"
 #include "hitinfo.h"
 
@@ -22,6 +23,49 @@ namespace geometry
         virtual bool intersect_fast(const Ray3f& ray, float tMin, float tMax, float& t) const;
         virtual AABB3f aabb() const;
 
+        /// Splits the part of the shape inside box at the plane position along axis and
+        /// returns the bounds of both halves. Used by spatial split builders; the default
+        /// just cuts the box, which is conservative for any shape.
+        virtual void splitAABB(const AABB3f& box, uint32_t axis, float position,
+                               AABB3f& left, AABB3f& right) const;
+
+        /// Hash of the geometry, used to tell whether cached acceleration data still
+        /// matches the scene. The default only hashes the bounds.
+        virtual uint64_t contentHash(uint64_t seed) const;
+
+        /// Shapes made of many primitives, such as meshes, let acceleration structures
+        /// reference every primitive on its own. Any other shape is a single primitive
+        /// and the methods below forward to the ones above.
+        virtual uint32_t numPrimitives() const;
+        virtual AABB3f primitiveAABB(uint32_t primitive) const;
+        virtual bool intersectPrimitive(uint32_t primitive, const Ray3f& ray, float tMin, float tMax, HitInfo& info) const;
+        virtual bool intersectPrimitive_fast(uint32_t primitive, const Ray3f& ray, float tMin, float tMax, float& t) const;
+        virtual void splitPrimitiveAABB(uint32_t primitive, const AABB3f& box, uint32_t axis, float position,
+                                        AABB3f& left, AABB3f& right) const;
+
+        /// Closest hit test that leaves the surface interaction for later: a hit only sets
+        /// t, b1 and b2 of hit, and computeSurfaceInteraction builds the HitInfo once the
+        /// hit is known to be the closest. The defaults fill info right away and clear
+        /// hit.deferred, for shapes that have nothing to gain from deferring.
+        virtual bool intersectPrimitive_deferred(uint32_t primitive, const Ray3f& ray, float tMin, float tMax,
+                                                 PrimitiveHit& hit, HitInfo& info) const;
+        virtual void computeSurfaceInteraction(uint32_t primitive, const Ray3f& ray, const PrimitiveHit& hit,
+                                               HitInfo& info) const;
+
+        /// Plain geometry of a primitive that is a triangle or a sphere, so acceleration
+        /// structures can store it in packed form and intersect it without calling back
+        /// into the shape. The defaults return false, such primitives are intersected
+        /// through the methods above.
+        virtual bool primitiveTriangle(uint32_t primitive, Vector3f vertices[3]) const;
+        virtual bool primitiveSphere(uint32_t primitive, Vector3f& center, float& radius) const;
+
+        /// Size of a copy made by cloneInto, or 0 when the shape cannot be relocated.
+        /// Lets acceleration structures pack the shapes they reference next to each other.
+        virtual size_t cloneSize() const;
+        /// Copy constructs the shape into memory of cloneSize() bytes with alignment
+        /// of at least alignof(std::max_align_t)
+        virtual Shape* cloneInto(void* memory) const;
+
     private:
         static uint32_t mShapeCounter;
         const  uint32_t mShapeId;
@@ -51,6 +95,71 @@ namespace geometry
         return false;
     }
 
+    void Shape::splitAABB(const AABB3f& box, uint32_t axis, float position,
+                          AABB3f& left, AABB3f& right) const {
+        left  = box;
+        right = box;
+        left[1][axis]  = std::min(position, box.max()[axis]);
+        right[0][axis] = std::max(position, box.min()[axis]);
+    }
+
+    uint64_t Shape::contentHash(uint64_t seed) const {
+        const AABB3f box = aabb();
+        return hashBytes(&box, sizeof(box), seed);
+    }
+
+    uint32_t Shape::numPrimitives() const {
+        return 1;
+    }
+
+    AABB3f Shape::primitiveAABB(uint32_t primitive) const {
+        return aabb();
+    }
+
+    bool Shape::intersectPrimitive(uint32_t primitive, const Ray3f& ray, float tMin, float tMax, HitInfo& info) const {
+        return intersect(ray, tMin, tMax, info);
+    }
+
+    bool Shape::intersectPrimitive_fast(uint32_t primitive, const Ray3f& ray, float tMin, float tMax, float& t) const {
+        return intersect_fast(ray, tMin, tMax, t);
+    }
+
+    void Shape::splitPrimitiveAABB(uint32_t primitive, const AABB3f& box, uint32_t axis, float position,
+                                   AABB3f& left, AABB3f& right) const {
+        splitAABB(box, axis, position, left, right);
+    }
+
+    bool Shape::intersectPrimitive_deferred(uint32_t primitive, const Ray3f& ray, float tMin, float tMax,
+                                            PrimitiveHit& hit, HitInfo& info) const {
+        if (!intersectPrimitive(primitive, ray, tMin, tMax, info)) {
+            return false;
+        }
+
+        hit.t        = info.t;
+        hit.deferred = false;
+        return true;
+    }
+
+    void Shape::computeSurfaceInteraction(uint32_t primitive, const Ray3f& ray, const PrimitiveHit& hit,
+                                          HitInfo& info) const {
+    }
+
+    bool Shape::primitiveTriangle(uint32_t primitive, Vector3f vertices[3]) const {
+        return false;
+    }
+
+    bool Shape::primitiveSphere(uint32_t primitive, Vector3f& center, float& radius) const {
+        return false;
+    }
+
+    size_t Shape::cloneSize() const {
+        return 0;
+    }
+
+    Shape* Shape::cloneInto(void* memory) const {
+        return nullptr;
+    }
+
     AABB3f Shape::aabb() const {
         std::cerr << "Error: Called unimplemented aabb method on shape: " << mShapeId << std::endl;
         const float zero = 0.f;
@@ -21,6 +21,16 @@ namespace geometry
         bool intersect(const Ray3f& ray, float tMin, float tMax, HitInfo& info) const override;
         bool intersect_fast(const Ray3f& ray, float tMin, float tMax, float& t) const override;
         AABB3f aabb() const override;
+        uint64_t contentHash(uint64_t seed) const override;
+        size_t cloneSize() const override;
+        Shape* cloneInto(void* memory) const override;
+        bool intersectPrimitive(uint32_t primitive, const Ray3f& ray, float tMin, float tMax, HitInfo& info) const override;
+        bool intersectPrimitive_fast(uint32_t primitive, const Ray3f& ray, float tMin, float tMax, float& t) const override;
+        bool intersectPrimitive_deferred(uint32_t primitive, const Ray3f& ray, float tMin, float tMax,
+                                         PrimitiveHit& hit, HitInfo& info) const override;
+        void computeSurfaceInteraction(uint32_t primitive, const Ray3f& ray, const PrimitiveHit& hit,
+                                       HitInfo& info) const override;
+        bool primitiveSphere(uint32_t primitive, Vector3f& center, float& radius) const override;
 
     private:
         Vector<T, 3> mCenter;
@@ -31,6 +41,50 @@ namespace geometry
     typedef Sphere<float>  Spheref;
     typedef Sphere<double> Sphered;
 
+    /// Fills in a hit at distance t on the sphere around center
+    template <typename T>
+    inline void sphereHitInfo(const Ray3f& ray, float t, const Vector<T, 3>& center, HitInfo& info) {
+        info.t      = t;
+        info.point  = ray.origin() + t * ray.direction();
+        info.normal = normalize(info.point - center);
+
+        Vector3f cs = info.normal * -1.f;
+        info.u = 0.5f + atan2f(cs.z(), cs.x()) / kPI * 2.0f;
+        info.v = 0.5f - asinf(cs.y()) / kPI;
+    }
+
+    /// Nearest of the two ray/sphere crossings inside (tMin, tMax), t is left alone on a miss
+    template <typename T>
+    inline bool intersectSphere(const Vector<T, 3>& center, T radius, const Ray3f& ray, float tMin, float tMax, float& t) {
+        Vector<T, 3> oc = ray.origin() - center;
+
+        T a = dot(ray.direction(), ray.direction());
+        T b = dot(oc, ray.direction());
+
+        /// b * b - a * (|oc|^2 - radius^2) cancels badly for small spheres far from the
+        /// ray origin, so the discriminant is taken from the offset l of the center to
+        /// the closest point of the ray's line instead
+        Vector<T, 3> l = oc - (b / a) * ray.direction();
+        T disc = a * (radius * radius - dot(l, l));
+        if (disc > static_cast<T>(0)) {
+            const T root = std::sqrt(disc);
+
+            T tHit = (-b - root) / a;
+            if (tHit > tMin && tHit < tMax) {
+                t = tHit;
+                return true;
+            }
+
+            tHit = (-b + root) / a;
+            if (tHit > tMin && tHit < tMax) {
+                t = tHit;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
     template <typename T>
     Sphere<T>::Sphere()
         : mCenter(static_cast<T>(0))
@@ -66,70 +120,71 @@ namespace geometry
         return mAABB;
     }
 
+    template <typename T>
+    uint64_t Sphere<T>::contentHash(uint64_t seed) const {
+        seed = hashBytes(&mCenter, sizeof(mCenter), seed);
+        return hashBytes(&mRadius, sizeof(mRadius), seed);
+    }
+
     template <typename T>
     bool Sphere<T>::intersect(const Ray3f& ray, float tMin, float tMax, HitInfo& info) const {
-        Vector<T, 3> oc = ray.origin() - mCenter;
+        float t;
+        if (!Sphere<T>::intersect_fast(ray, tMin, tMax, t)) {
+            return false;
+        }
 
-        T a = dot(ray.direction(), ray.direction());
-        T b = dot(oc, ray.direction());
-        T c = dot(oc, oc) - mRadius * mRadius;
+        sphereHitInfo(ray, t, mCenter, info);
+        return true;
+    }
 
-        T disc = b * b - a * c;
-        if (disc > static_cast<T>(0)) {
-            T t = (-b - sqrt(disc)) / a;
-            if (t > tMin && t < tMax) {
-                info.t      = t;
-                info.point  = ray.origin() + t * ray.direction();
-                info.normal = normalize(info.point - mCenter);
+    template <typename T>
+    bool Sphere<T>::intersect_fast(const Ray3f& ray, float tMin, float tMax, float& t) const {
+        return intersectSphere(mCenter, mRadius, ray, tMin, tMax, t);
+    }
 
-                Vector3f cs = info.normal * -1.f;
-                info.u = 0.5f + atan2f(cs.z(), cs.x()) / kPI * 2.0f;
-                info.v = 0.5f - asinf(cs.y()) / kPI;
+    template <typename T>
+    size_t Sphere<T>::cloneSize() const {
+        return sizeof(*this);
+    }
 
-                return true;
-            }
+    template <typename T>
+    Shape* Sphere<T>::cloneInto(void* memory) const {
+        return new (memory) Sphere<T>(*this);
+    }
 
-            t = (-b + sqrt(disc)) / a;
-            if (t > tMin && t < tMax) {
-                info.t      = t;
-                info.point  = ray.origin() + t * ray.direction();
-                info.normal = normalize(info.point - mCenter);
+    template <typename T>
+    bool Sphere<T>::intersectPrimitive(uint32_t primitive, const Ray3f& ray, float tMin, float tMax, HitInfo& info) const {
+        /// Qualified so that acceleration structures pay for a single virtual call
+        return Sphere<T>::intersect(ray, tMin, tMax, info);
+    }
 
-                Vector3f cs = info.normal * -1.f;
-                info.u = 0.5f + atan2f(cs.z(), cs.x()) / kPI * 2.0f;
-                info.v = 0.5f - asinf(cs.y()) / kPI;
+    template <typename T>
+    bool Sphere<T>::intersectPrimitive_fast(uint32_t primitive, const Ray3f& ray, float tMin, float tMax, float& t) const {
+        return Sphere<T>::intersect_fast(ray, tMin, tMax, t);
+    }
 
-                return true;
-            }
+    template <typename T>
+    bool Sphere<T>::intersectPrimitive_deferred(uint32_t primitive, const Ray3f& ray, float tMin, float tMax,
+                                                PrimitiveHit& hit, HitInfo& info) const {
+        if (!Sphere<T>::intersect_fast(ray, tMin, tMax, hit.t)) {
+            return false;
         }
 
-        return false;
+        hit.deferred = true;
+        return true;
     }
 
     template <typename T>
-    bool Sphere<T>::intersect_fast(const Ray3f& ray, float tMin, float tMax, float& t) const {
-        Vector<T, 3> oc = ray.origin() - mCenter;
-
-        T a = dot(ray.direction(), ray.direction());
-        T b = dot(oc, ray.direction());
-        T c = dot(oc, oc) - mRadius * mRadius;
-
-        T disc = b * b - a * c;
-        if (disc > static_cast<T>(0)) {
-            t = (-b - sqrt(disc)) / a;
-            if (t > tMin && t < tMax) {
-                return true;
-            }
-
-            t = (-b + sqrt(disc)) / a;
-            if (t > tMin && t < tMax) {
-                return true;
-            }
-
-            t = static_cast<T>(0);
-        }
+    void Sphere<T>::computeSurfaceInteraction(uint32_t primitive, const Ray3f& ray, const PrimitiveHit& hit,
+                                              HitInfo& info) const {
+        sphereHitInfo(ray, hit.t, mCenter, info);
+    }
 
-        return false;
+    template <typename T>
+    bool Sphere<T>::primitiveSphere(uint32_t primitive, Vector3f& center, float& radius) const {
+        center = mCenter.vec3f();
+        radius = static_cast<float>(mRadius);
+        return true;
     }
 }
 }
@@ -0,0 +1,197 @@
+#pragma once
+
+#include <vector>
+
+#include "sphere.h"
+
+namespace mcp
+{
+namespace geometry
+{
+    using namespace math;
+
+    /// Set of spheres stored as one x, y, z, radius float quadruple each, 16 bytes per
+    /// sphere. Meant for particle and point cloud scenes: acceleration structures reference
+    /// each sphere as a primitive of the set, so millions of spheres are a single Shape
+    /// instead of one Sphere object with its own bounds each. When the spheres are small
+    /// and far apart most BVH leaves hold a single one; such leaves stay unpacked, so the
+    /// tree adds only its nodes and one reference per sphere, also with default options.
+    class SphereSet : public Shape
+    {
+    public:
+        /// Copies the centers and the radii
+        SphereSet(const std::vector<Vector3f>& centers, const std::vector<float>& radii);
+        /// Takes over x, y, z, radius quadruples
+        explicit SphereSet(std::vector<float>&& spheres);
+        /// References quadruples owned by the caller, e.g. a mapped file, which have to outlive the set
+        SphereSet(const float* spheres, uint32_t numSpheres);
+
+        SphereSet(const SphereSet& rhs) = delete;
+        SphereSet& operator= (const SphereSet& rhs) = delete;
+
+        uint32_t numSpheres() const {
+            return mNumSpheres;
+        }
+
+        /// x, y, z, radius quadruples of all spheres
+        const float* spheres() const {
+            return mSpheres;
+        }
+
+        Vector3f center(uint32_t sphere) const {
+            const float* s = mSpheres + 4 * sphere;
+            return Vector3f(s[0], s[1], s[2]);
+        }
+
+        float radius(uint32_t sphere) const {
+            return mSpheres[4 * sphere + 3];
+        }
+
+        /// Recomputes the cached bounds after the referenced spheres were edited
+        void update();
+
+        bool intersect(const Ray3f& ray, float tMin, float tMax, HitInfo& info) const override;
+        bool intersect_fast(const Ray3f& ray, float tMin, float tMax, float& t) const override;
+        AABB3f aabb() const override;
+        uint64_t contentHash(uint64_t seed) const override;
+
+        uint32_t numPrimitives() const override;
+        AABB3f primitiveAABB(uint32_t primitive) const override;
+        bool intersectPrimitive(uint32_t primitive, const Ray3f& ray, float tMin, float tMax, HitInfo& info) const override;
+        bool intersectPrimitive_fast(uint32_t primitive, const Ray3f& ray, float tMin, float tMax, float& t) const override;
+        bool intersectPrimitive_deferred(uint32_t primitive, const Ray3f& ray, float tMin, float tMax,
+                                         PrimitiveHit& hit, HitInfo& info) const override;
+        void computeSurfaceInteraction(uint32_t primitive, const Ray3f& ray, const PrimitiveHit& hit,
+                                       HitInfo& info) const override;
+        bool primitiveSphere(uint32_t primitive, Vector3f& center, float& radius) const override;
+
+    private:
+        std::vector<float> mStorage;
+
+        /// Either the storage above or the caller's array
+        const float*       mSpheres;
+        uint32_t           mNumSpheres;
+
+        AABB3f             mAABB;
+    };
+
+    SphereSet::SphereSet(const std::vector<Vector3f>& centers, const std::vector<float>& radii)
+        : mStorage(4 * centers.size())
+    {
+        for (uint32_t i = 0; i < centers.size(); ++i) {
+            mStorage[4 * i]     = centers[i].x();
+            mStorage[4 * i + 1] = centers[i].y();
+            mStorage[4 * i + 2] = centers[i].z();
+            mStorage[4 * i + 3] = radii[i];
+        }
+
+        mSpheres    = mStorage.data();
+        mNumSpheres = centers.size();
+
+        update();
+    }
+
+    SphereSet::SphereSet(std::vector<float>&& spheres)
+        : mStorage(std::move(spheres))
+    {
+        mSpheres    = mStorage.data();
+        mNumSpheres = mStorage.size() / 4;
+
+        update();
+    }
+
+    SphereSet::SphereSet(const float* spheres, uint32_t numSpheres)
+        : mSpheres(spheres)
+        , mNumSpheres(numSpheres)
+    {
+        update();
+    }
+
+    void SphereSet::update() {
+        mAABB = AABB3f();
+        for (uint32_t i = 0; i < mNumSpheres; ++i) {
+            mAABB = box_union(mAABB, primitiveAABB(i));
+        }
+    }
+
+    AABB3f SphereSet::aabb() const {
+        return mAABB;
+    }
+
+    uint64_t SphereSet::contentHash(uint64_t seed) const {
+        return hashBytes(mSpheres, 4 * mNumSpheres * sizeof(float), seed);
+    }
+
+    uint32_t SphereSet::numPrimitives() const {
+        return mNumSpheres;
+    }
+
+    AABB3f SphereSet::primitiveAABB(uint32_t primitive) const {
+        const Vector3f c = center(primitive);
+        const float    r = radius(primitive);
+        return AABB3f(c - Vector3f(r, r, r), c + Vector3f(r, r, r));
+    }
+
+    bool SphereSet::intersectPrimitive(uint32_t primitive, const Ray3f& ray, float tMin, float tMax, HitInfo& info) const {
+        PrimitiveHit hit;
+        if (!SphereSet::intersectPrimitive_deferred(primitive, ray, tMin, tMax, hit, info)) {
+            return false;
+        }
+
+        SphereSet::computeSurfaceInteraction(primitive, ray, hit, info);
+        return true;
+    }
+
+    bool SphereSet::intersectPrimitive_fast(uint32_t primitive, const Ray3f& ray, float tMin, float tMax, float& t) const {
+        return intersectSphere(center(primitive), radius(primitive), ray, tMin, tMax, t);
+    }
+
+    bool SphereSet::intersectPrimitive_deferred(uint32_t primitive, const Ray3f& ray, float tMin, float tMax,
+                                                PrimitiveHit& hit, HitInfo& info) const {
+        if (!intersectSphere(center(primitive), radius(primitive), ray, tMin, tMax, hit.t)) {
+            return false;
+        }
+
+        hit.deferred = true;
+        return true;
+    }
+
+    void SphereSet::computeSurfaceInteraction(uint32_t primitive, const Ray3f& ray, const PrimitiveHit& hit,
+                                              HitInfo& info) const {
+        sphereHitInfo(ray, hit.t, center(primitive), info);
+    }
+
+    bool SphereSet::primitiveSphere(uint32_t primitive, Vector3f& center, float& radius) const {
+        center = SphereSet::center(primitive);
+        radius = SphereSet::radius(primitive);
+        return true;
+    }
+
+    bool SphereSet::intersect(const Ray3f& ray, float tMin, float tMax, HitInfo& info) const {
+        /// Tests every sphere, sets are meant to be put in a BVH
+        PrimitiveHit hit;
+        bool         found = false;
+        for (uint32_t i = 0; i < mNumSpheres; ++i) {
+            if (SphereSet::intersectPrimitive_deferred(i, ray, tMin, tMax, hit, info)) {
+                tMax          = hit.t;
+                hit.primitive = i;
+                found         = true;
+            }
+        }
+
+        if (found) {
+            SphereSet::computeSurfaceInteraction(hit.primitive, ray, hit, info);
+        }
+        return found;
+    }
+
+    bool SphereSet::intersect_fast(const Ray3f& ray, float tMin, float tMax, float& t) const {
+        for (uint32_t i = 0; i < mNumSpheres; ++i) {
+            if (intersectPrimitive_fast(i, ray, tMin, tMax, t)) {
+                return true;
+            }
+        }
+        return false;
+    }
+}
+}
@@ -2,9 +2,11 @@
 
 #include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <functional>
 #include <future>
+#include <iostream>
 #include <memory>
 #include <thread>
 #include <type_traits>
@@ -46,6 +48,10 @@ namespace thread
                 return mFuture.get();
             }
 
+            bool isReady() const {
+                return mFuture.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+            }
+
         private:
             std::future<T> mFuture;
         };
@@ -105,6 +111,22 @@ namespace thread
         template <typename Func, typename... Args>
         auto submit(Func&& func, Args&&... args);
 
+        /// Runs queued tasks on the calling thread until the future is ready.
+        /// Safe to call from inside a task, so tasks may spawn and wait on subtasks.
+        template <typename T>
+        void wait(TaskFuture<T>& future);
+
+        /// Splits [0, count) into chunks of chunkSize and calls func(chunk, begin, end)
+        /// for each of them in parallel. Returns once every chunk is done.
+        template <typename Func>
+        void parallelFor(uint32_t count, uint32_t chunkSize, const Func& func);
+
+        bool runPendingTask();
+
+        uint32_t numThreads() const {
+            return static_cast<uint32_t>(mThreads.size());
+        }
+
     private:
         void worker();
         void destroy();
@@ -153,6 +175,50 @@ namespace thread
         return result;
     }
 
+    template <typename T>
+    void ThreadPool::wait(TaskFuture<T>& future) {
+        while (!future.isReady()) {
+            if (!runPendingTask()) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    template <typename Func>
+    void ThreadPool::parallelFor(uint32_t count, uint32_t chunkSize, const Func& func) {
+        const uint32_t numChunks = (count + chunkSize - 1u) / chunkSize;
+        if (numChunks == 0u) {
+            return;
+        }
+
+        std::vector<TaskFuture<void>> futures;
+        futures.reserve(numChunks - 1u);
+
+        for (uint32_t i = 1u; i < numChunks; ++i) {
+            const uint32_t begin = i * chunkSize;
+            const uint32_t end   = std::min(begin + chunkSize, count);
+            futures.push_back(submit(std::cref(func), i, begin, end));
+        }
+
+        func(0u, 0u, std::min(chunkSize, count));
+
+        for (auto& future : futures) {
+            wait(future);
+            future.get();
+        }
+    }
+
+    bool ThreadPool::runPendingTask() {
+        std::unique_ptr<IThreadTask> pTask{nullptr};
+
+        if (mQueue.tryPop(pTask)) {
+            pTask->run();
+            return true;
+        }
+
+        return false;
+    }
+
     void ThreadPool::worker() {
         while (!mDone) {
             std::unique_ptr<IThreadTask> pTask{nullptr};
@@ -0,0 +1,240 @@
+#pragma once
+
+#include <cstring>
+
+#include "aabb.h"
+
+namespace mcp
+{
+namespace math
+{
+    /// Affine transform stored as a row-major 4x4 matrix together with its inverse
+    class Transform
+    {
+    public:
+        Transform();
+        explicit Transform(const float m[4][4]);
+        Transform(const float m[4][4], const float mInv[4][4]);
+
+        static Transform translate(const Vector3f& delta);
+        static Transform scale(const Vector3f& factors);
+        static Transform rotate(float angle, const Vector3f& axis);
+
+        Transform inverse() const;
+
+        Vector3f transformPoint(const Vector3f& p) const;
+        Vector3f transformVector(const Vector3f& v) const;
+        Vector3f transformNormal(const Vector3f& n) const;
+        AABB3f   transformBox(const AABB3f& box) const;
+
+        Transform operator* (const Transform& other) const;
+
+        const float (&matrix() const)[4][4] {
+            return mM;
+        }
+
+    private:
+        static bool invert(const float m[4][4], float mInv[4][4]);
+        static void multiply(const float a[4][4], const float b[4][4], float result[4][4]);
+
+        float mM[4][4];
+        float mInv[4][4];
+    };
+
+    Transform::Transform()
+    {
+        for (int i = 0; i < 4; ++i) {
+            for (int j = 0; j < 4; ++j) {
+                mM[i][j] = mInv[i][j] = (i == j) ? 1.f : 0.f;
+            }
+        }
+    }
+
+    Transform::Transform(const float m[4][4])
+    {
+        std::memcpy(mM, m, sizeof(mM));
+        if (!invert(mM, mInv)) {
+            std::memset(mInv, 0, sizeof(mInv));
+        }
+    }
+
+    Transform::Transform(const float m[4][4], const float mInv[4][4])
+    {
+        std::memcpy(mM, m, sizeof(mM));
+        std::memcpy(this->mInv, mInv, sizeof(this->mInv));
+    }
+
+    Transform Transform::translate(const Vector3f& delta) {
+        const float m[4][4] = {
+            { 1.f, 0.f, 0.f, delta.x() },
+            { 0.f, 1.f, 0.f, delta.y() },
+            { 0.f, 0.f, 1.f, delta.z() },
+            { 0.f, 0.f, 0.f, 1.f       }
+        };
+        const float mInv[4][4] = {
+            { 1.f, 0.f, 0.f, -delta.x() },
+            { 0.f, 1.f, 0.f, -delta.y() },
+            { 0.f, 0.f, 1.f, -delta.z() },
+            { 0.f, 0.f, 0.f, 1.f        }
+        };
+        return Transform(m, mInv);
+    }
+
+    Transform Transform::scale(const Vector3f& factors) {
+        const float m[4][4] = {
+            { factors.x(), 0.f,         0.f,         0.f },
+            { 0.f,         factors.y(), 0.f,         0.f },
+            { 0.f,         0.f,         factors.z(), 0.f },
+            { 0.f,         0.f,         0.f,         1.f }
+        };
+        const float mInv[4][4] = {
+            { 1.f / factors.x(), 0.f,               0.f,               0.f },
+            { 0.f,               1.f / factors.y(), 0.f,               0.f },
+            { 0.f,               0.f,               1.f / factors.z(), 0.f },
+            { 0.f,               0.f,               0.f,               1.f }
+        };
+        return Transform(m, mInv);
+    }
+
+    Transform Transform::rotate(float angle, const Vector3f& axis) {
+        const Vector3f a = normalize(axis);
+        const float sinTheta = std::sin(angle);
+        const float cosTheta = std::cos(angle);
+
+        float m[4][4];
+        m[0][0] = a.x() * a.x() + (1.f - a.x() * a.x()) * cosTheta;
+        m[0][1] = a.x() * a.y() * (1.f - cosTheta) - a.z() * sinTheta;
+        m[0][2] = a.x() * a.z() * (1.f - cosTheta) + a.y() * sinTheta;
+        m[0][3] = 0.f;
+
+        m[1][0] = a.x() * a.y() * (1.f - cosTheta) + a.z() * sinTheta;
+        m[1][1] = a.y() * a.y() + (1.f - a.y() * a.y()) * cosTheta;
+        m[1][2] = a.y() * a.z() * (1.f - cosTheta) - a.x() * sinTheta;
+        m[1][3] = 0.f;
+
+        m[2][0] = a.x() * a.z() * (1.f - cosTheta) - a.y() * sinTheta;
+        m[2][1] = a.y() * a.z() * (1.f - cosTheta) + a.x() * sinTheta;
+        m[2][2] = a.z() * a.z() + (1.f - a.z() * a.z()) * cosTheta;
+        m[2][3] = 0.f;
+
+        m[3][0] = m[3][1] = m[3][2] = 0.f;
+        m[3][3] = 1.f;
+
+        /// Rotations are orthogonal, the inverse is the transpose
+        float mInv[4][4];
+        for (int i = 0; i < 4; ++i) {
+            for (int j = 0; j < 4; ++j) {
+                mInv[i][j] = m[j][i];
+            }
+        }
+
+        return Transform(m, mInv);
+    }
+
+    Transform Transform::inverse() const {
+        return Transform(mInv, mM);
+    }
+
+    Vector3f Transform::transformPoint(const Vector3f& p) const {
+        const float x = mM[0][0] * p.x() + mM[0][1] * p.y() + mM[0][2] * p.z() + mM[0][3];
+        const float y = mM[1][0] * p.x() + mM[1][1] * p.y() + mM[1][2] * p.z() + mM[1][3];
+        const float z = mM[2][0] * p.x() + mM[2][1] * p.y() + mM[2][2] * p.z() + mM[2][3];
+        const float w = mM[3][0] * p.x() + mM[3][1] * p.y() + mM[3][2] * p.z() + mM[3][3];
+
+        if (w == 1.f) {
+            return Vector3f(x, y, z);
+        }
+        return Vector3f(x, y, z) / w;
+    }
+
+    Vector3f Transform::transformVector(const Vector3f& v) const {
+        return Vector3f(mM[0][0] * v.x() + mM[0][1] * v.y() + mM[0][2] * v.z(),
+                        mM[1][0] * v.x() + mM[1][1] * v.y() + mM[1][2] * v.z(),
+                        mM[2][0] * v.x() + mM[2][1] * v.y() + mM[2][2] * v.z());
+    }
+
+    Vector3f Transform::transformNormal(const Vector3f& n) const {
+        /// Normals transform with the inverse transpose
+        return Vector3f(mInv[0][0] * n.x() + mInv[1][0] * n.y() + mInv[2][0] * n.z(),
+                        mInv[0][1] * n.x() + mInv[1][1] * n.y() + mInv[2][1] * n.z(),
+                        mInv[0][2] * n.x() + mInv[1][2] * n.y() + mInv[2][2] * n.z());
+    }
+
+    AABB3f Transform::transformBox(const AABB3f& box) const {
+        AABB3f result;
+        for (int i = 0; i < 8; ++i) {
+            const Vector3f corner(box[i & 1].x(), box[(i >> 1) & 1].y(), box[(i >> 2) & 1].z());
+            result = box_union(result, transformPoint(corner));
+        }
+        return result;
+    }
+
+    Transform Transform::operator* (const Transform& other) const {
+        float m[4][4];
+        float inv[4][4];
+        multiply(mM, other.mM, m);
+        multiply(other.mInv, mInv, inv);
+        return Transform(m, inv);
+    }
+
+    void Transform::multiply(const float a[4][4], const float b[4][4], float result[4][4]) {
+        for (int i = 0; i < 4; ++i) {
+            for (int j = 0; j < 4; ++j) {
+                result[i][j] = a[i][0] * b[0][j] + a[i][1] * b[1][j] + a[i][2] * b[2][j] + a[i][3] * b[3][j];
+            }
+        }
+    }
+
+    bool Transform::invert(const float m[4][4], float mInv[4][4]) {
+        /// Gauss-Jordan elimination with partial pivoting
+        float a[4][8];
+        for (int i = 0; i < 4; ++i) {
+            for (int j = 0; j < 4; ++j) {
+                a[i][j]     = m[i][j];
+                a[i][j + 4] = (i == j) ? 1.f : 0.f;
+            }
+        }
+
+        for (int col = 0; col < 4; ++col) {
+            int pivot = col;
+            for (int row = col + 1; row < 4; ++row) {
+                if (std::abs(a[row][col]) > std::abs(a[pivot][col])) {
+                    pivot = row;
+                }
+            }
+
+            if (a[pivot][col] == 0.f) {
+                return false;
+            }
+
+            if (pivot != col) {
+                for (int j = 0; j < 8; ++j) {
+                    std::swap(a[col][j], a[pivot][j]);
+                }
+            }
+
+            const float invPivot = 1.f / a[col][col];
+            for (int j = 0; j < 8; ++j) {
+                a[col][j] *= invPivot;
+            }
+
+            for (int row = 0; row < 4; ++row) {
+                if (row != col && a[row][col] != 0.f) {
+                    const float factor = a[row][col];
+                    for (int j = 0; j < 8; ++j) {
+                        a[row][j] -= factor * a[col][j];
+                    }
+                }
+            }
+        }
+
+        for (int i = 0; i < 4; ++i) {
+            for (int j = 0; j < 4; ++j) {
+                mInv[i][j] = a[i][j + 4];
+            }
+        }
+
+        return true;
+    }
+}
+}
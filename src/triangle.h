@@ -24,9 +24,24 @@ namespace geometry
 
         Vector<T, 3> normal() const;
 
+        /// Recomputes the cached normal and bounds after the vertices were edited
+        void update();
+
         bool intersect(const Ray3f& ray, float tMin, float tMax, HitInfo& info) const override;
         bool intersect_fast(const Ray3f& ray, float tMin, float tMax, float& t) const override;
         AABB3f aabb() const override;
+        void splitAABB(const AABB3f& box, uint32_t axis, float position,
+                       AABB3f& left, AABB3f& right) const override;
+        uint64_t contentHash(uint64_t seed) const override;
+        size_t cloneSize() const override;
+        Shape* cloneInto(void* memory) const override;
+        bool intersectPrimitive(uint32_t primitive, const Ray3f& ray, float tMin, float tMax, HitInfo& info) const override;
+        bool intersectPrimitive_fast(uint32_t primitive, const Ray3f& ray, float tMin, float tMax, float& t) const override;
+        bool intersectPrimitive_deferred(uint32_t primitive, const Ray3f& ray, float tMin, float tMax,
+                                         PrimitiveHit& hit, HitInfo& info) const override;
+        void computeSurfaceInteraction(uint32_t primitive, const Ray3f& ray, const PrimitiveHit& hit,
+                                       HitInfo& info) const override;
+        bool primitiveTriangle(uint32_t primitive, Vector3f vertices[3]) const override;
 
     private:
         Vector<T, 3> mV1;
@@ -41,6 +56,141 @@ namespace geometry
     typedef Triangle<float>  Trianglef;
     typedef Triangle<double> Triangled;
 
+    /// Per-ray constants of the watertight ray/triangle test (Woop et al. 2013). The ray
+    /// is sheared and scaled so that it points down +z from the origin, which turns the
+    /// test into 2D edge functions; rays tested against many triangles can share them.
+    struct RayShear {
+        RayShear() {}
+        explicit RayShear(const Ray3f& ray);
+
+        Vector3f origin;
+        /// x, y and z scale applied to the vertices after the axes are permuted
+        float    shear[3];
+        uint32_t kx;
+        uint32_t ky;
+        uint32_t kz;
+    };
+
+    inline RayShear::RayShear(const Ray3f& ray)
+        : origin(ray.origin())
+    {
+        const Vector3f direction = ray.direction();
+
+        kz = 0;
+        if (std::abs(direction[1]) > std::abs(direction[kz])) kz = 1;
+        if (std::abs(direction[2]) > std::abs(direction[kz])) kz = 2;
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+
+        /// Keeps the winding of the triangles, and with it the sign of the edge functions
+        if (direction[kz] < 0.f) {
+            std::swap(kx, ky);
+        }
+
+        shear[2] = 1.f / direction[kz];
+        shear[0] = direction[kx] * shear[2];
+        shear[1] = direction[ky] * shear[2];
+    }
+
+    /// Watertight ray/triangle test, rays hitting an edge or a vertex shared by several
+    /// triangles hit at least one of them. On a hit returns the distance and the
+    /// barycentric weights of v1 and v2; t, b1 and b2 are left alone otherwise.
+    inline bool intersectTriangle(const Vector3f& v0, const Vector3f& v1, const Vector3f& v2,
+                                  const RayShear& ray, float tMin, float tMax, float& t, float& b1, float& b2) {
+        const Vector3f a = v0 - ray.origin;
+        const Vector3f b = v1 - ray.origin;
+        const Vector3f c = v2 - ray.origin;
+
+        const float ax = a[ray.kx] - ray.shear[0] * a[ray.kz];
+        const float ay = a[ray.ky] - ray.shear[1] * a[ray.kz];
+        const float bx = b[ray.kx] - ray.shear[0] * b[ray.kz];
+        const float by = b[ray.ky] - ray.shear[1] * b[ray.kz];
+        const float cx = c[ray.kx] - ray.shear[0] * c[ray.kz];
+        const float cy = c[ray.ky] - ray.shear[1] * c[ray.kz];
+
+        /// Edge functions, the unnormalized barycentric weights of v0, v1 and v2
+        float u = cx * by - cy * bx;
+        float v = ax * cy - ay * cx;
+        float w = bx * ay - by * ax;
+
+        /// Exactly zero may be a rounded result for a ray through an edge, redo it in double
+        if (u == 0.f || v == 0.f || w == 0.f) {
+            u = static_cast<float>(static_cast<double>(cx) * by - static_cast<double>(cy) * bx);
+            v = static_cast<float>(static_cast<double>(ax) * cy - static_cast<double>(ay) * cx);
+            w = static_cast<float>(static_cast<double>(bx) * ay - static_cast<double>(by) * ax);
+        }
+
+        if ((u < 0.f || v < 0.f || w < 0.f) && (u > 0.f || v > 0.f || w > 0.f)) {
+            return false;
+        }
+
+        const float det = u + v + w;
+        if (det == 0.f) {
+            return false;
+        }
+
+        const float az = ray.shear[2] * a[ray.kz];
+        const float bz = ray.shear[2] * b[ray.kz];
+        const float cz = ray.shear[2] * c[ray.kz];
+
+        /// Range test on the scaled distance, before paying for the division
+        const float scaledT = u * az + v * bz + w * cz;
+        if (det > 0.f ? (scaledT < tMin * det || scaledT > tMax * det)
+                      : (scaledT > tMin * det || scaledT < tMax * det)) {
+            return false;
+        }
+
+        const float invDet = 1.f / det;
+        t  = scaledT * invDet;
+        b1 = v * invDet;
+        b2 = w * invDet;
+        return true;
+    }
+
+    inline bool intersectTriangle(const Vector3f& v0, const Vector3f& v1, const Vector3f& v2,
+                                  const Ray3f& ray, float tMin, float tMax, float& t, float& b1, float& b2) {
+        return intersectTriangle(v0, v1, v2, RayShear(ray), tMin, tMax, t, b1, b2);
+    }
+
+    /// Fills in a hit recorded by intersectTriangle on a triangle with the given normal
+    inline void triangleHitInfo(const Ray3f& ray, const PrimitiveHit& hit, const Vector3f& normal, HitInfo& info) {
+        info.t      = hit.t;
+        info.point  = ray.origin() + hit.t * ray.direction();
+        info.normal = normal;
+        info.u      = 1.f - hit.b1 - hit.b2;
+        info.v      = hit.b1;
+    }
+
+    /// Bounds of the parts of a triangle on either side of the plane at position along
+    /// axis, clipped to box
+    inline void splitTriangleAABB(const Vector3f vertices[3], const AABB3f& box, uint32_t axis, float position,
+                                  AABB3f& left, AABB3f& right) {
+        left  = AABB3f();
+        right = AABB3f();
+
+        /// Walk the edges, sending vertices to their side and edge crossings to both
+        for (uint32_t i = 0; i < 3; ++i) {
+            const Vector3f& v0 = vertices[i];
+            const Vector3f& v1 = vertices[(i + 1) % 3];
+            const float p0 = v0[axis];
+            const float p1 = v1[axis];
+
+            if (p0 <= position) left  = box_union(left, v0);
+            if (p0 >= position) right = box_union(right, v0);
+
+            if ((p0 < position && p1 > position) || (p0 > position && p1 < position)) {
+                Vector3f crossing = v0 + (v1 - v0) * ((position - p0) / (p1 - p0));
+                crossing[axis] = position;
+
+                left  = box_union(left, crossing);
+                right = box_union(right, crossing);
+            }
+        }
+
+        left  = box_intersection(left, box);
+        right = box_intersection(right, box);
+    }
+
     template <typename T>
     Triangle<T>::Triangle()
         : mV1(Vector<T, 3>(static_cast<T>(0), static_cast<T>(0), static_cast<T>(0)))
@@ -55,22 +205,7 @@ namespace geometry
         , mV2(v2)
         , mV3(v3)
     {
-        Vector<T, 3> v1v2 = v2 - v1;
-        Vector<T, 3> v1v3 = v3 - v1;
-
-        mFlatNormal = normalize(cross(v1v2, v1v3));
-
-        Vector<T, 3> pMin(std::min(v1.x(), v2.x()), std::min(v1.y(), v2.y()), std::min(v1.z(), v2.z()));
-        pMin.x() = std::min(pMin.x(), v3.x());
-        pMin.y() = std::min(pMin.y(), v3.y());
-        pMin.z() = std::min(pMin.z(), v3.z());
-
-        Vector<T, 3> pMax(std::max(v1.x(), v2.x()), std::max(v1.y(), v2.y()), std::max(v1.z(), v2.z()));
-        pMax.x() = std::max(pMax.x(), v3.x());
-        pMax.y() = std::max(pMax.y(), v3.y());
-        pMax.z() = std::max(pMax.z(), v3.z());
-
-        mAABB = AABB<T, 3>(pMin, pMax);
+        update();
     }
 
     template <typename T>
@@ -108,72 +243,106 @@ namespace geometry
         return mFlatNormal;
     }
 
+    template <typename T>
+    void Triangle<T>::update() {
+        Vector<T, 3> v1v2 = mV2 - mV1;
+        Vector<T, 3> v1v3 = mV3 - mV1;
+
+        mFlatNormal = normalize(cross(v1v2, v1v3));
+
+        Vector<T, 3> pMin(std::min(mV1.x(), mV2.x()), std::min(mV1.y(), mV2.y()), std::min(mV1.z(), mV2.z()));
+        pMin.x() = std::min(pMin.x(), mV3.x());
+        pMin.y() = std::min(pMin.y(), mV3.y());
+        pMin.z() = std::min(pMin.z(), mV3.z());
+
+        Vector<T, 3> pMax(std::max(mV1.x(), mV2.x()), std::max(mV1.y(), mV2.y()), std::max(mV1.z(), mV2.z()));
+        pMax.x() = std::max(pMax.x(), mV3.x());
+        pMax.y() = std::max(pMax.y(), mV3.y());
+        pMax.z() = std::max(pMax.z(), mV3.z());
+
+        mAABB = AABB<T, 3>(pMin, pMax);
+    }
+
     template <typename T>
     AABB3f Triangle<T>::aabb() const {
         return mAABB;
     }
 
+    template <typename T>
+    uint64_t Triangle<T>::contentHash(uint64_t seed) const {
+        seed = hashBytes(&mV1, sizeof(mV1), seed);
+        seed = hashBytes(&mV2, sizeof(mV2), seed);
+        return hashBytes(&mV3, sizeof(mV3), seed);
+    }
+
+    template <typename T>
+    void Triangle<T>::splitAABB(const AABB3f& box, uint32_t axis, float position,
+                                AABB3f& left, AABB3f& right) const {
+        const Vector3f vertices[3] = { mV1.vec3f(), mV2.vec3f(), mV3.vec3f() };
+        splitTriangleAABB(vertices, box, axis, position, left, right);
+    }
+
     template <typename T>
     bool Triangle<T>::intersect(const Ray3f& ray, float tMin, float tMax, HitInfo& info) const {
-        if (!intersect_fast(ray, tMin, tMax, info.t)) {
+        PrimitiveHit hit;
+        if (!Triangle<T>::intersectPrimitive_deferred(0, ray, tMin, tMax, hit, info)) {
             return false;
         }
 
-        info.point = ray.origin() + info.t * ray.direction();
-        info.normal = mFlatNormal;
-
-        Vector<T, 3> e0 = mV2 - mV1;
-        Vector<T, 3> e1 = mV3 - mV1;
-        Vector<T, 3> e2 = info.point - mV1;
-
-        const float d00 = dot(e0, e0);
-        const float d01 = dot(e0, e1);
-        const float d11 = dot(e1, e1);
-        const float d20 = dot(e2, e0);
-        const float d21 = dot(e2, e1);
-        const float denom = d00 * d11 - d01 * d01;
-
-        const float v = (d11 * d20 - d01 * d21) / denom;
-        const float w = (d00 * d21 - d01 * d20) / denom;
-        const float u = static_cast<T>(1) - v - w;
-
-        info.u = u;
-        info.v = v;
-
+        Triangle<T>::computeSurfaceInteraction(0, ray, hit, info);
         return true;
     }
 
     template <typename T>
     bool Triangle<T>::intersect_fast(const Ray3f& ray, float tMin, float tMax, float& t) const {
-        Vector<T, 3> v1v2 = mV2 - mV1;
-        Vector<T, 3> v1v3 = mV3 - mV1;
+        float b1;
+        float b2;
+        return intersectTriangle(mV1.vec3f(), mV2.vec3f(), mV3.vec3f(), ray, tMin, tMax, t, b1, b2);
+    }
 
-        Vector<T, 3> pVec = cross(ray.direction(), v1v3);
-        T det = dot(v1v2, pVec);
+    template <typename T>
+    size_t Triangle<T>::cloneSize() const {
+        return sizeof(*this);
+    }
 
-        if (std::abs(det) < kEpsilon) {
-            return false;
-        }
+    template <typename T>
+    Shape* Triangle<T>::cloneInto(void* memory) const {
+        return new (memory) Triangle<T>(*this);
+    }
 
-        T invDet = static_cast<T>(1) / det;
+    template <typename T>
+    bool Triangle<T>::intersectPrimitive(uint32_t primitive, const Ray3f& ray, float tMin, float tMax, HitInfo& info) const {
+        /// Qualified so that acceleration structures pay for a single virtual call
+        return Triangle<T>::intersect(ray, tMin, tMax, info);
+    }
 
-        Vector<T, 3> tVec = ray.origin() - mV1;
-        T u = dot(tVec, pVec) * invDet;
-        if (u < static_cast<T>(0) || u > static_cast<T>(1)) {
-            return false;
-        }
+    template <typename T>
+    bool Triangle<T>::intersectPrimitive_fast(uint32_t primitive, const Ray3f& ray, float tMin, float tMax, float& t) const {
+        return Triangle<T>::intersect_fast(ray, tMin, tMax, t);
+    }
 
-        Vector<T, 3> qVec = cross(tVec, v1v2);
-        T v = dot(ray.direction(), qVec) * invDet;
-        if (v < static_cast<T>(0) || u + v > static_cast<T>(1)) {
+    template <typename T>
+    bool Triangle<T>::intersectPrimitive_deferred(uint32_t primitive, const Ray3f& ray, float tMin, float tMax,
+                                                  PrimitiveHit& hit, HitInfo& info) const {
+        if (!intersectTriangle(mV1.vec3f(), mV2.vec3f(), mV3.vec3f(), ray, tMin, tMax, hit.t, hit.b1, hit.b2)) {
             return false;
         }
 
-        t = dot(v1v3, qVec) * invDet;
-        if (t < tMin || t > tMax) {
-            return false;
-        }
+        hit.deferred = true;
+        return true;
+    }
 
+    template <typename T>
+    void Triangle<T>::computeSurfaceInteraction(uint32_t primitive, const Ray3f& ray, const PrimitiveHit& hit,
+                                                HitInfo& info) const {
+        triangleHitInfo(ray, hit, mFlatNormal.vec3f(), info);
+    }
+
+    template <typename T>
+    bool Triangle<T>::primitiveTriangle(uint32_t primitive, Vector3f vertices[3]) const {
+        vertices[0] = mV1.vec3f();
+        vertices[1] = mV2.vec3f();
+        vertices[2] = mV3.vec3f();
         return true;
     }
 }
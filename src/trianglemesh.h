@@ -0,0 +1,258 @@
+#pragma once
+
+#include <vector>
+
+#include "triangle.h"
+
+namespace mcp
+{
+namespace geometry
+{
+    using namespace math;
+
+    /// Indexed triangle mesh with positions stored as separate x, y and z arrays and
+    /// three vertex indices per triangle. Acceleration structures reference each
+    /// triangle as a primitive of the mesh, so however many triangles it has the mesh
+    /// is a single Shape and its data stays in a few contiguous buffers.
+    class TriangleMesh : public Shape
+    {
+    public:
+        /// Copies the positions and the indices
+        TriangleMesh(const std::vector<Vector3f>& positions, const std::vector<uint32_t>& indices);
+        /// Takes over position arrays of equal length and the indices
+        TriangleMesh(std::vector<float>&& x, std::vector<float>&& y, std::vector<float>&& z,
+                     std::vector<uint32_t>&& indices);
+        /// References arrays owned by the caller, e.g. a mapped file, which have to outlive the mesh
+        TriangleMesh(const float* x, const float* y, const float* z, uint32_t numVertices,
+                     const uint32_t* indices, uint32_t numTriangles);
+
+        TriangleMesh(const TriangleMesh& rhs) = delete;
+        TriangleMesh& operator= (const TriangleMesh& rhs) = delete;
+
+        uint32_t numVertices() const {
+            return mNumVertices;
+        }
+
+        uint32_t numTriangles() const {
+            return mNumTriangles;
+        }
+
+        /// Array of the x (0), y (1) or z (2) coordinates of all vertices
+        const float* positions(uint32_t axis) const {
+            return mPositions[axis];
+        }
+
+        /// Three vertex indices per triangle
+        const uint32_t* indices() const {
+            return mIndices;
+        }
+
+        Vector3f position(uint32_t vertex) const {
+            return Vector3f(mPositions[0][vertex], mPositions[1][vertex], mPositions[2][vertex]);
+        }
+
+        /// Position of corner 0, 1 or 2 of a triangle
+        Vector3f vertex(uint32_t triangle, uint32_t corner) const {
+            return position(mIndices[3 * triangle + corner]);
+        }
+
+        /// Recomputes the cached bounds after the referenced positions were edited
+        void update();
+
+        bool intersect(const Ray3f& ray, float tMin, float tMax, HitInfo& info) const override;
+        bool intersect_fast(const Ray3f& ray, float tMin, float tMax, float& t) const override;
+        AABB3f aabb() const override;
+        uint64_t contentHash(uint64_t seed) const override;
+
+        uint32_t numPrimitives() const override;
+        AABB3f primitiveAABB(uint32_t primitive) const override;
+        bool intersectPrimitive(uint32_t primitive, const Ray3f& ray, float tMin, float tMax, HitInfo& info) const override;
+        bool intersectPrimitive_fast(uint32_t primitive, const Ray3f& ray, float tMin, float tMax, float& t) const override;
+        void splitPrimitiveAABB(uint32_t primitive, const AABB3f& box, uint32_t axis, float position,
+                                AABB3f& left, AABB3f& right) const override;
+        bool intersectPrimitive_deferred(uint32_t primitive, const Ray3f& ray, float tMin, float tMax,
+                                         PrimitiveHit& hit, HitInfo& info) const override;
+        void computeSurfaceInteraction(uint32_t primitive, const Ray3f& ray, const PrimitiveHit& hit,
+                                       HitInfo& info) const override;
+        bool primitiveTriangle(uint32_t primitive, Vector3f vertices[3]) const override;
+
+    private:
+        std::vector<float>    mX;
+        std::vector<float>    mY;
+        std::vector<float>    mZ;
+        std::vector<uint32_t> mIndexStorage;
+
+        /// Either the storage above or the caller's arrays
+        const float*          mPositions[3];
+        const uint32_t*       mIndices;
+        uint32_t              mNumVertices;
+        uint32_t              mNumTriangles;
+
+        AABB3f                mAABB;
+    };
+
+    TriangleMesh::TriangleMesh(const std::vector<Vector3f>& positions, const std::vector<uint32_t>& indices)
+        : mX(positions.size())
+        , mY(positions.size())
+        , mZ(positions.size())
+        , mIndexStorage(indices)
+    {
+        for (uint32_t i = 0; i < positions.size(); ++i) {
+            mX[i] = positions[i].x();
+            mY[i] = positions[i].y();
+            mZ[i] = positions[i].z();
+        }
+
+        mPositions[0] = mX.data();
+        mPositions[1] = mY.data();
+        mPositions[2] = mZ.data();
+        mIndices      = mIndexStorage.data();
+        mNumVertices  = positions.size();
+        mNumTriangles = indices.size() / 3;
+
+        update();
+    }
+
+    TriangleMesh::TriangleMesh(std::vector<float>&& x, std::vector<float>&& y, std::vector<float>&& z,
+                               std::vector<uint32_t>&& indices)
+        : mX(std::move(x))
+        , mY(std::move(y))
+        , mZ(std::move(z))
+        , mIndexStorage(std::move(indices))
+    {
+        mPositions[0] = mX.data();
+        mPositions[1] = mY.data();
+        mPositions[2] = mZ.data();
+        mIndices      = mIndexStorage.data();
+        mNumVertices  = mX.size();
+        mNumTriangles = mIndexStorage.size() / 3;
+
+        update();
+    }
+
+    TriangleMesh::TriangleMesh(const float* x, const float* y, const float* z, uint32_t numVertices,
+                               const uint32_t* indices, uint32_t numTriangles)
+        : mIndices(indices)
+        , mNumVertices(numVertices)
+        , mNumTriangles(numTriangles)
+    {
+        mPositions[0] = x;
+        mPositions[1] = y;
+        mPositions[2] = z;
+
+        update();
+    }
+
+    void TriangleMesh::update() {
+        mAABB = AABB3f();
+        for (uint32_t i = 0; i < mNumTriangles; ++i) {
+            mAABB = box_union(mAABB, primitiveAABB(i));
+        }
+    }
+
+    AABB3f TriangleMesh::aabb() const {
+        return mAABB;
+    }
+
+    uint64_t TriangleMesh::contentHash(uint64_t seed) const {
+        for (uint32_t axis = 0; axis < 3; ++axis) {
+            seed = hashBytes(mPositions[axis], mNumVertices * sizeof(float), seed);
+        }
+        return hashBytes(mIndices, 3 * mNumTriangles * sizeof(uint32_t), seed);
+    }
+
+    uint32_t TriangleMesh::numPrimitives() const {
+        return mNumTriangles;
+    }
+
+    AABB3f TriangleMesh::primitiveAABB(uint32_t primitive) const {
+        const uint32_t* triangle = mIndices + 3 * primitive;
+
+        AABB3f box;
+        for (uint32_t axis = 0; axis < 3; ++axis) {
+            const float p0 = mPositions[axis][triangle[0]];
+            const float p1 = mPositions[axis][triangle[1]];
+            const float p2 = mPositions[axis][triangle[2]];
+            box[0][axis] = std::min(p0, std::min(p1, p2));
+            box[1][axis] = std::max(p0, std::max(p1, p2));
+        }
+        return box;
+    }
+
+    bool TriangleMesh::intersectPrimitive(uint32_t primitive, const Ray3f& ray, float tMin, float tMax, HitInfo& info) const {
+        PrimitiveHit hit;
+        if (!TriangleMesh::intersectPrimitive_deferred(primitive, ray, tMin, tMax, hit, info)) {
+            return false;
+        }
+
+        TriangleMesh::computeSurfaceInteraction(primitive, ray, hit, info);
+        return true;
+    }
+
+    bool TriangleMesh::intersectPrimitive_fast(uint32_t primitive, const Ray3f& ray, float tMin, float tMax, float& t) const {
+        float b1;
+        float b2;
+        return intersectTriangle(vertex(primitive, 0), vertex(primitive, 1), vertex(primitive, 2),
+                                 ray, tMin, tMax, t, b1, b2);
+    }
+
+    bool TriangleMesh::intersectPrimitive_deferred(uint32_t primitive, const Ray3f& ray, float tMin, float tMax,
+                                                   PrimitiveHit& hit, HitInfo& info) const {
+        if (!intersectTriangle(vertex(primitive, 0), vertex(primitive, 1), vertex(primitive, 2),
+                               ray, tMin, tMax, hit.t, hit.b1, hit.b2)) {
+            return false;
+        }
+
+        hit.deferred = true;
+        return true;
+    }
+
+    void TriangleMesh::computeSurfaceInteraction(uint32_t primitive, const Ray3f& ray, const PrimitiveHit& hit,
+                                                 HitInfo& info) const {
+        const Vector3f v0 = vertex(primitive, 0);
+        const Vector3f v1 = vertex(primitive, 1);
+        const Vector3f v2 = vertex(primitive, 2);
+        triangleHitInfo(ray, hit, normalize(cross(v1 - v0, v2 - v0)), info);
+    }
+
+    void TriangleMesh::splitPrimitiveAABB(uint32_t primitive, const AABB3f& box, uint32_t axis, float position,
+                                          AABB3f& left, AABB3f& right) const {
+        const Vector3f vertices[3] = { vertex(primitive, 0), vertex(primitive, 1), vertex(primitive, 2) };
+        splitTriangleAABB(vertices, box, axis, position, left, right);
+    }
+
+    bool TriangleMesh::primitiveTriangle(uint32_t primitive, Vector3f vertices[3]) const {
+        vertices[0] = vertex(primitive, 0);
+        vertices[1] = vertex(primitive, 1);
+        vertices[2] = vertex(primitive, 2);
+        return true;
+    }
+
+    bool TriangleMesh::intersect(const Ray3f& ray, float tMin, float tMax, HitInfo& info) const {
+        /// Tests every triangle, meshes are meant to be put in a BVH
+        PrimitiveHit hit;
+        bool         found = false;
+        for (uint32_t i = 0; i < mNumTriangles; ++i) {
+            if (TriangleMesh::intersectPrimitive_deferred(i, ray, tMin, tMax, hit, info)) {
+                tMax          = hit.t;
+                hit.primitive = i;
+                found         = true;
+            }
+        }
+
+        if (found) {
+            TriangleMesh::computeSurfaceInteraction(hit.primitive, ray, hit, info);
+        }
+        return found;
+    }
+
+    bool TriangleMesh::intersect_fast(const Ray3f& ray, float tMin, float tMax, float& t) const {
+        for (uint32_t i = 0; i < mNumTriangles; ++i) {
+            if (intersectPrimitive_fast(i, ray, tMin, tMax, t)) {
+                return true;
+            }
+        }
+        return false;
+    }
+}
+}
@@ -4,6 +4,10 @@
 #include <cfloat>
 #include <random>
 
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 namespace mcp
 {
     static const float kEpsilon  = 1e-6f;
@@ -28,6 +32,39 @@ namespace mcp
         return clamp(value, static_cast<T>(0), static_cast<T>(1));
     }
 
+    /// Index of the lowest set bit, x must not be zero
+    inline uint32_t countTrailingZeros(uint32_t x) {
+#if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanForward(&index, x);
+        return static_cast<uint32_t>(index);
+#else
+        return static_cast<uint32_t>(__builtin_ctz(x));
+#endif
+    }
+
+    /// Number of set bits
+    inline uint32_t countBits(uint32_t x) {
+#if defined(_MSC_VER)
+        return static_cast<uint32_t>(__popcnt(x));
+#else
+        return static_cast<uint32_t>(__builtin_popcount(x));
+#endif
+    }
+
+    /// 64-bit FNV-1a hash of a block of memory, chain calls by passing the previous hash as seed
+    inline uint64_t hashBytes(const void* data, size_t size, uint64_t seed = 14695981039346656037ull) {
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        uint64_t hash = seed;
+
+        for (size_t i = 0; i < size; ++i) {
+            hash ^= bytes[i];
+            hash *= 1099511628211ull;
+        }
+
+        return hash;
+    }
+
     inline float random01() {
         static std::random_device rd;
         static std::mt19937 mt(rd());
@@ -3,6 +3,12 @@
 #include <cmath>
 #include <algorithm>
 
+#include "mcp.h"
+
+#if defined(MCP_SSE) || defined(MCP_AVX)
+#include <immintrin.h>
+#endif
+
 namespace mcp
 {
 namespace math
@@ -40,6 +46,8 @@ namespace math
         Vector<T, Dimension> abs() const;
         Vector<T, Dimension> min(const Vector& v) const;
         Vector<T, Dimension> max(const Vector& v) const;
+        /// Exact component-wise 1 / v, e.g. the reciprocal direction of a ray
+        Vector<T, Dimension> rcp() const;
 
         Vector<T, 2>&       vec2();
         const Vector<T, 2>& vec2() const;
@@ -100,6 +108,17 @@ namespace math
         return result;
     }
 
+    /// v1 * v2 + v3 component-wise
+    template <typename T, int Dimension>
+    inline Vector<T, Dimension> multiplyAdd(const Vector<T, Dimension>& v1, const Vector<T, Dimension>& v2,
+                                            const Vector<T, Dimension>& v3) {
+        Vector<T, Dimension> result;
+        for (int i = 0; i < Dimension; ++i) {
+            result[i] = v1[i] * v2[i] + v3[i];
+        }
+        return result;
+    }
+
     template <typename T>
     inline Vector<T, 3> cross(const Vector<T, 3>& v1, const Vector<T, 3>& v2) {
         return Vector<T, 3>(v1.y() * v2.z() - v1.z() * v2.y(),
@@ -213,6 +232,59 @@ namespace math
         return Vector<T, 3>(v1.x() / v2.x(), v1.y() / v2.y(), v1.z() / v2.z());
     }
 
+    /// V4 operators
+    template <typename T>
+    Vector<T, 4> operator+ (T s, const Vector<T, 4>& v) {
+        return Vector<T, 4>(s + v.x(), s + v.y(), s + v.z(), s + v.w());
+    }
+    template <typename T>
+    Vector<T, 4> operator+ (const Vector<T, 4>& v, T s) {
+        return Vector<T, 4>(v.x() + s, v.y() + s, v.z() + s, v.w() + s);
+    }
+    template <typename T>
+    Vector<T, 4> operator+ (const Vector<T, 4>& v1, const Vector<T, 4>& v2) {
+        return Vector<T, 4>(v1.x() + v2.x(), v1.y() + v2.y(), v1.z() + v2.z(), v1.w() + v2.w());
+    }
+
+    template <typename T>
+    Vector<T, 4> operator- (T s, const Vector<T, 4>& v) {
+        return Vector<T, 4>(s - v.x(), s - v.y(), s - v.z(), s - v.w());
+    }
+    template <typename T>
+    Vector<T, 4> operator- (const Vector<T, 4>& v, T s) {
+        return Vector<T, 4>(v.x() - s, v.y() - s, v.z() - s, v.w() - s);
+    }
+    template <typename T>
+    Vector<T, 4> operator- (const Vector<T, 4>& v1, const Vector<T, 4>& v2) {
+        return Vector<T, 4>(v1.x() - v2.x(), v1.y() - v2.y(), v1.z() - v2.z(), v1.w() - v2.w());
+    }
+
+    template <typename T>
+    Vector<T, 4> operator* (T s, const Vector<T, 4>& v) {
+        return Vector<T, 4>(s * v.x(), s * v.y(), s * v.z(), s * v.w());
+    }
+    template <typename T>
+    Vector<T, 4> operator* (const Vector<T, 4>& v, T s) {
+        return Vector<T, 4>(v.x() * s, v.y() * s, v.z() * s, v.w() * s);
+    }
+    template <typename T>
+    Vector<T, 4> operator* (const Vector<T, 4>& v1, const Vector<T, 4>& v2) {
+        return Vector<T, 4>(v1.x() * v2.x(), v1.y() * v2.y(), v1.z() * v2.z(), v1.w() * v2.w());
+    }
+
+    template <typename T>
+    Vector<T, 4> operator/ (T s, const Vector<T, 4>& v) {
+        return Vector<T, 4>(s / v.x(), s / v.y(), s / v.z(), s / v.w());
+    }
+    template <typename T>
+    Vector<T, 4> operator/ (const Vector<T, 4>& v, T s) {
+        return Vector<T, 4>(v.x() / s, v.y() / s, v.z() / s, v.w() / s);
+    }
+    template <typename T>
+    Vector<T, 4> operator/ (const Vector<T, 4>& v1, const Vector<T, 4>& v2) {
+        return Vector<T, 4>(v1.x() / v2.x(), v1.y() / v2.y(), v1.z() / v2.z(), v1.w() / v2.w());
+    }
+
     /////////////////////////////////////////////////////////////////////
 
     template <typename T, int Dimension>
@@ -241,8 +313,9 @@ namespace math
     template <typename T, int Dimension>
     template <int OtherDimension>
     Vector<T, Dimension>::Vector(const Vector<T, OtherDimension>& other) {
-        ((void)(other));
-        // TODO: do this thing
+        for (int i = 0; i < Dimension; ++i) {
+            mData[i] = i < OtherDimension ? other[i] : static_cast<T>(0);
+        }
     }
 
     template <typename T, int Dimension>
@@ -328,7 +401,7 @@ namespace math
     inline Vector<T, Dimension> Vector<T, Dimension>::abs() const {
         Vector<T, Dimension> result;
         for (int i = 0; i < Dimension; ++i) {
-            result[i] = abs(mData[i]);
+            result[i] = std::abs(mData[i]);
         }
         return result;
     }
@@ -351,6 +424,15 @@ namespace math
         return result;
     }
 
+    template <typename T, int Dimension>
+    inline Vector<T, Dimension> Vector<T, Dimension>::rcp() const {
+        Vector<T, Dimension> result;
+        for (int i = 0; i < Dimension; ++i) {
+            result[i] = static_cast<T>(1) / mData[i];
+        }
+        return result;
+    }
+
     template <typename T, int Dimension>
     inline Vector<T, 2>& Vector<T, Dimension>::vec2() {
         return reinterpret_cast<Vector<T, 2>&>(*this);
@@ -394,7 +476,7 @@ namespace math
     template <typename T, int Dimension>
     inline bool Vector<T, Dimension>::isZero(float epsilon) const {
         for (int i = 0; i < Dimension; ++i) {
-            if (abs(mData[i] > epsilon)) return false;
+            if (std::abs(mData[i]) > epsilon) return false;
         }
         return true;
     }
@@ -444,5 +526,212 @@ namespace math
     T& Vector<T, Dimension>::operator[] (int i) {
         return mData[i];
     }
+
+#if defined(MCP_SSE)
+    /// Vector3f keeps its 12 byte layout, nodes, meshes and cache files store it packed.
+    /// Its component-wise operations load it into the low lanes of an SSE register.
+    inline __m128 loadVector3(const Vector<float, 3>& v) {
+        const __m128 xy = _mm_castsi128_ps(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&v)));
+        return _mm_movelh_ps(xy, _mm_load_ss(reinterpret_cast<const float*>(&v) + 2));
+    }
+
+    inline Vector<float, 3> storeVector3(__m128 value) {
+        Vector<float, 3> result;
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(&result), _mm_castps_si128(value));
+        _mm_store_ss(reinterpret_cast<float*>(&result) + 2, _mm_movehl_ps(value, value));
+        return result;
+    }
+
+    /// Operands in the order that returns the same component as std::min and std::max
+    /// for ties and NaNs
+    template <>
+    inline Vector<float, 3> Vector<float, 3>::min(const Vector& v) const {
+        return storeVector3(_mm_min_ps(loadVector3(v), loadVector3(*this)));
+    }
+
+    template <>
+    inline Vector<float, 3> Vector<float, 3>::max(const Vector& v) const {
+        return storeVector3(_mm_max_ps(loadVector3(v), loadVector3(*this)));
+    }
+
+    template <>
+    inline Vector<float, 3> Vector<float, 3>::rcp() const {
+        return storeVector3(_mm_div_ps(_mm_set1_ps(1.f), loadVector3(*this)));
+    }
+
+    /// Vector4f held in an SSE register, 16 byte aligned
+    template <>
+    class alignas(16) Vector<float, 4>
+    {
+    public:
+        static const int kDimension = 4;
+
+        Vector() {}
+        explicit Vector(float x) : mValue(_mm_set1_ps(x)) {}
+        Vector(float x, float y, float z, float w) : mValue(_mm_setr_ps(x, y, z, w)) {}
+        Vector(const Vector<float, 2>& other, float z, float w) : mValue(_mm_setr_ps(other.x(), other.y(), z, w)) {}
+        Vector(const Vector<float, 3>& other, float w) : mValue(_mm_setr_ps(other.x(), other.y(), other.z(), w)) {}
+        explicit Vector(__m128 value) : mValue(value) {}
+        /// Copies the leading components of other, the remaining ones are zero
+        template <int OtherDimension>
+        explicit Vector(const Vector<float, OtherDimension>& other) : mValue(_mm_setzero_ps()) {
+            for (int i = 0; i < OtherDimension && i < kDimension; ++i) {
+                mData[i] = other[i];
+            }
+        }
+
+        float  x() const { return mData[0]; }
+        float  y() const { return mData[1]; }
+        float  z() const { return mData[2]; }
+        float  w() const { return mData[3]; }
+        float& x() { return mData[0]; }
+        float& y() { return mData[1]; }
+        float& z() { return mData[2]; }
+        float& w() { return mData[3]; }
+
+        /// Like the generic set overloads, components not given keep their value
+        void set(float x, float y) {
+            mValue = _mm_shuffle_ps(_mm_setr_ps(x, y, 0.f, 0.f), mValue, _MM_SHUFFLE(3, 2, 1, 0));
+        }
+
+        void set(float x, float y, float z) {
+            mValue = _mm_setr_ps(x, y, z, mData[3]);
+        }
+
+        void set(float x, float y, float z, float w) {
+            mValue = _mm_setr_ps(x, y, z, w);
+        }
+
+        __m128 simd() const {
+            return mValue;
+        }
+
+        Vector abs() const {
+            return Vector(_mm_andnot_ps(_mm_set1_ps(-0.f), mValue));
+        }
+
+        Vector min(const Vector& v) const {
+            return Vector(_mm_min_ps(v.mValue, mValue));
+        }
+
+        Vector max(const Vector& v) const {
+            return Vector(_mm_max_ps(v.mValue, mValue));
+        }
+
+        Vector rcp() const {
+            return Vector(_mm_div_ps(_mm_set1_ps(1.f), mValue));
+        }
+
+        Vector<float, 2>&       vec2()       { return reinterpret_cast<Vector<float, 2>&>(mData); }
+        const Vector<float, 2>& vec2() const { return reinterpret_cast<const Vector<float, 2>&>(mData); }
+        Vector<float, 3>&       vec3()       { return reinterpret_cast<Vector<float, 3>&>(mData); }
+        const Vector<float, 3>& vec3() const { return reinterpret_cast<const Vector<float, 3>&>(mData); }
+
+        Vector<float, 2>  vec2f() const { return Vector<float, 2>(x(), y()); }
+        Vector<double, 2> vec2d() const { return Vector<double, 2>(x(), y()); }
+        Vector<float, 3>  vec3f() const { return Vector<float, 3>(x(), y(), z()); }
+        Vector<double, 3> vec3d() const { return Vector<double, 3>(x(), y(), z()); }
+
+        bool isZero(float epsilon = 1e-5f) const {
+            return _mm_movemask_ps(_mm_cmpgt_ps(abs().mValue, _mm_set1_ps(epsilon))) == 0;
+        }
+
+        bool isNormalized() const {
+            return magnitude() == 1.f;
+        }
+
+        float distance(const Vector& point) const;
+        float squaredDistance(const Vector& point) const;
+
+        Vector normalized() const;
+        float  magnitude() const;
+        float  squaredMagnitude() const;
+
+        float  operator[] (int i) const { return mData[i]; }
+        float& operator[] (int i) { return mData[i]; }
+
+    private:
+        union {
+            __m128 mValue;
+            float  mData[kDimension];
+        };
+    };
+
+    inline Vector<float, 4> operator+ (const Vector<float, 4>& v1, const Vector<float, 4>& v2) {
+        return Vector<float, 4>(_mm_add_ps(v1.simd(), v2.simd()));
+    }
+    inline Vector<float, 4> operator+ (float s, const Vector<float, 4>& v) {
+        return Vector<float, 4>(s) + v;
+    }
+    inline Vector<float, 4> operator+ (const Vector<float, 4>& v, float s) {
+        return v + Vector<float, 4>(s);
+    }
+
+    inline Vector<float, 4> operator- (const Vector<float, 4>& v1, const Vector<float, 4>& v2) {
+        return Vector<float, 4>(_mm_sub_ps(v1.simd(), v2.simd()));
+    }
+    inline Vector<float, 4> operator- (float s, const Vector<float, 4>& v) {
+        return Vector<float, 4>(s) - v;
+    }
+    inline Vector<float, 4> operator- (const Vector<float, 4>& v, float s) {
+        return v - Vector<float, 4>(s);
+    }
+
+    inline Vector<float, 4> operator* (const Vector<float, 4>& v1, const Vector<float, 4>& v2) {
+        return Vector<float, 4>(_mm_mul_ps(v1.simd(), v2.simd()));
+    }
+    inline Vector<float, 4> operator* (float s, const Vector<float, 4>& v) {
+        return Vector<float, 4>(s) * v;
+    }
+    inline Vector<float, 4> operator* (const Vector<float, 4>& v, float s) {
+        return v * Vector<float, 4>(s);
+    }
+
+    inline Vector<float, 4> operator/ (const Vector<float, 4>& v1, const Vector<float, 4>& v2) {
+        return Vector<float, 4>(_mm_div_ps(v1.simd(), v2.simd()));
+    }
+    inline Vector<float, 4> operator/ (float s, const Vector<float, 4>& v) {
+        return Vector<float, 4>(s) / v;
+    }
+    inline Vector<float, 4> operator/ (const Vector<float, 4>& v, float s) {
+        return v / Vector<float, 4>(s);
+    }
+
+    inline float dot(const Vector<float, 4>& v1, const Vector<float, 4>& v2) {
+        const __m128 product = _mm_mul_ps(v1.simd(), v2.simd());
+        const __m128 pairs   = _mm_add_ps(product, _mm_movehl_ps(product, product));
+        return _mm_cvtss_f32(_mm_add_ss(pairs, _mm_shuffle_ps(pairs, pairs, _MM_SHUFFLE(1, 1, 1, 1))));
+    }
+
+    /// Fused when the target has FMA instructions
+    inline Vector<float, 4> multiplyAdd(const Vector<float, 4>& v1, const Vector<float, 4>& v2,
+                                        const Vector<float, 4>& v3) {
+#if defined(MCP_FMA)
+        return Vector<float, 4>(_mm_fmadd_ps(v1.simd(), v2.simd(), v3.simd()));
+#else
+        return v1 * v2 + v3;
+#endif
+    }
+
+    inline float Vector<float, 4>::distance(const Vector& point) const {
+        return (*this - point).magnitude();
+    }
+
+    inline float Vector<float, 4>::squaredDistance(const Vector& point) const {
+        return (*this - point).squaredMagnitude();
+    }
+
+    inline Vector<float, 4> Vector<float, 4>::normalized() const {
+        return *this / magnitude();
+    }
+
+    inline float Vector<float, 4>::magnitude() const {
+        return std::sqrt(squaredMagnitude());
+    }
+
+    inline float Vector<float, 4>::squaredMagnitude() const {
+        return dot(*this, *this);
+    }
+#endif
 }
 }
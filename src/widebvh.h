@@ -0,0 +1,340 @@
+#pragma once
+
+#include "bvh.h"
+#include "util.h"
+
+#if defined(MCP_SSE) || defined(MCP_AVX)
+#include <immintrin.h>
+#endif
+
+namespace mcp
+{
+namespace accelerator
+{
+    using namespace math;
+
+    /// Collapses a binary BVH into nodes with up to Width children whose bounds are
+    /// stored as SoA, so that all children of a node are tested at once. Leaves are
+    /// the leaf nodes of the source BVH, which has to outlive this one.
+    template <uint32_t Width>
+    class WideBVH : public Aggregate
+    {
+    public:
+        explicit WideBVH(const BVH& bvh);
+        ~WideBVH();
+
+        bool intersect(const Ray3f& ray, float tMin, float tMax, HitInfo& info) const override;
+        bool intersect_fast(const Ray3f& ray, float tMin, float tMax, float& t) const override;
+        AABB3f aabb() const override;
+
+        /// Same as above for a ray prepared by the caller, a hit moves ray.tMax to its distance
+        bool intersect(TraversalRay& ray, HitInfo& info) const;
+        bool intersect_fast(const TraversalRay& ray, float& t) const;
+
+    private:
+        template <uint32_t W, typename Q>
+        friend class CompressedBVH;
+
+        static const uint32_t kEmptyChild = 0xFFFFFFFF;
+        static const uint32_t kLeafFlag   = 0x80000000;
+        static const uint32_t kStackSize  = BVH::kTraversalStackSize * (Width - 1) + 1;
+
+        struct alignas(32) WideNode {
+            /// minX, minY, minZ, maxX, maxY, maxZ of every child
+            float    bounds[6][Width];
+            /// Wide node index, or BVH leaf node index | kLeafFlag, or kEmptyChild
+            uint32_t children[Width];
+        };
+
+        struct StackEntry {
+            uint32_t child;
+            float    tNear;
+        };
+
+        uint32_t collapse(uint32_t bvhNode, uint32_t* offset);
+        uint32_t countNodes(uint32_t bvhNode) const;
+        uint32_t gatherChildren(uint32_t bvhNode, uint32_t* children) const;
+
+        uint32_t intersectChildren(const WideNode& node, const TraversalRay& ray, float* tNear) const;
+
+        /// With AnyHit set the traversal stops at the first leaf that reports a hit. Closest
+        /// hit leaf functions shrink ray.tMax through their own reference to the ray.
+        template <bool AnyHit, typename LeafFunc>
+        bool traverse(const TraversalRay& ray, const LeafFunc& leafFunc) const;
+
+        const BVH& mBVH;
+        WideNode*  mNodes;
+        uint32_t   mNumNodes;
+        uint32_t   mRoot;
+    };
+
+    typedef WideBVH<4> BVH4;
+    typedef WideBVH<8> BVH8;
+
+    template <uint32_t Width>
+    WideBVH<Width>::WideBVH(const BVH& bvh)
+        : mBVH(bvh)
+        , mNodes(nullptr)
+        , mNumNodes(0)
+        , mRoot(kEmptyChild)
+    {
+        if (!mBVH.mNodes) {
+            return;
+        }
+
+        mNumNodes = countNodes(0);
+        mNodes    = memory::allocAligned<WideNode>(mNumNodes);
+
+        uint32_t offset = 0;
+        mRoot = collapse(0, &offset);
+    }
+
+    template <uint32_t Width>
+    WideBVH<Width>::~WideBVH() {
+        memory::freeAligned(mNodes);
+    }
+
+    template <uint32_t Width>
+    AABB3f WideBVH<Width>::aabb() const {
+        return mBVH.aabb();
+    }
+
+    template <uint32_t Width>
+    uint32_t WideBVH<Width>::gatherChildren(uint32_t bvhNode, uint32_t* children) const {
+        const BVH::BVHLinearNode* nodes = mBVH.mNodes;
+
+        if (nodes[bvhNode].numShapes > 0) {
+            children[0] = bvhNode;
+            return 1;
+        }
+
+        children[0] = bvhNode + 1;
+        children[1] = nodes[bvhNode].secondChildOffset;
+        uint32_t numChildren = 2;
+
+        /// Keep opening the interior child with the largest surface area
+        while (numChildren < Width) {
+            int32_t best     = -1;
+            float   bestArea = -1.f;
+
+            for (uint32_t i = 0; i < numChildren; ++i) {
+                const BVH::BVHLinearNode& child = nodes[children[i]];
+                if (child.numShapes == 0 && child.aabb.surfaceArea() > bestArea) {
+                    best     = i;
+                    bestArea = child.aabb.surfaceArea();
+                }
+            }
+
+            if (best < 0) {
+                break;
+            }
+
+            const uint32_t opened = children[best];
+            children[best]        = opened + 1;
+            children[numChildren++] = nodes[opened].secondChildOffset;
+        }
+
+        return numChildren;
+    }
+
+    template <uint32_t Width>
+    uint32_t WideBVH<Width>::countNodes(uint32_t bvhNode) const {
+        uint32_t children[Width];
+        const uint32_t numChildren = gatherChildren(bvhNode, children);
+
+        uint32_t count = 1;
+        for (uint32_t i = 0; i < numChildren; ++i) {
+            if (mBVH.mNodes[children[i]].numShapes == 0) {
+                count += countNodes(children[i]);
+            }
+        }
+
+        return count;
+    }
+
+    template <uint32_t Width>
+    uint32_t WideBVH<Width>::collapse(uint32_t bvhNode, uint32_t* offset) {
+        const uint32_t myOffset = (*offset)++;
+
+        uint32_t children[Width];
+        const uint32_t numChildren = gatherChildren(bvhNode, children);
+
+        for (uint32_t i = 0; i < Width; ++i) {
+            /// Empty slots get an inverted box that no ray can hit
+            AABB3f box;
+            uint32_t child = kEmptyChild;
+
+            if (i < numChildren) {
+                const BVH::BVHLinearNode& node = mBVH.mNodes[children[i]];
+                box   = node.aabb;
+                child = node.numShapes > 0 ? (children[i] | kLeafFlag) : collapse(children[i], offset);
+            }
+
+            for (uint32_t axis = 0; axis < 3; ++axis) {
+                mNodes[myOffset].bounds[axis][i]     = box.min()[axis];
+                mNodes[myOffset].bounds[axis + 3][i] = box.max()[axis];
+            }
+            mNodes[myOffset].children[i] = child;
+        }
+
+        return myOffset;
+    }
+
+    template <uint32_t Width>
+    uint32_t WideBVH<Width>::intersectChildren(const WideNode& node, const TraversalRay& ray, float* tNear) const {
+        uint32_t mask = 0;
+
+        for (uint32_t i = 0; i < Width; ++i) {
+            float t0 = ray.tMin;
+            float t1 = ray.tMax;
+
+            for (uint32_t axis = 0; axis < 3; ++axis) {
+                const float nearT = (node.bounds[axis + 3 * ray.dirIsNeg[axis]][i]       - ray.ray.origin()[axis]) * ray.invDir[axis];
+                const float farT  = (node.bounds[axis + 3 * (1 - ray.dirIsNeg[axis])][i] - ray.ray.origin()[axis]) * ray.invDir[axis] * kBoxFarScale;
+                t0 = std::max(t0, nearT);
+                t1 = std::min(t1, farT);
+            }
+
+            tNear[i] = t0;
+            mask |= static_cast<uint32_t>(t0 <= t1) << i;
+        }
+
+        return mask;
+    }
+
+#if defined(MCP_SSE)
+    template <>
+    uint32_t WideBVH<4>::intersectChildren(const WideNode& node, const TraversalRay& ray, float* tNear) const {
+        __m128 t0 = _mm_set1_ps(ray.tMin);
+        __m128 t1 = _mm_set1_ps(ray.tMax);
+
+        for (uint32_t axis = 0; axis < 3; ++axis) {
+            const __m128 origin = _mm_set1_ps(ray.ray.origin()[axis]);
+            const __m128 invDir = _mm_set1_ps(ray.invDir[axis]);
+            const __m128 farDir = _mm_set1_ps(ray.invDir[axis] * kBoxFarScale);
+            const __m128 nearB  = _mm_load_ps(node.bounds[axis + 3 * ray.dirIsNeg[axis]]);
+            const __m128 farB   = _mm_load_ps(node.bounds[axis + 3 * (1 - ray.dirIsNeg[axis])]);
+
+            t0 = _mm_max_ps(t0, _mm_mul_ps(_mm_sub_ps(nearB, origin), invDir));
+            t1 = _mm_min_ps(t1, _mm_mul_ps(_mm_sub_ps(farB,  origin), farDir));
+        }
+
+        _mm_storeu_ps(tNear, t0);
+        return static_cast<uint32_t>(_mm_movemask_ps(_mm_cmple_ps(t0, t1)));
+    }
+#endif
+
+#if defined(MCP_AVX)
+    template <>
+    uint32_t WideBVH<8>::intersectChildren(const WideNode& node, const TraversalRay& ray, float* tNear) const {
+        __m256 t0 = _mm256_set1_ps(ray.tMin);
+        __m256 t1 = _mm256_set1_ps(ray.tMax);
+
+        for (uint32_t axis = 0; axis < 3; ++axis) {
+            const __m256 origin = _mm256_set1_ps(ray.ray.origin()[axis]);
+            const __m256 invDir = _mm256_set1_ps(ray.invDir[axis]);
+            const __m256 farDir = _mm256_set1_ps(ray.invDir[axis] * kBoxFarScale);
+            const __m256 nearB  = _mm256_load_ps(node.bounds[axis + 3 * ray.dirIsNeg[axis]]);
+            const __m256 farB   = _mm256_load_ps(node.bounds[axis + 3 * (1 - ray.dirIsNeg[axis])]);
+
+            t0 = _mm256_max_ps(t0, _mm256_mul_ps(_mm256_sub_ps(nearB, origin), invDir));
+            t1 = _mm256_min_ps(t1, _mm256_mul_ps(_mm256_sub_ps(farB,  origin), farDir));
+        }
+
+        _mm256_storeu_ps(tNear, t0);
+        return static_cast<uint32_t>(_mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ)));
+    }
+#endif
+
+    template <uint32_t Width>
+    template <bool AnyHit, typename LeafFunc>
+    bool WideBVH<Width>::traverse(const TraversalRay& ray, const LeafFunc& leafFunc) const {
+        if (!mNodes) {
+            return false;
+        }
+
+        bool hit = false;
+
+        uint32_t   todoOffset = 0;
+        StackEntry todo[kStackSize];
+        todo[todoOffset++] = { mRoot, ray.tMin };
+
+        while (todoOffset > 0) {
+            const StackEntry entry = todo[--todoOffset];
+
+            /// A closer hit was found since this entry was pushed
+            if (entry.tNear > ray.tMax) {
+                continue;
+            }
+
+            if (entry.child & kLeafFlag) {
+                if (leafFunc(mBVH.mNodes[entry.child & ~kLeafFlag])) {
+                    if (AnyHit) {
+                        return true;
+                    }
+                    hit = true;
+                }
+                continue;
+            }
+
+            const WideNode& node = mNodes[entry.child];
+
+            float    tNear[Width];
+            uint32_t mask = intersectChildren(node, ray, tNear);
+
+            /// Sort the hit children by entry distance and push the farthest first
+            StackEntry hits[Width];
+            uint32_t   numHits = 0;
+            while (mask) {
+                const uint32_t i = countTrailingZeros(mask);
+                mask &= mask - 1;
+
+                StackEntry hitEntry = { node.children[i], tNear[i] };
+                uint32_t   j        = numHits++;
+                while (j > 0 && hits[j - 1].tNear < hitEntry.tNear) {
+                    hits[j] = hits[j - 1];
+                    --j;
+                }
+                hits[j] = hitEntry;
+            }
+
+            for (uint32_t i = 0; i < numHits; ++i) {
+                todo[todoOffset++] = hits[i];
+            }
+        }
+
+        return hit;
+    }
+
+    template <uint32_t Width>
+    bool WideBVH<Width>::intersect(const Ray3f& ray, float tMin, float tMax, HitInfo& info) const {
+        TraversalRay traversalRay(ray, tMin, tMax);
+        return intersect(traversalRay, info);
+    }
+
+    template <uint32_t Width>
+    bool WideBVH<Width>::intersect_fast(const Ray3f& ray, float tMin, float tMax, float& t) const {
+        return intersect_fast(TraversalRay(ray, tMin, tMax), t);
+    }
+
+    template <uint32_t Width>
+    bool WideBVH<Width>::intersect(TraversalRay& ray, HitInfo& info) const {
+        PrimitiveHit closest;
+        const bool hit = traverse<false>(ray, [&](const BVH::BVHLinearNode& leaf) {
+            return mBVH.intersectLeaf(leaf.firstShapeOffset, leaf.numShapes, ray, closest, info);
+        });
+
+        if (hit && closest.deferred) {
+            mBVH.deferredHitInfo(ray.ray, closest, info);
+        }
+        return hit;
+    }
+
+    template <uint32_t Width>
+    bool WideBVH<Width>::intersect_fast(const TraversalRay& ray, float& t) const {
+        return traverse<true>(ray, [&](const BVH::BVHLinearNode& leaf) {
+            return mBVH.intersectLeaf_fast(leaf.firstShapeOffset, leaf.numShapes, ray, t);
+        });
+    }
+}
+}